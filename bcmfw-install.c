@@ -24,14 +24,24 @@
  */
 
 /*
- * bcmfw-install [source-dir]
+ * bcmfw-install [-z] [source-dir]
+ * bcmfw-install -e [firmware-dir]
  *
  * search for the *.inf file [in the directory given], parse
- * it to discover which devices have PatchRAM files, copy them to
- * the libdata directory for each device.
+ * it to discover which devices have PatchRAM files, and store each
+ * distinct file once in the libdata directory, named by its SHA-256
+ * digest and along with a precompiled form, with the original names
+ * linked to it. The index gives the digest and CRC32C for each device,
+ * and all of the precompiled files are packed into a single indexed
+ * file.
+ * With -z, the files are stored compressed.
+ *
+ * With -e, C source for a table of the installed firmware is written
+ * to stdout instead, to be built in to bcmfw.
  */
 
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <ctype.h>
 #include <dirent.h>
@@ -45,395 +55,248 @@
 #include <unistd.h>
 #include <util.h>
 
-struct line {
-	char *		text;
-	struct line *	next;
-};
-
-struct section {
-	char *		name;
-	struct line *	lines;
-	struct section *next;
-};
-
-struct model {
-	unsigned int	vid;
-	unsigned int	pid;
-	char *		file;
-	struct model *	next;
-};
+#include "bcmfw.h"
+#include "inf.h"
 
 static const char	fwdir[] = BCMFW_DIR;
 
-static struct section *	sections;
-static struct model *	models;
-static int		nmodels;
 static int		nfiles;
+static int		nprecompiled;
+static int		nlinks;
+static bool		compress;
+
+/*
+ * Each distinct firmware file is stored once, named by its digest, and
+ * every file name that has the same contents is a hard link to it.
+ */
+struct blob {
+	struct blob *	next;
+	char *		file;	/* source file name */
+	char		digest[BLOB_DIGESTLEN + 1];
+	uint32_t	crc;
+};
 
-static char *		DriverDate;
-static char *		DriverVersion;
-static unsigned int	VendorID;
-static unsigned int	ProductID;
+static struct blob *	blobs;
 
+/*
+ * Make the precompiled form of a PatchRAM file, unless a good one is
+ * already installed. The file is checked in full while doing this, so
+ * that bcmfw does not need to parse anything at boot time.
+ */
 static void
-line_add(struct section *s, uint8_t *ptr, size_t len)
+fw_precompile(const char *file, const char *path)
 {
-	struct line *l;
+	struct fwb fw;
+
+	if (fwb_open(&fw, path) == 0) {
+		fwb_close(&fw);
+		return;
+	}
 
-	l = emalloc(sizeof(struct line));
-	l->text = estrndup((char *)ptr, len);
-	l->next = s->lines;
-	s->lines = l;
+	if (fwb_write(file, path, compress))
+		nprecompiled++;
 }
 
-static struct section *
-section_add(uint8_t *ptr, size_t len)
+/*
+ * Find the SHA-256 digest and CRC32C of a file.
+ */
+static bool
+fw_digest(const char *file, struct blob *b)
 {
-	struct section *s;
+	uint8_t buf[65536], digest[SHA256_LEN];
+	struct sha256 ctx;
+	size_t n;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (f == NULL)
+		return false;
 
-	for (s = sections; s != NULL; s = s->next) {
-		if (strncasecmp(s->name, (char *)ptr, len) == 0
-		    && s->name[len] == '\0')
-			return s;
+	sha256_init(&ctx);
+	b->crc = 0;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+		sha256_update(&ctx, buf, n);
+		b->crc = crc32c(b->crc, buf, n);
 	}
 
-	s = emalloc(sizeof(struct section));
-	s->name = estrndup((char *)ptr, len);
-	s->lines = NULL;
-	s->next = sections;
-	sections = s;
+	if (ferror(f)) {
+		fclose(f);
+		return false;
+	}
 
-	return s;
+	fclose(f);
+	sha256_final(&ctx, digest);
+	digest_hex(b->digest, digest, sizeof(digest));
+	return true;
 }
 
+/*
+ * Copy a file, compressing it if wanted.
+ */
 static void
-model_add(unsigned int vid, unsigned int pid, char *file)
+fw_copy(FILE *s, FILE *d)
 {
-	struct model *m, **p;
-
-	for (p = &models, m = *p; m != NULL; p = &m->next, m = *p) {
-		if (vid == m->vid && pid == m->pid)
-			return;	/* ignore dupes */
-
-		if (vid == m->vid && pid < m->pid)
-			break;
+	uint8_t *buf;
+	size_t len, size, n;
+	int ch;
 
-		if (vid < m->vid)
-			break;
-	}
+	if (!compress) {
+		while ((ch = fgetc(s)) != EOF)
+			fputc(ch, d);
 
-	if (file[0] == '"') {
-		*strrchr(file, '"') = '\0';
-		file++;
+		return;
 	}
 
-	m = emalloc(sizeof(struct model));
-	m->vid = vid;
-	m->pid = pid;
-	m->file = estrdup(file);
+	buf = NULL;
+	len = 0;
+	size = 0;
+	do {
+		if (len == size) {
+			size = MAX(size * 2, 65536);
+			buf = erealloc(buf, size);
+		}
 
-	m->next = *p;
-	*p = m;
+		n = fread(buf + len, 1, size - len, s);
+		len += n;
+	} while (n > 0);
 
-	nmodels++;
+	lz_fwrite(d, buf, len);
+	free(buf);
 }
 
 /*
- * Read the .INF file. The rules we follow here are
- *	a. max line length is 4096 bytes
- *	b. <esc><esc> is not <esc>
- *	c. <esc><end-of-line> is skipped
- *	d. leading <space> is skipped
- *	e. trailing <space> is skipped
- *	f. <quote> % <quote> is not <stringkey>
- *	g. <quote> ; <quote> is not <semicolon>
- *	h. <stringkey> " <stringkey> is not <quote>
- *	i. <stringkey> ; <stringkey> is not <semicolon>
- *	j. all chars after <semicolon> are skipped
- *	k. empty lines are skipped
+ * Make a file name refer to the stored copy, unless it already does.
  */
 static void
-read_inf(const char *name)
+fw_link(const char *blob, const char *path)
 {
-	uint8_t	buf[4096];
-	struct section *section;
-	FILE *	f;
-	size_t	len, space, lineno;
-	bool	esc, quote, comment, stringkey;
-	bool	leading;
-	int	ch;
-
-	f = efopen(name, "r");
-	lineno = 0;
-	section = NULL;
-
-start:
-	len = 0;
-	space = 0;
-
-	esc = false;
-	quote = false;
-	comment = false;
-	stringkey = false;
-
-	leading = true;
-
-	lineno++;
-
-	while (len < __arraycount(buf)) {
-		ch = fgetc(f);
-		if (ch == '\n' || ch == EOF) {
-			if (esc) {
-				if (!comment)
-					len--;	/* drop <backslash> */
-
-				if (ch == '\n') {
-					esc = false;
-					lineno++;
-					continue;
-				}
-			}
-			if (quote)
-				warnx("unterminated quote on line #%zu", lineno);
-			if (stringkey)
-				warnx("unterminated string key on line #%zu", lineno);
-			if (space)
-				len = space;	/* drop trailing spaces */
-			if (ch == EOF) {
-				if (len == 0) {
-					if (ferror(f))
-						warn("Read error on %s", name);
-
-					fclose(f);
-					return;
-				}
-
-				warnx("missing newline at end of file");
-			}
-			if (len == 0)
-				goto start;	/* ignore empty lines */
-			if (buf[0] == '[') {
-				if (buf[len - 1] == ']')
-					section = section_add(buf + 1, len - 2);
-				else {
-					warnx("malformed section header on line #%zu", lineno);
-					section = NULL;
-				}
-			} else if (section != NULL) /* ignore lines with no section */
-				line_add(section, buf, len);
-
-			goto start;
-		}
-		if (ch == ';' && !quote && !stringkey)
-			comment = true;
-		if (ch == '\\')
-			esc = !esc;
-		else
-			esc = false;
+	struct stat sa, sb;
+	char *tmp;
 
-		if (ch == '\r' || comment)
-			continue;
+	if (stat(blob, &sa) == -1)
+		return;
 
-		if (ch == '%' && !quote)
-			stringkey = !stringkey;
-		if (ch == '"' && !stringkey)
-			quote = !quote;
-		if ((ch == '=' || ch == ',') && !quote && !stringkey) {
-			if (space) {
-				len = space;	/* drop spaces */
-				space = 0;
-			}
-			leading = true;
-		} else if ((ch == ' ' || ch == '\t') && !quote && !stringkey) {
-			if (leading)	/* skip leading spaces */
-				continue;
-			if (space == 0)	/* mark start of space */
-				space = len;
-		} else {
-			space = 0;
-			leading = false;
-		}
+	if (stat(path, &sb) == 0
+	    && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino)
+		return;
 
-		buf[len++] = (uint8_t)ch;
+	easprintf(&tmp, "%s.tmp", path);
+	(void)unlink(tmp);
+	if (link(blob, tmp) == -1 || rename(tmp, path) == -1) {
+		warn("%s", path);
+		(void)unlink(tmp);
+	} else {
+		nlinks++;
 	}
 
-	err(EXIT_FAILURE, "line #%zu too long", lineno);
+	free(tmp);
 }
 
-static bool
-section_foreach(const char *name, void (*func)(char **, size_t))
+/*
+ * Store a PatchRAM file under its digest, if it is not there already,
+ * along with its precompiled form. Returns NULL if the file can't be
+ * read.
+ */
+static struct blob *
+fw_store(const char *file)
 {
-	struct section *s;
-	struct line *l;
-	char *av[10], *p, *t, *text, sep;
-	bool quote, stringkey;
-	size_t n;
+	struct blob *b;
+	char *path, *tmp;
+	FILE *s, *d;
 
-	/*
-	 * lookup section
-	 */
-	for (s = sections;; s = s->next) {
-		if (s == NULL)
-			return false;
-
-		if (strcasecmp(s->name, name) == 0)
-			break;
+	for (b = blobs; b != NULL; b = b->next) {
+		if (strcmp(b->file, file) == 0)
+			return b;
 	}
 
-	/*
-	 * parse each line into an arg array
-	 *
-	 *	<0> = <1> [, <2> ... ]
-	 *
-	 * and call the function.
-	 */
-	for (l = s->lines; l; l = l->next) {
-		n = 0;
-		sep = '=';
-		quote = false;
-		stringkey = false;
-
-		t = text = estrdup(l->text);
-		for (p = t; n < __arraycount(av) - 1; p++) {
-			if (*p == '\0') {
-				if (sep == ',')
-					break;
-
-				av[n++] = p;	/* empty key */
-				p = t;		/* restart */
-				sep = ',';
-			}
-			if (*p == '%' && !quote)
-				stringkey = !stringkey;
-			if (*p == '"' && !stringkey)
-				quote = !quote;
-			if (*p == sep && !quote && !stringkey) {
-				*p = '\0';
-				av[n++] = t;
-				t = p + 1;
-				sep = ',';
-			}
-		}
-		av[n++] = t;
-
-		(*func)(av, n);
-		free(text);
+	b = ecalloc(1, sizeof(struct blob));
+	if (!fw_digest(file, b)) {
+		warn("%s", file);
+		free(b);
+		return NULL;
 	}
 
-	return true;
-}
+	b->file = estrdup(file);
+	b->next = blobs;
+	blobs = b;
 
-static void
-each_version(char *av[], size_t n)
-{
-	int d, m, y;
+	easprintf(&path, "%s/%s/%s.hex%s", fwdir, BLOB_DIR, b->digest,
+	    (compress ? LZ_SUFFIX : ""));
+	if (access(path, F_OK) == -1) {
+		s = fopen(file, "r");
+		if (s == NULL)
+			err(EXIT_FAILURE, "%s", file);
+
+		easprintf(&tmp, "%s.tmp", path);
+		d = fopen(tmp, "w");
+		if (d == NULL)
+			err(EXIT_FAILURE, "%s", tmp);
 
-	/*
-	 * Version Section. Match lines in the format of
-	 *
-	 *	DriverVer = <date>, <version>
-	 */
+		fw_copy(s, d);
+		fclose(s);
 
-	if (n > 2 && strcasecmp("DriverVer", av[0]) == 0) {
-		if (sscanf(av[1], "%d/%d/%d", &m, &d, &y) == 3)
-			easprintf(&DriverDate, "%04d-%02d-%02d", y, m, d);
+		if (fclose(d) == EOF || rename(tmp, path) == -1)
+			err(EXIT_FAILURE, "%s", path);
 
-		DriverVersion = estrdup(av[2]);
+		free(tmp);
+		nfiles++;
 	}
-}
+	free(path);
 
-static void
-each_addreg(char *av[], size_t n)
-{
-	/*
-	 * AddReg Section. Match lines in the format of
-	 *
-	 *	<?>,<?>,%RAMPatchFileName%,<flags>,<filename>
-	 *
-	 * and copy the value to RAMPatchFileName
-	 */
-
-	if (n > 5 && strcasecmp(av[3], "%RAMPatchFileName%") == 0)
-		model_add(VendorID, ProductID, av[5]);
-}
+	easprintf(&path, "%s/%s/%s%s%s", fwdir, BLOB_DIR, b->digest,
+	    FWB_SUFFIX, (compress ? LZ_SUFFIX : ""));
+	fw_precompile(file, path);
+	free(path);
 
-static void
-each_hw(char *av[], size_t n)
-{
-	/*
-	 * Match lines in the format of
-	 *
-	 *	AddReg=<addreg-section>
-	 *
-	 * and parse those sections
-	 */
-
-	if (n > 1 && strcasecmp("AddReg", av[0]) == 0)
-		section_foreach(av[1], each_addreg);
+	return b;
 }
 
+/*
+ * Link the installed names for a PatchRAM file, and its precompiled
+ * form, to the stored copies.
+ */
 static void
-each_model(char *av[], size_t n)
+fw_names(const struct blob *b)
 {
-	const char *ext[] = { "", ".nt", ".ntx86", ".ntia64", ".ntamd64" };
-	char name[256];
-	size_t i;
-
-	/*
-	 * Models Section. Match lines in the format of
-	 *
-	 *	<model-description> = <model-section-name>, <usb-device-id>
-	 *
-	 * and parse sections named
-	 *
-	 *	 <model-section-name>[|.nt|.ntx86|.ntia64|.ntamd64].hw
-	 */
-
-	if (n < 3 || sscanf(av[2], "USB\\VID_%4x&PID_%4x", &VendorID, &ProductID) != 2)
-		return;
+	const char *z;
+	char *blob, *path;
+	size_t len;
 
-	for (i = 0; i < __arraycount(ext); i++) {
-		snprintf(name, sizeof(name), "%s%s.hw", av[1], ext[i]);
-		if (section_foreach(name, each_hw))
-			break;
-	}
-}
+	z = (compress ? LZ_SUFFIX : "");
 
-static void
-each_manufacturer(char *av[], size_t n)
-{
-	char name[256];
-	size_t i;
-
-	/*
-	 * Manufacturer Section. Match lines in the format of
-	 *
-	 *	<description> = <manufacturer> [, <target> ...]
-	 *
-	 * parse sections named
-	 *	<manufacturer> <manufacturer>.<target> ...
-	 */
-	if (n < 2 && strlen(av[0]) > 0)
-		return;
-
-	snprintf(name, sizeof(name), "%s", av[1]);
-	for (i = 2;; i++) {
-		section_foreach(name, each_model);
+	easprintf(&blob, "%s/%s/%s.hex%s", fwdir, BLOB_DIR, b->digest, z);
+	easprintf(&path, "%s/%s%s", fwdir, b->file, z);
+	fw_link(blob, path);
+	free(path);
+	free(blob);
 
-		if (i == n)
-			break;
+	len = strlen(b->file);
+	if (len <= 4 || strcasecmp(&b->file[len - 4], ".hex") != 0)
+		return;
 
-		snprintf(name, sizeof(name), "%s.%s", av[1], av[i]);
-	}
+	easprintf(&blob, "%s/%s/%s%s%s", fwdir, BLOB_DIR, b->digest,
+	    FWB_SUFFIX, z);
+	easprintf(&path, "%s/%.*s%s%s", fwdir, (int)(len - 4), b->file,
+	    FWB_SUFFIX, z);
+	fw_link(blob, path);
+	free(path);
+	free(blob);
 }
 
 static void
 fw_install(void)
 {
+	struct pack_model *pm;
 	struct model *m;
+	struct blob *b;
 	char *path;
-	FILE *i, *s, *d;
-	int ch;
+	FILE *i;
+	size_t n;
+
+	easprintf(&path, "%s/%s", fwdir, BLOB_DIR);
+	if (mkdir(path, 0755) == -1 && errno != EEXIST)
+		err(EXIT_FAILURE, "%s", path);
+	free(path);
 
 	easprintf(&path, "%s/index.txt", fwdir);
 	i = fopen(path, "w");
@@ -450,34 +313,196 @@ fw_install(void)
 		    "# Broadcom Driver version %s dated %s\n"
 		    "\n", DriverVersion, DriverDate);
 
+	pm = ecalloc((size_t)nmodels + 1, sizeof(struct pack_model));
+	n = 0;
+
 	for (m = models; m != NULL; m = m->next) {
-		s = fopen(m->file, "r");
-		if (s == NULL) {
-			warn("%s", m->file);
+		pm[n].vid = (uint16_t)m->vid;
+		pm[n].pid = (uint16_t)m->pid;
+		pm[n].file = m->file;
+		n++;
+
+		b = fw_store(m->file);
+		if (b == NULL)
 			continue;
-		}
 
-		easprintf(&path, "%s/%s", fwdir, m->file);
-		d = fopen(path, "wx");
-		if (d == NULL && errno != EEXIST)
-			err(EXIT_FAILURE, "%s", path);
+		fprintf(i, "%04x:%04x\t%s\t%s\t%08x\n", m->vid, m->pid,
+		    m->file, b->digest, b->crc);
+	}
 
-		fprintf(i, "%04x:%04x\t%s\n", m->vid, m->pid, m->file);
-		free(path);
+	fclose(i);
 
-		if (d == NULL)
-			continue;
+	for (b = blobs; b != NULL; b = b->next)
+		fw_names(b);
 
-		while ((ch = fgetc(s)) != EOF)
-			fputc(ch, d);
+	easprintf(&path, "%s/%s", fwdir, PACK_FILE);
+	pack_write(path, fwdir, pm, n);
+	free(path);
+	free(pm);
 
-		fclose(s);
-		fclose(d);
+	while ((b = blobs) != NULL) {
+		blobs = b->next;
+		free(b->file);
+		free(b);
+	}
+}
 
-		nfiles++;
+/*
+ * Firmware built in to bcmfw. A table of the devices in the firmware
+ * pack of an installed directory is written as C source, sorted by
+ * device, with the records of each firmware and the address ranges
+ * that it writes, so that bcmfw can use them as they are.
+ */
+struct embed_dev {
+	uint32_t	key;	/* vid:pid */
+	const char *	name;
+	size_t		off;	/* firmware in the pack */
+	size_t		len;
+	size_t		fw;	/* number of the firmware */
+};
+
+static int
+embed_cmp(const void *a, const void *b)
+{
+	const struct embed_dev *x = a, *y = b;
+
+	if (x->key != y->key)
+		return (x->key < y->key ? -1 : 1);
+
+	return 0;
+}
+
+static void
+embed_string(const char *s)
+{
+
+	putchar('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+
+		if (isprint((unsigned char)*s))
+			putchar(*s);
+		else
+			printf("\\%03o", (unsigned char)*s);
 	}
+	putchar('"');
+}
 
-	fclose(i);
+static void
+fw_embed(const char *dir)
+{
+	struct embed_dev *dev;
+	struct spanmap map;
+	struct pack pk;
+	struct fwb fw;
+	char *path;
+	size_t i, k, n, nfw;
+	uint16_t vid, pid;
+	int rv;
+
+	easprintf(&path, "%s/%s", dir, PACK_FILE);
+	if (pack_open(&pk, path) == -1)
+		errx(EXIT_FAILURE, "%s", pack_error(&pk));
+
+	free(path);
+
+	dev = ecalloc(pk.nentry + 1, sizeof(struct embed_dev));
+	n = 0;
+	for (i = 0; i < pk.nentry; i++) {
+		rv = pack_entry(&pk, i, &vid, &pid, &dev[n].name,
+		    &dev[n].off, &dev[n].len);
+		if (rv == -1)
+			errx(EXIT_FAILURE, "%s", pack_error(&pk));
+
+		dev[n].key = (uint32_t)vid << 16 | pid;
+		n++;
+	}
+
+	qsort(dev, n, sizeof(struct embed_dev), embed_cmp);
+
+	printf("/*\n"
+	       " * THIS FILE AUTOMATICALLY GENERATED - DO NOT EDIT\n"
+	       " *\n"
+	       " * Firmware built in to bcmfw, made by bcmfw-install -e\n"
+	       " * from %s\n"
+	       " */\n"
+	       "\n"
+	       "#include \"bcmfw.h\"\n", dir);
+
+	/* each firmware once, however many devices use it */
+	nfw = 0;
+	for (i = 0; i < n; i++) {
+		for (k = 0; k < i; k++) {
+			if (dev[k].off == dev[i].off)
+				break;
+		}
+
+		if (k < i) {
+			dev[i].fw = dev[k].fw;
+			continue;
+		}
+
+		dev[i].fw = nfw++;
+
+		if (fwb_init(&fw, dev[i].name, pk.buf + dev[i].off,
+		    dev[i].len) == -1)
+			errx(EXIT_FAILURE, "%s", fwb_error(&fw));
+
+		spanmap_init(&map);
+		if (fwb_check(&fw, &map) == -1)
+			errx(EXIT_FAILURE, "%s", fwb_error(&fw));
+
+		printf("\n/* %s */\n", dev[i].name);
+		printf("static const uint8_t fw%zu_rec[] = {", dev[i].fw);
+		for (k = 0; k < fw.len; k++)
+			printf("%s0x%02x,", (k % 12 == 0 ? "\n\t" : " "),
+			    fw.rec[k]);
+		printf("\n};\n\n");
+
+		printf("static const struct span fw%zu_span[] = {\n",
+		    dev[i].fw);
+		for (k = 0; k < map.count; k++)
+			printf("\t{ 0x%08x, %ju },\n", map.span[k].addr,
+			    (uintmax_t)map.span[k].len);
+		printf("};\n");
+
+		printf("\n#define FW%zu\t", dev[i].fw);
+		embed_string(dev[i].name);
+		printf(", fw%zu_rec, sizeof(fw%zu_rec), %zu, %zu, %u, "
+		    "0x%08x, \\\n\tfw%zu_span, __arraycount(fw%zu_span)\n",
+		    dev[i].fw, dev[i].fw, fw.count, fw.nrec, fw.starttype,
+		    fw.start, dev[i].fw, dev[i].fw);
+
+		spanmap_free(&map);
+		fwb_close(&fw);
+	}
+
+	printf("\nconst struct embed embed_table[] = {\n");
+	for (i = 0; i < n; i++)
+		printf("\t{ 0x%04x, 0x%04x, FW%zu },\n",
+		    dev[i].key >> 16, dev[i].key & 0xffff, dev[i].fw);
+	if (n == 0)
+		printf("\t{ 0, 0, NULL, NULL, 0, 0, 0, 0, 0, NULL, 0 },\n");
+	printf("};\n"
+	       "\n"
+	       "const size_t embed_count = %zu;\n", n);
+
+	if (fflush(stdout) == EOF || ferror(stdout))
+		err(EXIT_FAILURE, "stdout");
+
+	free(dev);
+	pack_close(&pk);
+}
+
+static void __dead
+usage(void)
+{
+
+	fprintf(stderr, "usage: %s [-z] [source-dir]\n"
+	    "       %s -e [firmware-dir]\n",
+	    getprogname(), getprogname());
+	exit(EXIT_FAILURE);
 }
 
 int
@@ -485,36 +510,54 @@ main(int argc, char *argv[])
 {
 	struct dirent *de;
 	DIR *dp;
-	int len;
+	bool embed;
+	int ch, len;
+
+	embed = false;
+	while ((ch = getopt(argc, argv, "ez")) != -1) {
+		switch (ch) {
+		case 'e':	/* write firmware table for bcmfw */
+			embed = true;
+			break;
 
-	if (argc > 2)
-		err(EXIT_FAILURE, "usage: %s [source-dir]", getprogname());
+		case 'z':	/* store compressed */
+			compress = true;
+			break;
 
-	if (argc > 1 && chdir(argv[1]) == -1)
-		err(EXIT_FAILURE, "%s", argv[1]);
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+
+	if (embed) {
+		fw_embed(argc > 0 ? argv[0] : fwdir);
+		return 0;
+	}
+
+	if (argc > 0 && chdir(argv[0]) == -1)
+		err(EXIT_FAILURE, "%s", argv[0]);
 
 	dp = opendir(".");
 	if (dp == NULL)
 		err(EXIT_FAILURE, "can't open directory");
 
 	nfiles = 0;
-	nmodels = 0;
+	nprecompiled = 0;
+	nlinks = 0;
 
 	while ((de = readdir(dp)) != NULL) {
 		if ((len = strlen(de->d_name)) > 4
 		    && strcasecmp(&de->d_name[len - 4], ".inf") == 0) {
 
-			models = NULL;
-			sections = NULL;
-			DriverDate = NULL;
-			DriverVersion = NULL;
-
 			read_inf(de->d_name);
-
-			section_foreach("Version", each_version);
-			section_foreach("Manufacturer", each_manufacturer);
-
+			find_models();
 			fw_install();
+			free_inf();
 
 			break;
 		}
@@ -522,8 +565,9 @@ main(int argc, char *argv[])
 
 	closedir(dp);
 
-	printf("%d firmware file%s installed for %d model%s to %s\n",
-	    nfiles, (nfiles == 1 ? "" : "s"),
+	printf("%d firmware file%s installed, %d precompiled, %d linked, "
+	    "for %d model%s to %s\n",
+	    nfiles, (nfiles == 1 ? "" : "s"), nprecompiled, nlinks,
 	    nmodels, (nmodels == 1 ? "" : "s"),
 	    fwdir);
 
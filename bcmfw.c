@@ -23,15 +23,21 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <bluetooth.h>
 #include <err.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <util.h>
 
 #include "bcmfw.h"
+#include "btdev.h"
 
 static const char bcmfw_dir[] = BCMFW_DIR;
+static const char bcmfw_cache[] = BCMFW_CACHE;
 
 int	verbose = 1;
 
@@ -40,40 +46,146 @@ usage(void)
 {
 
 	fprintf(stderr,
-	    "usage: %s [-qv] [-f firmware] [-m mini-driver] [device ...]\n",
+	    "usage: %s [-nqv] [-b downloads] [-f firmware] [-j jobs]"
+	    " [-m mini-driver]\n"
+	    "       [-S settings] [-t trace-file] [device ...]\n",
 	    getprogname()
 	);
 
 	fprintf(stderr,
 	    "Where:\n"
+	    "\t-n              do not use the probe cache\n"
 	    "\t-q              be quiet\n"
 	    "\t-v              be verbose\n"
+	    "\t-b downloads    at once on each USB bus (0 for any)\n"
 	    "\t-f firmware     for BCM2033, via ugen\n"
+	    "\t-j jobs         devices to update at once (0 for all)\n"
 	    "\t-m mini-driver  for BCM2033, via ugen\n"
+	    "\t-S settings     use simulated controllers\n"
+	    "\t-t trace-file   write binary record trace\n"
 	);
 
 	exit(EXIT_FAILURE);
 }
 
+/*
+ * Change to the firmware directory, when a file is first needed, so
+ * that nothing is looked for when all of the firmware is built in.
+ */
+void
+firmware_chdir(void)
+{
+	static bool done;
+
+	if (done)
+		return;
+
+	done = true;
+	if (chdir(bcmfw_dir) == -1)
+		warn("%s", bcmfw_dir);
+}
+
+/*
+ * Check the named devices, or all devices if none are named. Returns
+ * false if any device could not be updated.
+ */
+static bool
+check_btdev(const struct btdev_transport *tp, char (*name)[HCI_DEVNAME_SIZE],
+    size_t n, unsigned int jobs, unsigned int perbus, bool cache)
+{
+	char dev[HCI_DEVNAME_SIZE];
+	unsigned int wall, serial;
+	bool ok;
+
+	if (cache)
+		probe_open(bcmfw_cache);
+
+	if (n == 0) {
+		dev[0] = '\0';
+		while (btdev_next(tp, dev)) {
+			name = erealloc(name, (n + 1) * sizeof(*name));
+			memcpy(name[n++], dev, sizeof(dev));
+		}
+	}
+
+	ok = update_devices(tp, (const char (*)[HCI_DEVNAME_SIZE])name, n,
+	    jobs, perbus, &wall, &serial);
+
+	if (verbose > 1 && n > 1 && jobs != 1) {
+		printf("%zu devices in %u ms, %u ms one at a time",
+		    n, wall, serial);
+		if (wall > 0)
+			printf(" (%.1fx)", (double)serial / wall);
+		printf("\n");
+	}
+
+	free(name);
+	probe_close();
+	firmware_flush();
+	return ok;
+}
+
 int
 main (int argc, char **argv)
 {
-	int ch, n;
-
-	while ((ch = getopt(argc, argv, "f:m:qv")) != -1) {
+	const struct btdev_transport *tp;
+	char (*name)[HCI_DEVNAME_SIZE];
+	const char *trace;
+	unsigned int jobs, perbus;
+	size_t n;
+	bool cache;
+	int ch, rv;
+
+	tp = &btsock_transport;
+	trace = NULL;
+	jobs = 1;
+	perbus = 0;
+	cache = true;
+	while ((ch = getopt(argc, argv, "S:b:f:j:m:nqt:v")) != -1) {
 		switch (ch) {
+		case 'S':	/* simulated controllers */
+			if (btsim_config(optarg) == -1)
+				errx(EXIT_FAILURE, "%s: invalid settings",
+				    optarg);
+
+			tp = &btsim_transport;
+			cache = false;
+			break;
+
+		case 'b':	/* downloads at once on each USB bus */
+			perbus = (unsigned int)strtou(optarg, NULL, 10, 0,
+			    UINT_MAX, &rv);
+			if (rv != 0)
+				errx(EXIT_FAILURE, "%s: invalid limit", optarg);
+			break;
+
 		case 'f':	/* firmware file (BCM2033) */
 			bcm2033_fw = optarg;
 			break;
 
+		case 'j':	/* devices to update at once */
+			jobs = (unsigned int)strtou(optarg, NULL, 10, 0,
+			    UINT_MAX, &rv);
+			if (rv != 0)
+				errx(EXIT_FAILURE, "%s: invalid jobs", optarg);
+			break;
+
 		case 'm':	/* minidriver file (BCM2033) */
 			bcm2033_md = optarg;
 			break;
 
+		case 'n':	/* do not use the probe cache */
+			cache = false;
+			break;
+
 		case 'q':	/* quiet mode */
 			verbose = 0;
 			break;
 
+		case 't':	/* binary trace file */
+			trace = optarg;
+			break;
+
 		case 'v':	/* verbose mode */
 			verbose++;
 			break;
@@ -86,8 +198,10 @@ main (int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (chdir(bcmfw_dir) == -1)
-		warn("%s", bcmfw_dir);
+	if (trace != NULL)
+		trace_open(trace);
+	else if (verbose > 1)
+		trace_open(NULL);
 
 	/*
 	 * For compatibility with previous versions, we allow devices
@@ -95,21 +209,21 @@ main (int argc, char **argv)
 	 * (signifying BCM2033) or a Bluetooth devname. If no devname
 	 * was given, then we check all the adaptors present.
 	 */
+	name = ecalloc((size_t)argc + 1, sizeof(*name));
 	n = 0;
 	while (argc > 0) {
-		if (strncmp(*argv, "ugen", 4) == 0) {
+		if (strncmp(*argv, "ugen", 4) == 0)
 			check_ugen(*argv);
-		} else {
-			check_btdev(*argv);
-			n++;
-		}
+		else
+			snprintf(name[n++], sizeof(*name), "%s", *argv);
 
 		argc--;
 		argv++;
 	}
 
-	if (n == 0)
-		check_btdev(NULL);
+	rv = EXIT_SUCCESS;
+	if (!check_btdev(tp, name, n, jobs, perbus, cache))
+		rv = EXIT_FAILURE;
 
-	return 0;
+	return rv;
 }
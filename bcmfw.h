@@ -24,18 +24,311 @@
  */
 
 #include <sys/param.h>
+#include <sys/stat.h>
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 
 extern const char *	bcm2033_fw;
 extern const char *	bcm2033_md;
 extern int		verbose;
 
+/*
+ * Firmware image, see image.c
+ */
+struct image {
+	uint8_t *	buf;	/* packed records */
+	size_t		len;	/* bytes used */
+	size_t		size;	/* bytes allocated */
+	size_t		count;	/* number of records */
+};
+
+#define IMAGE_HDRLEN		(1 + sizeof(uint32_t))
+#define IMAGE_PARAM(r)		((r) + 1)
+#define IMAGE_PARAMLEN(r)	((r)[0])
+#define IMAGE_ADDR(r)		le32dec((r) + 1)
+#define IMAGE_DATA(r)		((r) + IMAGE_HDRLEN)
+#define IMAGE_DATALEN(r)	((size_t)(r)[0] - sizeof(uint32_t))
+
+#define IMAGE_FOREACH(r, img)						\
+	for ((r) = (img)->buf; (r) < (img)->buf + (img)->len;		\
+	    (r) += 1 + (r)[0])
+
+struct image *image_alloc(void);
+void image_free(struct image *);
+void image_add(struct image *, uint32_t, const uint8_t *, size_t);
+void image_trim(struct image *);
+size_t image_count(const struct image *);
+void image_coalesce(struct image *);
+void image_sort(struct image *);
+
+/*
+ * Address space map, see span.c
+ */
+struct span {
+	uint32_t	addr;
+	uint64_t	len;
+};
+
+struct spanmap {
+	struct span *	span;	/* sorted, disjoint */
+	size_t		count;
+	size_t		size;
+	bool		sorted;	/* ranges were added in order */
+};
+
+void spanmap_init(struct spanmap *);
+void spanmap_free(struct spanmap *);
+int spanmap_add(struct spanmap *, uint32_t, size_t);
+uint64_t spanmap_size(const struct spanmap *);
+
+/*
+ * Intel HEX parser context, see ihex.c
+ */
 struct ihex {
-	struct ihex *	next;
-	uint8_t		count;
-	uint8_t		data[UINT8_MAX];
+	char		name[PATH_MAX];
+	uint8_t *	buf;	/* file contents */
+	uint8_t *	end;
+	uint8_t *	ptr;	/* next character */
+	uint8_t *	bol;	/* start of current line */
+	size_t		line;	/* current line number */
+	bool		mapped;	/* buf is mapped */
+	bool		done;	/* End of File was read */
+	uint8_t		cksum;
+	uint32_t	base;	/* Extended Segment/Linear Address */
+	bool		based;	/* base was set */
+	uint8_t		starttype;	/* Start Address record type, or 0 */
+	uint32_t	start;	/* CS:IP or EIP */
+	size_t		nrec;	/* Data records read */
+	struct spanmap *map;	/* optional, ranges of data read */
+	bool		quiet;	/* records are not traced */
+	uint8_t		rec[UINT8_MAX + 4];	/* current record */
+	const uint8_t *	pend;	/* data not yet returned by ihex_next() */
+	size_t		pendlen;
+	uint32_t	pendaddr;
+	struct lz_stream *lz;	/* compressed, buf is a window on it */
+	size_t		window;	/* size of the window */
+	size_t		size;	/* of the whole contents */
+	int		ioerr;	/* reading the compressed file failed */
+	void		(*observe)(void *, const uint8_t *, size_t);
+	void *		observearg;
+	char		error[PATH_MAX + 128];
+};
+
+int ihex_open(struct ihex *, const char *);
+struct image *ihex_parse(struct ihex *);
+struct image *ihex_parse_parallel(struct ihex *, int);
+int ihex_next(struct ihex *, uint8_t *, size_t *);
+int ihex_check(struct ihex *, struct spanmap *);
+struct image *ihex_image(struct ihex *, struct spanmap *);
+void ihex_observe(struct ihex *, void (*)(void *, const uint8_t *, size_t),
+    void *);
+void ihex_close(struct ihex *);
+const char *ihex_error(const struct ihex *);
+struct image *read_ihex(const char *);
+
+/*
+ * Digests, see digest.c
+ */
+#define SHA256_LEN	32
+#define SHA256_BLOCK	64
+
+struct sha256 {
+	uint32_t	h[8];
+	uint64_t	len;
+	uint8_t		buf[SHA256_BLOCK];
+};
+
+void sha256_init(struct sha256 *);
+void sha256_update(struct sha256 *, const void *, size_t);
+void sha256_final(struct sha256 *, uint8_t *);
+void sha256(const void *, size_t, uint8_t *);
+uint32_t crc32c(uint32_t, const void *, size_t);
+char *digest_hex(char *, const uint8_t *, size_t);
+const char *sha256_engine(void);
+const char *crc32c_engine(void);
+
+/*
+ * Precompiled firmware file, see fwb.c
+ */
+#define FWB_MAGIC	"BFWB"
+#define FWB_VERSION	2
+#define FWB_HDRLEN	64
+#define FWB_SUFFIX	".fwb"
+
+struct fwb {
+	char		name[PATH_MAX];
+	uint8_t *	buf;	/* file contents */
+	size_t		size;
+	bool		mapped;	/* buf is mapped */
+	bool		allocated;	/* buf is allocated */
+	const uint8_t *	rec;	/* packed Write RAM records */
+	size_t		len;
+	size_t		count;	/* number of records */
+	const uint8_t *	ptr;	/* next record */
+	size_t		nrec;	/* Data records in the .hex file */
+	uint8_t		starttype;	/* Start Address record type, or 0 */
+	uint32_t	start;
+	char		error[PATH_MAX + 128];
+};
+
+int fwb_open(struct fwb *, const char *);
+int fwb_init(struct fwb *, const char *, const uint8_t *, size_t);
+int fwb_next(struct fwb *, const uint8_t **, size_t *);
+int fwb_check(struct fwb *, struct spanmap *);
+void fwb_close(struct fwb *);
+const char *fwb_error(const struct fwb *);
+bool fwb_write(const char *, const char *, bool);
+
+/*
+ * Firmware pack, see pack.c
+ */
+#define PACK_FILE	"firmware.pack"
+
+struct pack {
+	char		name[PATH_MAX];
+	struct stat	sb;
+	uint8_t *	buf;	/* mapped file */
+	size_t		size;
+	const uint8_t *	bucket;	/* hash buckets */
+	uint32_t	nbucket;
+	const uint8_t *	entry;	/* index entries */
+	uint32_t	nentry;
+	char		error[PATH_MAX + 128];
+};
+
+struct pack_model {
+	uint16_t	vid;
+	uint16_t	pid;
+	const char *	file;	/* .hex file name */
+};
+
+int pack_open(struct pack *, const char *);
+int pack_find(struct pack *, uint16_t, uint16_t, const char **, size_t *,
+    size_t *);
+int pack_entry(struct pack *, size_t, uint16_t *, uint16_t *, const char **,
+    size_t *, size_t *);
+void pack_close(struct pack *);
+const char *pack_error(const struct pack *);
+bool pack_write(const char *, const char *, const struct pack_model *,
+    size_t);
+
+/*
+ * Content addressed firmware files, named by the SHA-256 digest of the
+ * .hex file, in this directory under BCMFW_DIR
+ */
+#define BLOB_DIR	"sha256"
+#define BLOB_DIGESTLEN	64	/* in hex */
+#define BLOB_CRCLEN	8	/* CRC32C, in hex */
+
+/*
+ * Firmware built in to bcmfw, sorted by device. The table is generated
+ * by bcmfw-install -e from an installed firmware directory, when bcmfw
+ * is built with BCMFW_EMBED.
+ */
+struct embed {
+	uint16_t	vid;
+	uint16_t	pid;
+	const char *	name;	/* .hex file */
+	const uint8_t *	rec;	/* packed Write RAM records */
+	size_t		len;
+	size_t		count;
+	size_t		nrec;
+	uint8_t		starttype;
+	uint32_t	start;
+	const struct span *span;	/* address ranges written */
+	size_t		nspan;
+};
+
+extern const struct embed	embed_table[];
+extern const size_t		embed_count;
+
+/*
+ * Firmware cache, see firmware.c
+ */
+struct firmware {
+	struct firmware *next;
+	unsigned int	refs;
+	char		name[PATH_MAX];	/* for display */
+	char		path[PATH_MAX];	/* file identity */
+	char		digest[BLOB_DIGESTLEN + 1];	/* of .hex file, if known */
+	char		crc[BLOB_CRCLEN + 1];		/* the same */
+	dev_t		dev;
+	ino_t		ino;
+	off_t		size;
+	struct timespec	mtime;
+	size_t		off;	/* offset in the firmware pack */
+	pthread_mutex_t	lock;	/* held while the .hex file is parsed */
+	bool		ready;	/* records are available */
+	const uint8_t *	rec;	/* packed Write RAM records */
+	size_t		len;
+	size_t		count;	/* number of records */
+	size_t		nrec;	/* Data records in the .hex file */
+	uint8_t		starttype;	/* Start Address record type, or 0 */
+	uint32_t	start;
+	struct spanmap	map;	/* address ranges written */
+	struct fwb	fwb;	/* precompiled firmware, if used */
+	struct image *	img;	/* parsed .hex file, if used */
+	const void *	embed;	/* built in firmware, if used */
+	char		error[128];
+};
+
+struct firmware *firmware_open(const char *, const char *, const char *);
+struct firmware *firmware_find(struct pack *, uint16_t, uint16_t);
+struct firmware *firmware_embedded(uint16_t, uint16_t);
+struct firmware *firmware_device(uint16_t, uint16_t);
+int firmware_prepare(struct firmware *, FILE *);
+const char *firmware_error(const struct firmware *);
+void firmware_release(struct firmware *);
+void firmware_flush(void);
+void firmware_stamp(char *);
+
+/*
+ * Compressed files, see lz.c
+ */
+#define LZ_MAGIC	"BFWZ"
+#define LZ_SUFFIX	".lz"
+#define LZ_BLOCK	(64 * 1024)
+
+struct lz_stream {
+	int		fd;
+	size_t		len;	/* of the data, from the header */
+	size_t		off;	/* decoded so far */
+	uint8_t *	in;	/* compressed block */
+};
+
+size_t lz_bound(size_t);
+size_t lz_compress(uint8_t *, const uint8_t *, size_t);
+int lz_decompress(uint8_t *, size_t, const uint8_t *, size_t);
+bool lz_fwrite(FILE *, const uint8_t *, size_t);
+int lz_open(struct lz_stream *, int);
+ssize_t lz_next(struct lz_stream *, uint8_t *);
+int lz_rewind(struct lz_stream *);
+void lz_close(struct lz_stream *);
+int lz_read(int, uint8_t **, size_t *);
+bool lz_name(const char *);
+
+/*
+ * Record trace, see trace.c
+ */
+void trace_open(const char *);
+bool tracing(void);
+void trace_output(FILE *);
+void trace_record(uint8_t, uint32_t, const uint8_t *, size_t);
+void trace_flush(void);
+void trace_close(void);
+
+/*
+ * Hex digit decoding, see hexdec.c
+ */
+struct hex_decoder {
+	const char *	name;
+	bool		(*decode)(uint8_t *, const uint8_t *, size_t, uint8_t *);
 };
 
-struct ihex *read_ihex(const char *);
+bool hex_decode(uint8_t *, const uint8_t *, size_t, uint8_t *);
+const struct hex_decoder *hex_decoders(size_t *);
 
-void check_btdev(const char *);
+void firmware_chdir(void);
 void check_ugen(const char *);
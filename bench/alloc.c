@@ -0,0 +1,100 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Counting versions of the libutil allocators, which take the place of
+ * the library ones so that the benchmarks can report how many
+ * allocations the code under test makes.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+
+#include "bench.h"
+
+size_t	nalloc;
+size_t	alloc_bytes;
+
+void *
+emalloc(size_t n)
+{
+	void *p;
+
+	nalloc++;
+	alloc_bytes += n;
+	if ((p = malloc(n)) == NULL)
+		err(EXIT_FAILURE, "Cannot allocate %zu bytes", n);
+
+	return p;
+}
+
+void *
+ecalloc(size_t n, size_t c)
+{
+	void *p;
+
+	nalloc++;
+	alloc_bytes += n * c;
+	if ((p = calloc(n, c)) == NULL)
+		err(EXIT_FAILURE, "Cannot allocate %zu blocks of size %zu",
+		    n, c);
+
+	return p;
+}
+
+void *
+erealloc(void *p, size_t n)
+{
+	void *q;
+
+	nalloc++;
+	alloc_bytes += n;
+	if ((q = realloc(p, n)) == NULL)
+		err(EXIT_FAILURE, "Cannot re-allocate %zu bytes", n);
+
+	return q;
+}
+
+char *
+estrdup(const char *s)
+{
+
+	return estrndup(s, strlen(s));
+}
+
+char *
+estrndup(const char *s, size_t len)
+{
+	char *d;
+
+	len = strnlen(s, len);
+	d = emalloc(len + 1);
+	memcpy(d, s, len);
+	d[len] = '\0';
+
+	return d;
+}
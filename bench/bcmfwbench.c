@@ -0,0 +1,515 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bcmfwbench [-m max-size] [-t seconds]
+ *
+ * Run the parser benchmarks over generated inputs, and report each
+ * result as one JSON object per line, with the throughput, allocations
+ * per run and peak RSS. Every case runs in a process of its own, so the
+ * RSS is for that case alone.
+ *
+ *	read_ihex	parse a Patch RAM file into an image
+ *	ihex_next	stream a Patch RAM file as Write RAM blocks
+ *	read_inf	read a Windows driver .INF file
+ *	find_models	walk the .INF sections with section_foreach()
+ *	load_hex	build the image of a Patch RAM file, as bcmfw does
+ *	load_hex_lz	the same, from a compressed Patch RAM file
+ *	load_fwb	check and walk a precompiled firmware file
+ *	load_fwb_lz	the same, from a compressed precompiled file
+ *	sha256		SHA-256 digest of a buffer
+ *	crc32c		CRC32C of a buffer
+ *
+ * For the load cases, the bytes are those read from the disk, and the
+ * generated data is partly repetitive so that it compresses about as
+ * well as the real thing.
+ */
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "inf.h"
+#include "bench.h"
+
+int	verbose = 0;
+
+static char	path[] = "/tmp/bcmfwbench.XXXXXX";
+static double	mintime = 0.5;
+static char	*file;		/* for the load cases */
+static uint8_t	*data;		/* for the digest cases */
+static size_t	datalen;
+static volatile uint32_t datacrc;
+
+struct result {
+	int		runs;
+	double		secs;
+	size_t		nalloc;
+	size_t		alloc_bytes;
+};
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Run the function until the minimum time has passed
+ */
+static void
+measure(struct result *r, void (*func)(void))
+{
+	double t0;
+
+	nalloc = 0;
+	alloc_bytes = 0;
+	r->runs = 0;
+
+	t0 = now();
+	do {
+		(*func)();
+		r->runs++;
+	} while (now() - t0 < mintime);
+
+	r->secs = now() - t0;
+	r->nalloc = nalloc;
+	r->alloc_bytes = alloc_bytes;
+}
+
+static void
+report(const char *bench, const char *params, size_t size,
+    const struct result *r)
+{
+	struct rusage ru;
+
+	getrusage(RUSAGE_SELF, &ru);
+
+	printf("{\"bench\":\"%s\",%s,\"bytes\":%zu,\"runs\":%d,"
+	    "\"seconds\":%.6f,\"mb_per_s\":%.1f,"
+	    "\"allocs\":%zu,\"alloc_bytes\":%zu,\"peak_rss_kb\":%ld}\n",
+	    bench, params, size, r->runs, r->secs,
+	    (double)size * r->runs / r->secs / 1e6,
+	    r->nalloc / r->runs, r->alloc_bytes / r->runs,
+	    (long)ru.ru_maxrss);
+	fflush(stdout);
+}
+
+static void
+bench_read_ihex(void)
+{
+	struct image *img;
+
+	img = read_ihex(path);
+	if (img == NULL)
+		err(EXIT_FAILURE, "%s", path);
+
+	image_free(img);
+}
+
+static void
+bench_ihex_next(void)
+{
+	uint8_t buf[UINT8_MAX];
+	struct ihex ih;
+	size_t len;
+	int rv;
+
+	if (ihex_open(&ih, path) == -1)
+		err(EXIT_FAILURE, "%s", path);
+
+	while ((rv = ihex_next(&ih, buf, &len)) == 1)
+		continue;
+
+	if (rv == -1)
+		errx(EXIT_FAILURE, "%s", ihex_error(&ih));
+
+	ihex_close(&ih);
+}
+
+static void
+bench_read_inf(void)
+{
+
+	read_inf(path);
+	free_inf();
+}
+
+static void
+bench_find_models(void)
+{
+
+	read_inf(path);
+	find_models();
+	if (nmodels == 0)
+		errx(EXIT_FAILURE, "no models found");
+
+	free_inf();
+}
+
+static void
+bench_load_hex(void)
+{
+	struct spanmap map;
+	struct image *img;
+	struct ihex ih;
+
+	if (ihex_open(&ih, file) == -1)
+		err(EXIT_FAILURE, "%s", file);
+
+	spanmap_init(&map);
+	img = ihex_image(&ih, &map);
+	if (img == NULL)
+		errx(EXIT_FAILURE, "%s", ihex_error(&ih));
+
+	image_free(img);
+	spanmap_free(&map);
+	ihex_close(&ih);
+}
+
+static void
+bench_load_fwb(void)
+{
+	struct spanmap map;
+	struct fwb fw;
+	const uint8_t *cp;
+	size_t len;
+
+	if (fwb_open(&fw, file) == -1)
+		errx(EXIT_FAILURE, "%s: %s", file, fwb_error(&fw));
+
+	spanmap_init(&map);
+	if (fwb_check(&fw, &map) == -1)
+		errx(EXIT_FAILURE, "%s", fwb_error(&fw));
+
+	while (fwb_next(&fw, &cp, &len) == 1)
+		continue;
+
+	spanmap_free(&map);
+	fwb_close(&fw);
+}
+
+static void
+bench_sha256(void)
+{
+	uint8_t digest[SHA256_LEN];
+
+	sha256(data, datalen, digest);
+}
+
+static void
+bench_crc32c(void)
+{
+
+	datacrc = crc32c(0, data, datalen);
+}
+
+/*
+ * Set the file for the load cases to the generated file with a suffix
+ */
+static const char *
+file_name(const char *suffix)
+{
+
+	free(file);
+	easprintf(&file, "%s%s", path, suffix);
+	return file;
+}
+
+static size_t
+file_size(const char *name)
+{
+	struct stat sb;
+
+	if (stat(name, &sb) == -1)
+		err(EXIT_FAILURE, "%s", name);
+
+	return (size_t)sb.st_size;
+}
+
+/*
+ * Generate a file, and run the benchmarks on it in a child process
+ */
+static void
+ihex_case(size_t size, int recsize, enum ela ela)
+{
+	struct result r;
+	char params[128];
+	FILE *f;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	f = fopen(path, "w");
+	if (f == NULL)
+		err(EXIT_FAILURE, "%s", path);
+
+	size = gen_ihex(f, size, recsize, ela, FILL_RANDOM, 1);
+	fclose(f);
+
+	snprintf(params, sizeof(params),
+	    "\"input\":\"ihex\",\"record\":%d,\"ela\":\"%s\"",
+	    recsize, ela_name(ela));
+
+	measure(&r, bench_read_ihex);
+	report("read_ihex", params, size, &r);
+
+	measure(&r, bench_ihex_next);
+	report("ihex_next", params, size, &r);
+
+	_exit(EXIT_SUCCESS);
+}
+
+static void
+inf_case(int nmodels)
+{
+	struct result r;
+	char params[128];
+	size_t size;
+	FILE *f;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	f = fopen(path, "w");
+	if (f == NULL)
+		err(EXIT_FAILURE, "%s", path);
+
+	size = gen_inf(f, nmodels, 1);
+	fclose(f);
+
+	snprintf(params, sizeof(params),
+	    "\"input\":\"inf\",\"models\":%d", nmodels);
+
+	measure(&r, bench_read_inf);
+	report("read_inf", params, size, &r);
+
+	measure(&r, bench_find_models);
+	report("find_models", params, size, &r);
+
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Generate a Patch RAM file in each of the forms that bcmfw-install
+ * can store, and time loading each of them in a child process
+ */
+static void
+load_case(size_t size)
+{
+	static const struct {
+		const char	*bench;
+		const char	*suffix;
+		void		(*func)(void);
+	} form[] = {
+		{ "load_hex",		"",				bench_load_hex },
+		{ "load_hex_lz",	LZ_SUFFIX,			bench_load_hex },
+		{ "load_fwb",		FWB_SUFFIX,			bench_load_fwb },
+		{ "load_fwb_lz",	FWB_SUFFIX LZ_SUFFIX,		bench_load_fwb },
+	};
+	struct result r;
+	char params[128];
+	uint8_t *buf;
+	size_t i, len;
+	FILE *f;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	f = fopen(path, "w+");
+	if (f == NULL)
+		err(EXIT_FAILURE, "%s", path);
+
+	size = gen_ihex(f, size, 16, ELA_SEGMENT, FILL_CODE, 1);
+
+	buf = emalloc(size);
+	rewind(f);
+	len = fread(buf, 1, size, f);
+	fclose(f);
+
+	for (i = 0; i < __arraycount(form); i++)
+		if (form[i].suffix[0] != '\0')
+			unlink(file_name(form[i].suffix));
+
+	f = fopen(file_name(LZ_SUFFIX), "w");
+	if (f == NULL || !lz_fwrite(f, buf, len) || fclose(f) == EOF)
+		err(EXIT_FAILURE, "%s", file);
+
+	free(buf);
+
+	if (!fwb_write(path, file_name(FWB_SUFFIX), false)
+	    || !fwb_write(path, file_name(FWB_SUFFIX LZ_SUFFIX), true))
+		errx(EXIT_FAILURE, "%s: can't precompile", path);
+
+	for (i = 0; i < __arraycount(form); i++) {
+		file_name(form[i].suffix);
+
+		snprintf(params, sizeof(params),
+		    "\"input\":\"ihex\",\"form\":\"%s\",\"hex_bytes\":%zu",
+		    form[i].bench + 5, size);
+
+		measure(&r, form[i].func);
+		report(form[i].bench, params, file_size(file), &r);
+
+		if (form[i].suffix[0] != '\0')
+			unlink(file);
+	}
+
+	_exit(EXIT_SUCCESS);
+}
+
+/*
+ * Time the digests used to check firmware, with the code that was
+ * chosen for this CPU
+ */
+static void
+digest_case(size_t size)
+{
+	struct result r;
+	char params[128];
+	uint32_t state;
+	size_t i;
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+
+	if (pid > 0) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	data = emalloc(size);
+	datalen = size;
+	state = 1;
+	for (i = 0; i < size; i++)
+		data[i] = (uint8_t)gen_random(&state);
+
+	snprintf(params, sizeof(params),
+	    "\"input\":\"random\",\"engine\":\"%s\"", sha256_engine());
+	measure(&r, bench_sha256);
+	report("sha256", params, size, &r);
+
+	snprintf(params, sizeof(params),
+	    "\"input\":\"random\",\"engine\":\"%s\"", crc32c_engine());
+	measure(&r, bench_crc32c);
+	report("crc32c", params, size, &r);
+
+	_exit(EXIT_SUCCESS);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const size_t sizes[] = {
+		16 * 1024, 1024 * 1024, 16 * 1024 * 1024, 256 * 1024 * 1024
+	};
+	static const int models[] = { 100, 1000, 10000, 50000 };
+	size_t i, max;
+	int ch, fd;
+
+	max = 256 * 1024 * 1024;
+
+	while ((ch = getopt(argc, argv, "m:t:")) != -1) {
+		switch (ch) {
+		case 'm':
+			max = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			mintime = atof(optarg);
+			break;
+
+		default:
+			errx(EXIT_FAILURE, "usage: %s [-m max-size] [-t seconds]",
+			    getprogname());
+		}
+	}
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		err(EXIT_FAILURE, "%s", path);
+
+	close(fd);
+
+	/* the usual Broadcom layout at each size */
+	for (i = 0; i < __arraycount(sizes) && sizes[i] <= max; i++)
+		ihex_case(sizes[i], 16, ELA_SEGMENT);
+
+	/* other record sizes and address patterns, at 1MiB */
+	ihex_case(1024 * 1024, 32, ELA_SEGMENT);
+	ihex_case(1024 * 1024, 0, ELA_SEGMENT);
+	ihex_case(1024 * 1024, 16, ELA_EVERY);
+	ihex_case(1024 * 1024, 0, ELA_SPARSE);
+
+	for (i = 0; i < __arraycount(models); i++)
+		inf_case(models[i]);
+
+	/* each of the stored forms, at the usual sizes */
+	for (i = 0; i < __arraycount(sizes) && sizes[i] <= max; i++)
+		if (sizes[i] <= 16 * 1024 * 1024)
+			load_case(sizes[i]);
+
+	/* checking a large firmware image, and a typical one */
+	digest_case(4 * 1024 * 1024);
+	digest_case(64 * 1024);
+
+	unlink(path);
+	return 0;
+}
@@ -0,0 +1,57 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Shared parts of the benchmarks
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * How Extended Linear Address records are placed in a generated
+ * Patch RAM file
+ */
+enum ela {
+	ELA_SEGMENT,	/* at each 64KiB boundary */
+	ELA_EVERY,	/* before every data record */
+	ELA_SPARSE,	/* data in scattered 64KiB segments */
+};
+
+/*
+ * What the generated Patch RAM data looks like
+ */
+enum fill {
+	FILL_RANDOM,	/* random bytes */
+	FILL_CODE,	/* partly repetitive, like machine code */
+};
+
+uint32_t gen_random(uint32_t *);
+size_t gen_ihex(FILE *, size_t, int, enum ela, enum fill, unsigned int);
+size_t gen_inf(FILE *, int, unsigned int);
+const char *ela_name(enum ela);
+
+extern size_t	nalloc;		/* e*alloc() calls */
+extern size_t	alloc_bytes;	/* bytes requested */
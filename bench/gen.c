@@ -0,0 +1,250 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Synthetic input generators. The output depends only on the arguments,
+ * so that results from different runs can be compared.
+ */
+
+#include <sys/param.h>
+
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+/* a small PRNG, so that the output is the same on every system */
+uint32_t
+gen_random(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return (*state = x);
+}
+
+static void
+put_record(FILE *f, uint8_t count, uint16_t addr, uint8_t type,
+    const uint8_t *data)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	char line[1 + 2 * (4 + UINT8_MAX + 1) + 2], *p;
+	uint8_t cksum;
+	int i;
+
+	cksum = count + (addr >> 8) + (addr & 0xff) + type;
+	p = line;
+	p += snprintf(p, 10, ":%02X%04X%02X", count, addr, type);
+	for (i = 0; i < count; i++) {
+		*p++ = hex[data[i] >> 4];
+		*p++ = hex[data[i] & 0xf];
+		cksum += data[i];
+	}
+	cksum = -cksum;
+	*p++ = hex[cksum >> 4];
+	*p++ = hex[cksum & 0xf];
+	*p++ = '\r';
+	*p++ = '\n';
+
+	fwrite(line, 1, (size_t)(p - line), f);
+}
+
+const char *
+ela_name(enum ela ela)
+{
+
+	switch (ela) {
+	case ELA_SEGMENT:	return "segment";
+	case ELA_EVERY:		return "every";
+	case ELA_SPARSE:	return "sparse";
+	}
+
+	return "unknown";
+}
+
+/*
+ * Make data that compresses about as well as real firmware, by mostly
+ * repeating runs of the data that came shortly before.
+ */
+static void
+gen_code(uint8_t *data, int n, uint8_t *hist, uint32_t *pos,
+    uint32_t *state)
+{
+	uint32_t dist;
+	int i, run;
+
+	dist = 0;
+	run = 0;
+	for (i = 0; i < n; i++) {
+		if (run == 0) {
+			run = 4 + (int)(gen_random(state) % 16);
+			dist = (gen_random(state) % 4 == 0
+			    ? 0 : 1 + gen_random(state) % 255);
+		}
+
+		if (dist == 0)
+			data[i] = (uint8_t)gen_random(state);
+		else
+			data[i] = hist[(*pos - dist) & 0xff];
+
+		hist[(*pos)++ & 0xff] = data[i];
+		run--;
+	}
+}
+
+/*
+ * Write a Patch RAM file of about 'size' bytes. Data records carry
+ * 'recsize' bytes, or a random 1 to 32 bytes when that is 0.
+ */
+size_t
+gen_ihex(FILE *f, size_t size, int recsize, enum ela ela, enum fill fill,
+    unsigned int seed)
+{
+	uint8_t data[UINT8_MAX], hist[256];
+	uint32_t addr, state, pos;
+	size_t len;
+	int i, n;
+
+	state = seed | 1;
+	addr = 0x00210000;
+	len = 0;
+	memset(hist, 0, sizeof(hist));
+	pos = 0;
+
+	while (len < size) {
+		n = recsize;
+		if (n == 0)
+			n = 1 + gen_random(&state) % 32;
+
+		/* records don't cross 64KiB, as in the Broadcom files */
+		if ((addr & 0xffff) + n > 0x10000)
+			n = 0x10000 - (addr & 0xffff);
+
+		if (ela == ELA_EVERY || (addr & 0xffff) == 0) {
+			data[0] = addr >> 24;
+			data[1] = addr >> 16;
+			put_record(f, 2, 0, 0x04, data);
+			len += 2 * (5 + 2) + 3;
+		}
+
+		if (fill == FILL_CODE)
+			gen_code(data, n, hist, &pos, &state);
+		else {
+			for (i = 0; i < n; i++)
+				data[i] = (uint8_t)gen_random(&state);
+		}
+
+		put_record(f, (uint8_t)n, addr & 0xffff, 0x00, data);
+		len += 2 * (5 + n) + 3;
+		addr += n;
+
+		/* move to an unused segment now and then */
+		if (ela == ELA_SPARSE && gen_random(&state) % 256 == 0)
+			addr = (addr & 0xffff0000) + 0x10000
+			    * (1 + gen_random(&state) % 16);
+	}
+
+	put_record(f, 0, 0, 0x01, NULL);
+	len += 13;
+
+	if (ferror(f))
+		err(EXIT_FAILURE, "write");
+
+	return len;
+}
+
+/*
+ * Write a Windows driver .INF file describing 'nmodels' USB devices, in
+ * the same layout as the Broadcom drivers. Each model has a .hw section
+ * with an AddReg section naming one of a smaller number of PatchRAM
+ * files, and there are the usual string keys, comments and continuation
+ * lines to skip over.
+ */
+size_t
+gen_inf(FILE *f, int nmodels, unsigned int seed)
+{
+	static const char *ext[] = { "", ".NT", ".NTx86", ".NTamd64" };
+	uint32_t state;
+	long start;
+	int i, e, nfiles;
+
+	state = seed | 1;
+	nfiles = MAX(nmodels / 16, 1);
+	start = ftell(f);
+
+	fprintf(f,
+	    "; Synthetic Bluetooth driver installation file\r\n"
+	    "\r\n"
+	    "[Version]\r\n"
+	    "Signature   = \"$Windows NT$\"\r\n"
+	    "Class       = Bluetooth\r\n"
+	    "Provider    = %%Provider%%\r\n"
+	    "DriverVer   = 07/20/2017, 12.0.1.1012\r\n"
+	    "\r\n"
+	    "[Manufacturer]\r\n"
+	    "%%Mfg%% = Broadcom, NTx86, NTamd64\r\n"
+	    "\r\n");
+
+	fprintf(f, "[Broadcom.NTamd64]\r\n");
+	for (i = 0; i < nmodels; i++) {
+		fprintf(f, "%%BCM_Model%05d.DeviceDesc%% = BCM_Model%05d, "
+		    "USB\\VID_%04X&PID_%04X ; model %d\r\n",
+		    i, i, 0x0a5c + i / 0x10000, i % 0x10000, i);
+	}
+	fprintf(f, "\r\n");
+
+	for (i = 0; i < nmodels; i++) {
+		e = (int)(gen_random(&state) % __arraycount(ext));
+		fprintf(f,
+		    "[BCM_Model%05d%s.hw]\r\n"
+		    "AddReg = BCM_Model%05d.AddReg\r\n"
+		    "\r\n"
+		    "[BCM_Model%05d.AddReg]\r\n"
+		    "HKR,,%%RAMPatchFileName%%,0x00000000,"
+		    "\"BCM%05d_001.002.014.hex\"\r\n"
+		    "HKR,,SelectiveSuspendEnabled,0x00010001,\\\r\n"
+		    "    0x00000001\r\n"
+		    "\r\n",
+		    i, ext[e], i, i, i % nfiles);
+	}
+
+	fprintf(f, "[Strings]\r\n"
+	    "Provider = \"Broadcom\"\r\n"
+	    "Mfg = \"Broadcom\"\r\n");
+	for (i = 0; i < nmodels; i++) {
+		fprintf(f, "BCM_Model%05d.DeviceDesc = "
+		    "\"Broadcom Bluetooth Device %d; synthetic\"\r\n", i, i);
+	}
+
+	if (ferror(f))
+		err(EXIT_FAILURE, "write");
+
+	return (size_t)(ftell(f) - start);
+}
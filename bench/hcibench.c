@@ -0,0 +1,270 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * hcibench [-s size] [-t seconds]
+ *
+ * Time whole firmware downloads, from the probe to the new firmware
+ * running, to a simulated controller for each of a range of link
+ * latencies, command credits and faults, and report each as one JSON
+ * object per line with the throughput and the median, 99th percentile
+ * and worst time for one download, the Write RAM commands sent again
+ * in each, and the downloads that failed even so. The controller restarts at once after Launch RAM, so
+ * the time is that of the commands alone.
+ */
+
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "btdev.h"
+#include "bench.h"
+
+#define SIM_PRODUCT	0x21e8
+
+int	verbose = 0;
+
+static char	dir[] = "/tmp/hcibench.XXXXXX";
+static double	mintime = 0.5;
+static int	minruns = 20;
+
+struct result {
+	int		runs;
+	double		secs;
+	double *	time;	/* for each run, sorted */
+	size_t		size;
+	unsigned int	resent;
+	int		failed;	/* downloads that gave up */
+};
+
+static double
+now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * The firmware is looked for in the temporary directory
+ */
+void
+firmware_chdir(void)
+{
+	static bool done;
+
+	if (done)
+		return;
+
+	done = true;
+	if (chdir(dir) == -1)
+		err(EXIT_FAILURE, "%s", dir);
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x < y ? -1 : x > y ? 1 : 0);
+}
+
+/*
+ * Download to a new controller each time, until the minimum time has
+ * passed and there are enough runs for the percentiles
+ */
+static void
+measure(struct result *r, const char *settings)
+{
+	struct btdev d;
+	size_t size;
+	double t0, t;
+
+	r->runs = 0;
+	r->resent = 0;
+	r->failed = 0;
+	size = 0;
+
+	t0 = now();
+	do {
+		if (btsim_config(settings) == -1)
+			errx(EXIT_FAILURE, "%s: invalid settings", settings);
+
+		t = now();
+		if (btdev_open(&d, &btsim_transport, "sim0") == -1)
+			errx(EXIT_FAILURE, "sim0: %s", btdev_error(&d));
+
+		switch (btdev_probe(&d)) {
+		case BTDEV_UPDATE:
+			break;
+
+		case -1:
+			errx(EXIT_FAILURE, "sim0: %s", btdev_error(&d));
+
+		default:
+			errx(EXIT_FAILURE, "sim0: not updated");
+		}
+
+		if (btdev_update(&d) == -1)
+			r->failed++;
+
+		r->resent += d.hci.resent;
+		r->size = (size_t)spanmap_size(&d.firmware->map);
+		btdev_close(&d);
+
+		if ((size_t)r->runs == size) {
+			size = MAX(size * 2, 64);
+			r->time = erealloc(r->time, size * sizeof(double));
+		}
+
+		r->time[r->runs++] = now() - t;
+	} while (now() - t0 < mintime || r->runs < minruns);
+
+	r->secs = now() - t0;
+	qsort(r->time, (size_t)r->runs, sizeof(double), cmp_double);
+}
+
+static void
+report(const char *params, const struct result *r)
+{
+	double sum;
+	int i;
+
+	sum = 0;
+	for (i = 0; i < r->runs; i++)
+		sum += r->time[i];
+
+	printf("{\"bench\":\"download\",%s,\"bytes\":%zu,\"runs\":%d,"
+	    "\"seconds\":%.6f,\"mb_per_s\":%.2f,\"p50_ms\":%.3f,"
+	    "\"p99_ms\":%.3f,\"max_ms\":%.3f,\"resent\":%.1f,"
+	    "\"failed\":%d}\n",
+	    params, r->size, r->runs, r->secs,
+	    (double)r->size * r->runs / sum / 1e6,
+	    r->time[r->runs / 2] * 1e3,
+	    r->time[(r->runs * 99) / 100] * 1e3,
+	    r->time[r->runs - 1] * 1e3,
+	    (double)r->resent / r->runs, r->failed);
+	fflush(stdout);
+}
+
+static void
+download_case(unsigned int latency, unsigned int jitter,
+    unsigned int credits, unsigned int fail, unsigned int drop)
+{
+	struct result r;
+	char settings[128], params[128];
+
+	snprintf(settings, sizeof(settings), "latency=%u,jitter=%u,"
+	    "credits=%u,fail=%u,drop=%u,ready=0,product=%#x",
+	    latency, jitter, credits, fail, drop, SIM_PRODUCT);
+
+	snprintf(params, sizeof(params), "\"latency_us\":%u,"
+	    "\"jitter_us\":%u,\"credits\":%u,\"fail\":%u,\"drop\":%u",
+	    latency, jitter, credits, fail, drop);
+
+	memset(&r, 0, sizeof(r));
+	measure(&r, settings);
+	report(params, &r);
+	free(r.time);
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const unsigned int latency[] = { 0, 100, 500, 2000 };
+	static const unsigned int credits[] = { 1, 4, 8 };
+	char *file;
+	size_t i, j, size;
+	FILE *f;
+	int ch;
+
+	size = 64 * 1024;
+
+	while ((ch = getopt(argc, argv, "s:t:")) != -1) {
+		switch (ch) {
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+
+		case 't':
+			mintime = atof(optarg);
+			break;
+
+		default:
+			errx(EXIT_FAILURE, "usage: %s [-s size] [-t seconds]",
+			    getprogname());
+		}
+	}
+
+	if (mkdtemp(dir) == NULL)
+		err(EXIT_FAILURE, "%s", dir);
+
+	easprintf(&file, "%s/patch.hex", dir);
+	f = fopen(file, "w");
+	if (f == NULL)
+		err(EXIT_FAILURE, "%s", file);
+
+	gen_ihex(f, size, 16, ELA_SEGMENT, FILL_CODE, 1);
+	fclose(f);
+	free(file);
+
+	easprintf(&file, "%s/index.txt", dir);
+	f = fopen(file, "w");
+	if (f == NULL)
+		err(EXIT_FAILURE, "%s", file);
+
+	fprintf(f, "0a5c:%04x\tpatch.hex\n", SIM_PRODUCT);
+	fclose(f);
+	free(file);
+
+	/* the link, without and with jitter */
+	for (i = 0; i < __arraycount(latency); i++) {
+		for (j = 0; j < __arraycount(credits); j++) {
+			download_case(latency[i], 0, credits[j], 0, 0);
+			if (latency[i] > 0)
+				download_case(latency[i], latency[i] / 2,
+				    credits[j], 0, 0);
+		}
+	}
+
+	/* faults, which are recovered by sending again */
+	download_case(100, 50, 4, 50, 0);
+	download_case(100, 50, 4, 0, 50);
+	download_case(100, 50, 4, 0, 20);
+
+	firmware_flush();
+	unlink("patch.hex");
+	unlink("index.txt");
+	rmdir(dir);
+	return 0;
+}
@@ -0,0 +1,192 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * hexcheck [-n iterations] [-s seed]
+ *
+ * Check every hex decoder that this CPU can run against the portable
+ * one. Random runs of digits in either case are decoded at every length
+ * up to HEXCHECK_MAX bytes, and from every alignment, then again with
+ * one character that is not a hex digit put at each position in turn.
+ * The decoders must agree on whether the run is valid, on the checksum
+ * and on the bytes. For one run the length of an AVX2 vector, every
+ * byte value is tried at every position. Exits 1 if any case differs.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcmfw.h"
+#include "bench.h"
+
+#define HEXCHECK_MAX	256	/* bytes decoded, at most */
+#define HEXCHECK_ALIGN	32	/* source offsets tried */
+#define HEXCHECK_FULL	32	/* bytes, where every byte value is tried */
+
+int	verbose = 0;
+
+static const struct hex_decoder *decoder;
+static size_t	ndecoder;
+static unsigned long ncase;
+static unsigned long nfail;
+
+static bool
+hex_digit(uint8_t ch)
+{
+
+	return (('0' <= ch && ch <= '9') || ('a' <= ch && ch <= 'f')
+	    || ('A' <= ch && ch <= 'F'));
+}
+
+/*
+ * Decode 'n' bytes from 'src' with each decoder, and compare the result
+ * with that of the portable one.
+ */
+static void
+check(const uint8_t *src, size_t n, const char *what)
+{
+	uint8_t want[HEXCHECK_MAX], got[HEXCHECK_MAX], wsum, gsum;
+	bool wok, gok;
+	size_t i;
+
+	wsum = 0x5a;
+	wok = (*decoder[0].decode)(want, src, n, &wsum);
+
+	for (i = 1; i < ndecoder; i++) {
+		gsum = 0x5a;
+		gok = (*decoder[i].decode)(got, src, n, &gsum);
+		ncase++;
+
+		if (gok == wok && gsum == wsum
+		    && (!gok || memcmp(got, want, n) == 0))
+			continue;
+
+		if (nfail++ >= 10)
+			continue;
+
+		if (gok == wok && gsum == wsum)
+			warnx("%s: %s, %zu bytes: bytes differ from %s",
+			    decoder[i].name, what, n, decoder[0].name);
+		else
+			warnx("%s: %s, %zu bytes: %s, sum 0x%02x"
+			    " where %s gave %s, sum 0x%02x", decoder[i].name,
+			    what, n, (gok ? "valid" : "invalid"), gsum,
+			    decoder[0].name, (wok ? "valid" : "invalid"), wsum);
+	}
+}
+
+static void
+fill(uint8_t *p, size_t len, uint32_t *seed)
+{
+	static const char digit[] = "0123456789abcdefABCDEF";
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		p[i] = (uint8_t)digit[gen_random(seed) % (sizeof(digit) - 1)];
+}
+
+static uint8_t
+non_digit(uint32_t *seed)
+{
+	uint8_t ch;
+
+	do {
+		ch = (uint8_t)gen_random(seed);
+	} while (hex_digit(ch));
+
+	return ch;
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint8_t buf[HEXCHECK_ALIGN + 2 * HEXCHECK_MAX], *src, save;
+	uint32_t seed;
+	size_t i, n, pos;
+	int ch, iter, k;
+
+	iter = 4;
+	seed = 1;
+
+	while ((ch = getopt(argc, argv, "n:s:")) != -1) {
+		switch (ch) {
+		case 'n':
+			iter = atoi(optarg);
+			break;
+
+		case 's':
+			seed = (uint32_t)strtoul(optarg, NULL, 0);
+			if (seed == 0)
+				seed = 1;
+			break;
+
+		default:
+			errx(EXIT_FAILURE, "usage: %s [-n iterations] [-s seed]",
+			    getprogname());
+		}
+	}
+
+	decoder = hex_decoders(&ndecoder);
+	printf("checking");
+	for (i = 1; i < ndecoder; i++)
+		printf(" %s", decoder[i].name);
+
+	printf("%s against %s\n", (ndecoder == 1 ? " nothing" : ""),
+	    decoder[0].name);
+
+	for (k = 0; k < iter; k++) {
+		for (n = 0; n <= HEXCHECK_MAX; n++) {
+			src = buf + (n + (size_t)k) % HEXCHECK_ALIGN;
+			fill(src, 2 * n, &seed);
+			check(src, n, "random");
+
+			for (pos = 0; pos < 2 * n; pos++) {
+				save = src[pos];
+				src[pos] = non_digit(&seed);
+				check(src, n, "invalid");
+				src[pos] = save;
+			}
+		}
+	}
+
+	src = buf;
+	fill(src, 2 * HEXCHECK_FULL, &seed);
+	for (pos = 0; pos < 2 * HEXCHECK_FULL; pos++) {
+		save = src[pos];
+		for (i = 0; i <= UINT8_MAX; i++) {
+			src[pos] = (uint8_t)i;
+			check(src, HEXCHECK_FULL, (hex_digit(src[pos])
+			    ? "every digit" : "every non-digit"));
+		}
+
+		src[pos] = save;
+	}
+
+	printf("%lu cases, %lu failed\n", ncase, nfail);
+	return (nfail == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
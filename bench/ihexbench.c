@@ -0,0 +1,211 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * ihexbench [-j threads] [-n iterations] [-s size]
+ *
+ * Generate a synthetic Patch RAM file of the given size, then time
+ * read_ihex() over it both when the file can be mapped and when it
+ * arrives through a pipe and must be read into memory. With -j, also
+ * time ihex_parse_parallel() for each number of threads up to that
+ * given, and show the speedup over one thread.
+ */
+
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "bench.h"
+
+int	verbose = 0;
+
+static char	path[] = "/tmp/ihexbench.XXXXXX";
+static int	nthreads;
+
+/*
+ * Feed the file to read_ihex() through a pipe, which can't be mapped.
+ */
+static struct image *
+pipe_ihex(void)
+{
+	struct image *img;
+	char name[32];
+	char buf[65536];
+	ssize_t len;
+	pid_t pid;
+	int fd, p[2];
+
+	if (pipe(p) == -1)
+		err(EXIT_FAILURE, "pipe");
+
+	pid = fork();
+	if (pid == -1)
+		err(EXIT_FAILURE, "fork");
+
+	if (pid == 0) {
+		close(p[0]);
+		fd = open(path, O_RDONLY);
+		if (fd == -1)
+			err(EXIT_FAILURE, "%s", path);
+
+		while ((len = read(fd, buf, sizeof(buf))) > 0) {
+			if (write(p[1], buf, (size_t)len) != len)
+				err(EXIT_FAILURE, "write");
+		}
+
+		_exit(EXIT_SUCCESS);
+	}
+
+	close(p[1]);
+	snprintf(name, sizeof(name), "/dev/fd/%d", p[0]);
+	img = read_ihex(name);
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+
+	return img;
+}
+
+static double
+run(const char *name, struct image *(*func)(void), int n, size_t size)
+{
+	struct timeval t0, t1;
+	struct image *img;
+	double secs;
+	int i;
+
+	gettimeofday(&t0, NULL);
+	for (i = 0; i < n; i++) {
+		img = (*func)();
+		if (img == NULL)
+			err(EXIT_FAILURE, "%s", path);
+
+		image_free(img);
+	}
+	gettimeofday(&t1, NULL);
+
+	timersub(&t1, &t0, &t1);
+	secs = t1.tv_sec + t1.tv_usec / 1e6;
+	printf("%-6s %10zu bytes x %-4d %8.3f s %10.1f MB/s",
+	    name, size, n, secs, (double)size * n / secs / 1e6);
+
+	return secs;
+}
+
+static struct image *
+map_ihex(void)
+{
+
+	return read_ihex(path);
+}
+
+static struct image *
+parallel_ihex(void)
+{
+	struct image *img;
+	struct ihex ih;
+
+	if (ihex_open(&ih, path) == -1)
+		return NULL;
+
+	img = ihex_parse_parallel(&ih, nthreads);
+	ihex_close(&ih);
+
+	if (img == NULL)
+		errx(EXIT_FAILURE, "%s", ihex_error(&ih));
+
+	return img;
+}
+
+int
+main(int argc, char *argv[])
+{
+	char name[16];
+	double t1, t;
+	size_t size;
+	FILE *f;
+	int ch, fd, j, n;
+
+	j = 0;
+	n = 10;
+	size = 4 * 1024 * 1024;
+
+	while ((ch = getopt(argc, argv, "j:n:s:")) != -1) {
+		switch (ch) {
+		case 'j':
+			j = atoi(optarg);
+			break;
+
+		case 'n':
+			n = atoi(optarg);
+			break;
+
+		case 's':
+			size = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			errx(EXIT_FAILURE,
+			    "usage: %s [-j threads] [-n iterations] [-s size]",
+			    getprogname());
+		}
+	}
+
+	fd = mkstemp(path);
+	if (fd == -1)
+		err(EXIT_FAILURE, "%s", path);
+
+	f = fdopen(fd, "w");
+	if (f == NULL)
+		err(EXIT_FAILURE, "%s", path);
+
+	size = gen_ihex(f, size, 16, ELA_SEGMENT, FILL_RANDOM, 1);
+	fclose(f);
+
+	run("mmap", map_ihex, n, size);
+	printf("\n");
+	run("pipe", pipe_ihex, n, size);
+	printf("\n");
+
+	t1 = 0;
+	for (nthreads = 1; nthreads <= j; nthreads++) {
+		snprintf(name, sizeof(name), "-j%d", nthreads);
+		t = run(name, parallel_ihex, n, size);
+		if (nthreads == 1)
+			t1 = t;
+
+		printf(" %6.2fx\n", t1 / t);
+	}
+
+	unlink(path);
+	return 0;
+}
@@ -40,8 +40,20 @@
  * firmware files can be accessed.
  */
 
+/*
+ * Each device is driven through a session, which holds everything that
+ * is known about it, so that any number of devices can be open at once.
+ * Nothing here exits; each call returns -1 if it fails, with the reason
+ * in btdev_error(), and the device can then be closed. Only the firmware
+ * and probe caches are shared between sessions.
+ *
+ * The device is reached through a transport, which is the raw HCI socket
+ * (btsock.c) or a simulated controller (btsim.c), so that everything but
+ * the transport can be run and measured without the hardware.
+ */
+
 #include <sys/types.h>
-#include <sys/ioctl.h>
+#include <sys/time.h>
 
 #include <bluetooth.h>
 #include <stdbool.h>
@@ -49,25 +61,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
 #include <util.h>
 
 #include "bcmfw.h"
+#include "btdev.h"
 
-static int		hci;	/* HCI socket */
-static struct bt_devreq	req;	/* HCI requests */
-static struct btreq	btr;	/* HCI ioctl request */
-
-#define	REQ_TIMEOUT	2
 
-static bool		Enabled;	/* if the device was enabled */
-static uint16_t		Manufacturer;	/* device Manufacturer */
-static uint16_t		Revision;	/* HCI revision */
-static uint16_t		VendorID;	/* USB VendorID */
-static uint16_t		ProductID;	/* USB ProductID */
-static uint16_t		BuildNum;	/* Broadcom Firmware version */
-static bdaddr_t		bdaddr;		/* Bluetooth Device Address */
-static struct ihex *	Firmware;	/* loaded firmware */
+#define	REQ_TIMEOUT	2	/* seconds */
+#define	READY_POLL	50	/* milliseconds */
 
 #define BLUETOOTH_MANUFACTURER_BROADCOM		15
 
@@ -88,36 +93,59 @@ static struct ihex *	Firmware;	/* loaded firmware */
 #define BCM_CMD_READ_USB_PRODUCT		0xfc5a
 #define BCM_CMD_READ_VERBOSE_CONFIG		0xfc79
 
-static void __unused
-hci_read_bdaddr(void)
+int
+btdev_fail(struct btdev *d, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(d->error, sizeof(d->error), fmt, ap);
+	va_end(ap);
+
+	return -1;
+}
+
+const char *
+btdev_error(const struct btdev *d)
+{
+
+	return d->error;
+}
+
+static int __unused
+hci_read_bdaddr(struct btdev *d)
 {
+	struct hci_cmd cmd;
 	uint8_t rp[7];	/* [0]	u8	status
 			   [1]	bdaddr	addr		*/
 
-	req = (struct bt_devreq) {
+	cmd = (struct hci_cmd) {
 		.opcode = HCI_CMD_READ_BDADDR,
 		.rparam = &rp,
 		.rlen = sizeof(rp)
 	};
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "HCI Read BDADDR");
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "HCI Read BDADDR: %s", hci_error(&d->hci));
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "HCI Read BDADDR: failed");
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "HCI Read BDADDR: failed");
 
-	bdaddr_copy(&bdaddr, (bdaddr_t *)&rp[1]);
+	bdaddr_copy(&d->bdaddr, (bdaddr_t *)&rp[1]);
 
 	if (verbose > 0) {
-		printf("Read BDADDR:\n");
-		printf("  Address %s\n", bt_ntoa(&bdaddr, NULL));
-		printf("\n");
+		fprintf(d->log, "Read BDADDR:\n");
+		fprintf(d->log, "  Address %s\n", bt_ntoa(&d->bdaddr, NULL));
+		fprintf(d->log, "\n");
 	}
+
+	return 0;
 }
 
-static void
-hci_read_local_version(void)
+static int
+hci_read_local_version(struct btdev *d)
 {
+	struct hci_cmd cmd;
 	uint8_t rp[9];	/* [0]	u8	status
 			   [1]	u8	HCIVersion
 			   [2]	u16	HCIRevision
@@ -125,288 +153,457 @@ hci_read_local_version(void)
 			   [5]	u16	Manufacturer
 			   [7]	u16	LMPSubversion	*/
 
-	req = (struct bt_devreq) {
+	cmd = (struct hci_cmd) {
 		.opcode = HCI_CMD_READ_LOCAL_VER,
 		.rparam = &rp,
 		.rlen = sizeof(rp)
 	};
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "HCI Read Local Version");
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "HCI Read Local Version: %s",
+		    hci_error(&d->hci));
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "HCI Read Local Version: failed");
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "HCI Read Local Version: failed");
 
-	Manufacturer = le16dec(&rp[5]);
-	Revision = le16dec(&rp[2]);
+	d->manufacturer = le16dec(&rp[5]);
+	d->revision = le16dec(&rp[2]);
+	d->subversion = le16dec(&rp[7]);
 
 	if (verbose > 0) {
-		printf("Read Local Version:\n");
-		printf("  Manufacturer %u\n", Manufacturer);
-		printf("  HCI version 0x%02x rev 0x%04x\n", rp[1], Revision);
-		printf("  LMP version 0x%02x sub 0x%04x\n", rp[4], le16dec(&rp[7]));
-		printf("\n");
+		fprintf(d->log, "Read Local Version:\n");
+		fprintf(d->log, "  Manufacturer %u\n", d->manufacturer);
+		fprintf(d->log, "  HCI version 0x%02x rev 0x%04x\n",
+		    rp[1], d->revision);
+		fprintf(d->log, "  LMP version 0x%02x sub 0x%04x\n",
+		    rp[4], d->subversion);
+		fprintf(d->log, "\n");
 	}
+
+	return 0;
 }
 
-static void __unused
-hci_reset(void)
+static int __unused
+hci_reset(struct btdev *d)
 {
+	struct hci_cmd cmd;
 	uint8_t rp[1];	/* [0] u8	status	*/
 
-	req = (struct bt_devreq) {
+	cmd = (struct hci_cmd) {
 		.opcode = HCI_CMD_RESET,
 		.rparam = &rp,
 		.rlen = sizeof(rp)
 	};
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "HCI Reset");
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "HCI Reset: %s", hci_error(&d->hci));
+
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "HCI Reset: failed");
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "HCI Reset: failed");
+	return 0;
 }
 
-static void __unused
-bcm_write_bdaddr(void)
+static int __unused
+bcm_write_bdaddr(struct btdev *d)
 {
+	struct hci_cmd cmd;
 	uint8_t rp[1];	/* [0] u8	status	*/
 
-	req = (struct bt_devreq) {
+	cmd = (struct hci_cmd) {
 		.opcode = BCM_CMD_WRITE_BDADDR,
-		.cparam = &bdaddr,
-		.clen = sizeof(bdaddr),
+		.cparam = &d->bdaddr,
+		.clen = sizeof(d->bdaddr),
 		.rparam = &rp,
 		.rlen = sizeof(rp)
 	};
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "Write BDADDR");
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "Write BDADDR: %s", hci_error(&d->hci));
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "Write BDADDR: failed");
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "Write BDADDR: failed");
 
 	if (verbose > 0) {
-		printf("Write BDADDR:\n");
-		printf("  Address %s\n", bt_ntoa(&bdaddr, NULL));
-		printf("\n");
+		fprintf(d->log, "Write BDADDR:\n");
+		fprintf(d->log, "  Address %s\n", bt_ntoa(&d->bdaddr, NULL));
+		fprintf(d->log, "\n");
 	}
+
+	return 0;
 }
 
-static void
-bcm_read_usb_product(void)
+static int
+bcm_read_usb_product(struct btdev *d)
 {
+	struct hci_cmd cmd;
 	uint8_t	rp[5];	/* [0]	u8	status
 			   [1]	u16	VendorID
 			   [3]	u16	ProductID	*/
 
-	req = (struct bt_devreq) {
+	cmd = (struct hci_cmd) {
 		.opcode = BCM_CMD_READ_USB_PRODUCT,
 		.rparam = &rp,
 		.rlen = sizeof(rp)
 	};
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "Read USB Product");
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "Read USB Product: %s",
+		    hci_error(&d->hci));
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "Read USB Product: failed");
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "Read USB Product: failed");
 
-	VendorID = le16dec(&rp[1]);
-	ProductID = le16dec(&rp[3]);
+	d->vendor = le16dec(&rp[1]);
+	d->product = le16dec(&rp[3]);
 
 	if (verbose > 0) {
-		printf("Read USB Product:\n");
-		printf("  VendorID 0x%04x\n", VendorID);
-		printf("  ProductID 0x%04x\n", ProductID);
-		printf("\n");
+		fprintf(d->log, "Read USB Product:\n");
+		fprintf(d->log, "  VendorID 0x%04x\n", d->vendor);
+		fprintf(d->log, "  ProductID 0x%04x\n", d->product);
+		fprintf(d->log, "\n");
 	}
+
+	return 0;
 }
 
-static void
-bcm_read_verbose_config(void)
+static int
+bcm_read_verbose_config(struct btdev *d)
 {
+	struct hci_cmd cmd;
 	uint8_t rp[7];	/* [0]	u8	status
 			   [1]	u8	ChipID
 			   [2]	u8	TargetID
 			   [3]	u16	BuildBase
 			   [5]	u16	BuildNum	*/
 
-	req = (struct bt_devreq) {
+	cmd = (struct hci_cmd) {
 		.opcode = BCM_CMD_READ_VERBOSE_CONFIG,
 		.rparam = &rp,
 		.rlen = sizeof(rp)
 	};
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "Read Verbose Config");
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "Read Verbose Config: %s",
+		    hci_error(&d->hci));
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "Read Verbose Config: failed");
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "Read Verbose Config: failed");
 
-	BuildNum = le16dec(&rp[5]);
+	d->buildnum = le16dec(&rp[5]);
 
 	if (verbose > 0) {
-		printf("Read Verbose Config:\n");
-		printf("  ChipID 0x%02x\n", rp[1]);
-		printf("  TargetID 0x%02x\n", rp[2]);
-		printf("  BuildBase 0x%04x\n", le16dec(&rp[3]));
-		printf("  BuildNum 0x%04x\n", BuildNum);
-		printf("\n");
+		fprintf(d->log, "Read Verbose Config:\n");
+		fprintf(d->log, "  ChipID 0x%02x\n", rp[1]);
+		fprintf(d->log, "  TargetID 0x%02x\n", rp[2]);
+		fprintf(d->log, "  BuildBase 0x%04x\n", le16dec(&rp[3]));
+		fprintf(d->log, "  BuildNum 0x%04x\n", d->buildnum);
+		fprintf(d->log, "\n");
 	}
+
+	return 0;
 }
 
-static void
-bcm_load_firmware(void)
+/*
+ * Check the whole firmware file before anything is sent to the device,
+ * and show the address ranges that it writes to.
+ */
+static int
+bcm_check_firmware(struct btdev *d)
 {
-	char *line;
-	size_t size;
-	ssize_t len;
-	FILE *i;
-	unsigned int vid, pid;
-	int n;
-
-	i = fopen("index.txt", "r");
-	if (i == NULL)
-		return;
+	const struct firmware *fw;
+	const struct spanmap *map;
+	size_t i;
 
-	line = NULL;
-	size = 0;
+	if (firmware_prepare(d->firmware, d->log) == -1)
+		return btdev_fail(d, "%s", firmware_error(d->firmware));
 
-	while ((len = getline(&line, &size, i)) != EOF) {
-		if (sscanf(line, "%x:%x\t%n%*s\n", &vid, &pid, &n) != 2
-		    || vid != VendorID || pid != ProductID)
-			continue;
+	fw = d->firmware;
+	map = &fw->map;
 
-		line[len - 1] = '\0';
-		Firmware = read_ihex(&line[n]);
-		break;
+	if (verbose > 0) {
+		fprintf(d->log, "Check Firmware:\n");
+		fprintf(d->log, "  %ju bytes in %zu range%s%s\n",
+		    (uintmax_t)spanmap_size(map),
+		    map->count, (map->count == 1 ? "" : "s"),
+		    (map->sorted ? "" : " (out of order)"));
+
+		for (i = 0; i < map->count; i++) {
+			fprintf(d->log, "  0x%08x-0x%08jx\n", map->span[i].addr,
+			    (uintmax_t)(map->span[i].addr + map->span[i].len - 1));
+		}
+
+		if (fw->starttype != 0) {
+			fprintf(d->log, "  Start %s Address 0x%08x\n",
+			    (fw->starttype == 0x03 ? "Segment" : "Linear"),
+			    fw->start);
+		}
+
+		fprintf(d->log, "\n");
 	}
 
-	free(line);
-	fclose(i);
+	return 0;
 }
 
-static void
-bcm_update_device(void)
+/*
+ * Wait for the controller to come back after Launch RAM. It resets to
+ * run the new firmware, which it may announce with a No Operation
+ * Command Complete, and is ready when Read Local Version shows an HCI
+ * revision or LMP subversion that differs from before. That is asked
+ * again until it does or the time runs out, since the old firmware may
+ * still answer for a while. If it never changes, the new firmware did
+ * not start.
+ */
+static int
+bcm_wait_ready(struct btdev *d)
 {
-	struct ihex *ihex;
-	uint8_t cp[4];	/* [0]	u32	addr		*/
-	uint8_t rp[1];	/* [0]	u8	status		*/
+	struct hci_cmd cmd;
+	struct timespec start, now, end, ts;
+	uint16_t revision, subversion;
+	bool answered;
+	uint8_t rp[9];	/* [0]	u8	status
+			   [1]	u8	HCIVersion
+			   [2]	u16	HCIRevision
+			   [4]	u8	LMPVersion
+			   [5]	u16	Manufacturer
+			   [7]	u16	LMPSubversion	*/
 
-	req = (struct bt_devreq) {
-		.opcode = BCM_CMD_DOWNLOAD_MINIDRIVER,
-		.rparam = &rp,
-		.rlen = sizeof(rp)
-	};
+	revision = d->revision;
+	subversion = d->subversion;
+	answered = false;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	ts.tv_sec = REQ_TIMEOUT;
+	ts.tv_nsec = 0;
+	timespecadd(&start, &ts, &end);
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "Download Minidriver");
+	d->hci.timeout = READY_POLL;
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "Download Minidriver: failed");
+	cmd = (struct hci_cmd) {
+		.opcode = HCI_CMD_NOP
+	};
 
-	usleep(100);
+	if (hci_expect(&d->hci, &cmd) == -1 || hci_wait(&d->hci, &cmd) == -1)
+		hci_restart(&d->hci);
 
-	for (ihex = Firmware; ihex != NULL; ihex = ihex->next) {
-		req = (struct bt_devreq) {
-			.opcode = BCM_CMD_WRITE_RAM,
-			.cparam = ihex->data,
-			.clen = ihex->count,
+	for (;;) {
+		cmd = (struct hci_cmd) {
+			.opcode = HCI_CMD_READ_LOCAL_VER,
 			.rparam = &rp,
 			.rlen = sizeof(rp)
 		};
 
-		if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-			err(EXIT_FAILURE, "Write RAM");
+		if (hci_request(&d->hci, &cmd) == 0
+		    && cmd.rlen == sizeof(rp)) {
+			if (le16dec(&rp[2]) != revision
+			    || le16dec(&rp[7]) != subversion)
+				break;
+
+			answered = true;
+			ts.tv_sec = 0;
+			ts.tv_nsec = READY_POLL * 1000000;
+			nanosleep(&ts, NULL);
+		}
 
-		if (req.rlen != sizeof(rp) || rp[0] > 0)
-			errx(EXIT_FAILURE, "Write RAM: failed");
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (timespeccmp(&now, &end, >=)) {
+			d->hci.timeout = REQ_TIMEOUT * 1000;
+			return btdev_fail(d, "Launch RAM: %s",
+			    (answered ? "firmware did not start"
+			    : d->hci.failed ? hci_error(&d->hci)
+			    : "no response"));
+		}
+
+		hci_restart(&d->hci);
 	}
 
-	le32enc(&cp, 0xffffffff);
-	req = (struct bt_devreq) {
-		.opcode = BCM_CMD_LAUNCH_RAM,
-		.cparam = &cp,
-		.clen = sizeof(cp),
-		.rparam = &rp,
-		.rlen = sizeof(rp)
-	};
+	d->hci.timeout = REQ_TIMEOUT * 1000;
+	d->revision = le16dec(&rp[2]);
+	d->subversion = le16dec(&rp[7]);
 
-	if (bt_devreq(hci, &req, REQ_TIMEOUT) == -1)
-		err(EXIT_FAILURE, "Launch RAM");
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &start, &ts);
+	d->readytime = (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+	return 0;
+}
 
-	if (req.rlen != sizeof(rp) || rp[0] > 0)
-		errx(EXIT_FAILURE, "Launch RAM: failed");
+/*
+ * Find the next device after the one named, or the first if the name
+ * is empty, and return its name there.
+ */
+bool
+btdev_next(const struct btdev_transport *tp, char *name)
+{
 
-	usleep(250);
+	return (*tp->next)(name);
 }
 
-static bool
-get_btdev(unsigned long cmd)
+/*
+ * Open a session for the named device, enabling it if need be, and
+ * connect to it.
+ */
+int
+btdev_open(struct btdev *d, const struct btdev_transport *tp,
+    const char *name)
 {
-	struct sockaddr_bt sa;
+	struct probe p;
+
+	memset(d, 0, sizeof(*d));
+	snprintf(d->name, sizeof(d->name), "%s", name);
+	d->tp = tp;
+	d->fd = -1;
+	d->log = stdout;
+	d->enabled = true;
+
+	if ((*tp->open)(d) == -1)
+		goto fail;
+
+	/*
+	 * A device that is down may be passed over without enabling it,
+	 * if its address is known from before and the probe cache has
+	 * a final decision for it.
+	 */
+	d->enabled = (d->btr.btr_flags & BTF_UP) ? true : false;
+	if (!d->enabled && !bdaddr_any(&d->btr.btr_bdaddr)
+	    && probe_known(&d->btr.btr_bdaddr, &p)) {
+		d->known = true;
+		d->decision = p.decision;
+		d->revision = p.revision;
+		d->vendor = p.vendor;
+		d->product = p.product;
+		return 0;
+	}
 
-	if (ioctl(hci, cmd, &btr) == -1)
-		return false;
+	if (!d->enabled) {
+		if ((*tp->enable)(d, true) == -1) {
+			d->enabled = true;
+			goto fail;
+		}
+
+		if ((*tp->info)(d) == -1)
+			goto fail;
+	}
+
+	if ((*tp->connect)(d) == -1)
+		goto fail;
 
-	Enabled = (btr.btr_flags & BTF_UP) ? true : false;
-	if (!Enabled) {
-		btr.btr_flags |= BTF_UP;
-		if (ioctl(hci, SIOCSBTFLAGS, &btr) == -1)
-			err(EXIT_FAILURE, "cannot enable device");
+	hci_open(&d->hci, d->fd, d->btr.btr_num_cmd, REQ_TIMEOUT * 1000);
+	return 0;
 
-		if (ioctl(hci, SIOCGBTINFO, &btr) == -1)
-			err(EXIT_FAILURE, "cannot read device info");
+fail:
+	btdev_close(d);
+	return -1;
+}
+
+/*
+ * Put the device back as it was, and close the session.
+ */
+void
+btdev_close(struct btdev *d)
+{
+	char error[sizeof(d->error)];
+
+	if (d->fd == -1)
+		return;
+
+	hci_close(&d->hci);
+
+	if (!d->enabled && !d->known) {
+		memcpy(error, d->error, sizeof(error));
+		if ((*d->tp->enable)(d, false) == -1)
+			warnx("%s: %s", d->name, d->error);
+
+		memcpy(d->error, error, sizeof(error));
 	}
 
-	sa.bt_len = sizeof(sa);
-	sa.bt_family = AF_BLUETOOTH;
-	bdaddr_copy(&sa.bt_bdaddr, &btr.btr_bdaddr);
+	(*d->tp->close)(d);
+
+	firmware_release(d->firmware);
+	d->firmware = NULL;
+}
+
+/*
+ * Recall what the probe cache knows of the device. Returns false if
+ * nothing is known.
+ */
+static bool
+btdev_recall(struct btdev *d, struct probe *p)
+{
 
-	if (bind(hci, (struct sockaddr *)&sa, sizeof(sa)) == -1)
-		err(EXIT_FAILURE, "bind");
+	if (!probe_find(&d->btr.btr_bdaddr, d->revision, p))
+		return false;
 
-	if (connect(hci, (struct sockaddr *)&sa, sizeof(sa)) == -1)
-		err(EXIT_FAILURE, "connect");
+	if (verbose > 0) {
+		fprintf(d->log, "Probe Cache:\n");
+		fprintf(d->log, "  VendorID 0x%04x\n", p->vendor);
+		fprintf(d->log, "  ProductID 0x%04x\n", p->product);
+		fprintf(d->log, "  Last %s%s\n", probe_decision(p),
+		    (probe_final(p) ? ", final" : ""));
+		if (p->digest[0] != '\0')
+			fprintf(d->log, "  Loaded %s\n", p->digest);
+		fprintf(d->log, "\n");
+	}
 
 	return true;
 }
 
+/*
+ * Remember what was found. When firmware was loaded, it is identified
+ * by the digest of its .hex file or else by the CRC of its records.
+ */
 static void
-put_btdev(void)
+btdev_remember(struct btdev *d, uint16_t revision, int decision)
 {
+	struct probe p;
 
-	if (!Enabled) {
-		btr.btr_flags &= ~BTF_UP;
+	if (bdaddr_any(&d->btr.btr_bdaddr))
+		return;
 
-		if (ioctl(hci, SIOCSBTFLAGS, &btr) == -1)
-			warn("failed to disable device");
+	memset(&p, 0, sizeof(p));
+	bdaddr_copy(&p.bdaddr, &d->btr.btr_bdaddr);
+	p.revision = revision;
+	p.vendor = d->vendor;
+	p.product = d->product;
+	p.decision = decision;
+
+	if (decision == BTDEV_UPDATE && d->firmware->digest[0] != '\0') {
+		snprintf(p.digest, sizeof(p.digest), "%s",
+		    d->firmware->digest);
+	} else if (decision == BTDEV_UPDATE) {
+		snprintf(p.digest, sizeof(p.digest), "%08x",
+		    crc32c(0, d->firmware->rec, d->firmware->len));
 	}
+
+	probe_note(&p);
 }
 
-static void
-update_btdev(void)
+static int
+bcm_probe(struct btdev *d)
 {
+	struct probe p;
 
-	hci_read_local_version();
-	if (Manufacturer != BLUETOOTH_MANUFACTURER_BROADCOM) {
-		if (verbose > 0)
-			printf("%s: Manufacturer is not Broadcom\n", btr.btr_name);
+	if (hci_read_local_version(d) == -1)
+		return -1;
 
-		return;
-	}
+	if (d->manufacturer != BLUETOOTH_MANUFACTURER_BROADCOM)
+		return BTDEV_NOT_BROADCOM;
 
-	switch(Revision & 0xf000) {
+	switch(d->revision & 0xf000) {
 	case 0x1000:
 	case 0x2000:
-		bcm_read_usb_product();
-		if (VendorID != USB_VENDOR_BROADCOM) {
-			if (verbose > 0)
-				printf("%s: VendorID is not Broadcom\n", btr.btr_name);
-
-			return;
+		if (btdev_recall(d, &p)) {
+			if (probe_final(&p))
+				return p.decision;
+
+			d->vendor = p.vendor;
+			d->product = p.product;
+		} else if (bcm_read_usb_product(d) == -1) {
+			return -1;
 		}
+
+		if (d->vendor != USB_VENDOR_BROADCOM)
+			return BTDEV_NOT_BROADCOM_USB;
+
 		break;
 
 	default:
@@ -420,70 +617,113 @@ update_btdev(void)
 		 *	HCI version 0x02 rev 0x0000
 		 * and it returns a command complete with single data byte 0x11)
 		 */
-		if (verbose > 0)
-			printf("%s: Firmware updating not available\n", btr.btr_name);
-
-		return;
+		return BTDEV_NOT_AVAILABLE;
 	}
 
-	bcm_read_verbose_config();
-	if (BuildNum > 0) {
-		if (verbose > 0)
-			printf("%s: Firmware update is not required\n", btr.btr_name);
+	if (bcm_read_verbose_config(d) == -1)
+		return -1;
 
-		return;
-	}
+	if (d->buildnum > 0)
+		return BTDEV_NOT_REQUIRED;
 
-	bcm_load_firmware();
-	if (Firmware == NULL) {
-		if (verbose > 0)
-			printf("%s: Firmware not found\n", btr.btr_name);
+	d->firmware = firmware_device(d->vendor, d->product);
+	if (d->firmware == NULL)
+		return BTDEV_NOT_FOUND;
 
-		return;
+	if (verbose > 0) {
+		fprintf(d->log, "Load Firmware:\n");
+		fprintf(d->log, "  File %s\n", d->firmware->name);
+		fprintf(d->log, "\n");
 	}
 
-	if (Enabled) {
-		if (verbose > 0)
-			printf("%s: Not updating (previously enabled)\n", btr.btr_name);
+	if (d->enabled)
+		return BTDEV_ENABLED;
 
-		return;
-	}
+	if (bcm_check_firmware(d) == -1)
+		return -1;
 
-	if (verbose > 0) {
-		printf("Updating ...");
-		fflush(stdout);
-	}
+	return BTDEV_UPDATE;
+}
+
+/*
+ * Find out whether the device needs firmware, and find and check the
+ * firmware if so. Returns BTDEV_UPDATE if the device can be updated,
+ * or the reason that it will not be.
+ */
+int
+btdev_probe(struct btdev *d)
+{
 
-	bcm_update_device();
+	if (d->known)
+		return d->decision;
 
-	if (verbose > 0) {
-		printf(" done\n");
-		printf("\n");
-	}
+	d->decision = bcm_probe(d);
+	if (d->decision > 0)
+		btdev_remember(d, d->revision, d->decision);
+
+	return d->decision;
 }
 
-void
-check_btdev(const char *dev)
+/*
+ * Download the firmware that was found by btdev_probe(). The Write RAM
+ * blocks are framed as packets once, and streamed as fast as the
+ * controller will take them, and all must be done before the new
+ * firmware is launched.
+ */
+int
+btdev_update(struct btdev *d)
 {
+	struct hci_frames wr;
+	struct hci_cmd cmd;
+	const struct firmware *fw;
+	uint16_t revision;
+	uint8_t cp[UINT8_MAX];	/* [0]	u32	addr
+				   [4]	u8[]	data		*/
+	uint8_t rp[1];		/* [0]	u8	status		*/
+
+	fw = d->firmware;
+	revision = d->revision;
+	cmd = (struct hci_cmd) {
+		.opcode = BCM_CMD_DOWNLOAD_MINIDRIVER,
+		.rparam = &rp,
+		.rlen = sizeof(rp)
+	};
 
-	hci = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
-	if (hci == -1)
-		err(EXIT_FAILURE, "socket");
-
-	memset(btr.btr_name, 0, HCI_DEVNAME_SIZE);
-	if (dev) {
-		snprintf(btr.btr_name, HCI_DEVNAME_SIZE, "%s", dev);
-		if (!get_btdev(SIOCGBTINFO))
-			err(EXIT_FAILURE, "%s get info failed", dev);
-
-		update_btdev();
-		put_btdev();
-	} else {
-		while (get_btdev(SIOCNBTINFO)) {
-			update_btdev();
-			put_btdev();
-		}
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "Download Minidriver: %s",
+		    hci_error(&d->hci));
+
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "Download Minidriver: failed");
+
+	hci_frames(&wr, BCM_CMD_WRITE_RAM, fw->rec, fw->len, fw->count);
+
+	d->ncmd = wr.count;
+	if (hci_stream(&d->hci, &wr) == -1) {
+		hci_frames_free(&wr);
+		return btdev_fail(d, "Write RAM: %s", hci_error(&d->hci));
 	}
 
-	close(hci);
+	hci_frames_free(&wr);
+
+	le32enc(&cp, 0xffffffff);
+	cmd = (struct hci_cmd) {
+		.opcode = BCM_CMD_LAUNCH_RAM,
+		.cparam = &cp,
+		.clen = sizeof(uint32_t),
+		.rparam = &rp,
+		.rlen = sizeof(rp)
+	};
+
+	if (hci_request(&d->hci, &cmd) == -1)
+		return btdev_fail(d, "Launch RAM: %s", hci_error(&d->hci));
+
+	if (cmd.rlen != sizeof(rp))
+		return btdev_fail(d, "Launch RAM: failed");
+
+	if (bcm_wait_ready(d) == -1)
+		return -1;
+
+	btdev_remember(d, revision, BTDEV_UPDATE);
+	return 0;
 }
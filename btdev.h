@@ -0,0 +1,125 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Device sessions, see btdev.c and update.c
+ */
+
+#include <bluetooth.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "hci.h"
+
+/*
+ * What btdev_probe() found
+ */
+enum btdev_probe {
+	BTDEV_UPDATE = 0,	/* firmware can be loaded */
+	BTDEV_NOT_BROADCOM,	/* Manufacturer is not Broadcom */
+	BTDEV_NOT_BROADCOM_USB,	/* VendorID is not Broadcom */
+	BTDEV_NOT_AVAILABLE,	/* Broadcom commands may not work */
+	BTDEV_NOT_REQUIRED,	/* firmware was already loaded */
+	BTDEV_NOT_FOUND,	/* no firmware for the device */
+	BTDEV_ENABLED,		/* device was already enabled */
+};
+
+struct btdev {
+	char		name[HCI_DEVNAME_SIZE];
+	const struct btdev_transport *tp;
+	int		fd;		/* connected to the device */
+	struct hci	hci;		/* HCI command engine */
+	struct btreq	btr;		/* HCI ioctl request */
+	bool		enabled;	/* if the device was enabled */
+	uint16_t	manufacturer;	/* device Manufacturer */
+	uint16_t	revision;	/* HCI revision */
+	uint16_t	subversion;	/* LMP subversion */
+	uint16_t	vendor;		/* USB VendorID */
+	uint16_t	product;	/* USB ProductID */
+	uint16_t	buildnum;	/* Broadcom Firmware version */
+	bdaddr_t	bdaddr;		/* Bluetooth Device Address */
+	struct firmware *firmware;	/* firmware for the device */
+	size_t		ncmd;		/* Write RAM commands sent */
+	unsigned int	readytime;	/* ms to restart after Launch RAM */
+	bool		known;		/* decided from the probe cache */
+	int		decision;	/* what btdev_probe() found */
+	FILE *		log;		/* for verbose output */
+	char		error[128];
+};
+
+/*
+ * How the devices are reached. Each call but next() returns -1 if it
+ * fails, with the reason set by btdev_fail().
+ */
+struct btdev_transport {
+	const char *	name;
+	bool		(*next)(char *);	/* as btdev_next() */
+	int		(*open)(struct btdev *);	/* and get info */
+	int		(*info)(struct btdev *);	/* get info again */
+	int		(*enable)(struct btdev *, bool);
+	int		(*connect)(struct btdev *);	/* to send commands */
+	void		(*close)(struct btdev *);
+};
+
+extern const struct btdev_transport btsock_transport;	/* btsock.c */
+extern const struct btdev_transport btsim_transport;	/* btsim.c */
+
+int btsim_config(const char *);
+
+bool btdev_next(const struct btdev_transport *, char *);
+int btdev_open(struct btdev *, const struct btdev_transport *, const char *);
+int btdev_probe(struct btdev *);
+int btdev_update(struct btdev *);
+void btdev_close(struct btdev *);
+const char *btdev_error(const struct btdev *);
+int btdev_fail(struct btdev *, const char *, ...) __printflike(2, 3);
+
+/*
+ * Probe cache, see probe.c
+ */
+struct probe {
+	bdaddr_t	bdaddr;
+	uint16_t	revision;	/* HCI revision */
+	uint16_t	vendor;		/* USB VendorID */
+	uint16_t	product;	/* USB ProductID */
+	int		decision;	/* enum btdev_probe */
+	char		stamp[BLOB_CRCLEN + 1];	/* firmware_stamp() */
+	char		digest[BLOB_DIGESTLEN + 1];	/* firmware loaded */
+};
+
+void probe_open(const char *);
+void probe_close(void);
+bool probe_find(const bdaddr_t *, uint16_t, struct probe *);
+bool probe_known(const bdaddr_t *, struct probe *);
+bool probe_final(const struct probe *);
+void probe_note(const struct probe *);
+const char *probe_decision(const struct probe *);
+
+/* update.c */
+bool update_devices(const struct btdev_transport *,
+    const char (*)[HCI_DEVNAME_SIZE], size_t, unsigned int, unsigned int,
+    unsigned int *, unsigned int *);
@@ -0,0 +1,729 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Simulated Broadcom controller transport. Each session is connected to
+ * a controller that runs in a thread of its own, at the other end of a
+ * socketpair, and answers the commands that the probe and download use
+ * as a BCM20702 would:
+ *
+ *	Read Local Version, Read USB Product, Read Verbose Config,
+ *	Download Minidriver, Write RAM, Launch RAM, Reset
+ *
+ * and fails anything else as an Unknown HCI Command. Each answer is
+ * sent after the link latency, or the latency given for its opcode,
+ * with random jitter added, and in order, so that the controller can
+ * have several commands in hand at once, as many as its credits. After
+ * Launch RAM it ignores commands until it has restarted, which it
+ * announces with a No Operation Command Complete.
+ *
+ * Each Write RAM block is checked against the firmware that bcmfw would
+ * find for the controller, if there is any. The firmware is only
+ * reported as loaded, with a new HCI revision, LMP subversion and build
+ * number, when every block matched and the whole image was written.
+ *
+ * The simulated devices are named sim0, sim1 and so on, and remember
+ * whether they are enabled and have firmware until btsim_config() is
+ * called again, as if they were plugged in again. Every Write RAM
+ * command may be counted, so that every so many of them fail or go
+ * unanswered.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <bluetooth.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "btdev.h"
+
+#define SIM_MAXDEV	16
+#define SIM_MAXQUEUE	64	/* answers in hand */
+#define SIM_MAXDELAY	8	/* opcodes with a latency of their own */
+
+#define SIM_VENDOR	0x0a5c
+#define SIM_BUILDNUM	0x0a2f	/* reported once firmware is loaded */
+
+/* status codes */
+#define SIM_UNKNOWN_COMMAND	0x01
+#define SIM_DISALLOWED		0x0c
+#define SIM_INVALID_PARAMS	0x12
+#define SIM_UNSPECIFIED		0x1f
+
+struct sim_config {
+	unsigned int	devices;
+	unsigned int	latency;	/* microseconds, each answer */
+	unsigned int	jitter;		/* microseconds, up to */
+	unsigned int	credits;	/* commands in hand at once */
+	unsigned int	fail;		/* every so many Write RAM fail */
+	unsigned int	drop;		/* or are not answered */
+	unsigned int	ready;		/* milliseconds to restart */
+	unsigned int	revision;	/* HCI revision */
+	unsigned int	product;	/* USB ProductID */
+	unsigned int	build;		/* of the firmware, once loaded */
+	struct {
+		uint16_t	opcode;
+		unsigned int	latency;	/* microseconds */
+	} delay[SIM_MAXDELAY];
+	size_t		ndelay;
+};
+
+struct sim_device {
+	bool		up;		/* enabled */
+	bool		loaded;		/* firmware was launched */
+};
+
+struct sim_answer {
+	struct timespec	due;
+	uint16_t	opcode;
+	uint8_t		rp[16];		/* return parameters */
+	size_t		rlen;
+};
+
+/*
+ * Controller, for one session
+ */
+struct sim_ctl {
+	int		fd;
+	size_t		unit;
+	struct sim_config cf;
+	uint32_t	seed;		/* for the jitter */
+	bool		minidriver;	/* taking Write RAM */
+	bool		written;	/* and had some */
+	bool		wrong;		/* that were not the image */
+	bool		restarting;	/* after Launch RAM */
+	unsigned long	nwrite;		/* Write RAM commands taken */
+	struct firmware *fw;		/* that Write RAM should send */
+	const uint8_t *	next;		/* record expected next */
+	struct spanmap	ram;		/* ranges written */
+	struct sim_answer queue[SIM_MAXQUEUE];
+	size_t		head;
+	size_t		count;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sim_config config = {
+	.devices =	1,
+	.credits =	1,
+	.ready =	100,
+	.revision =	0x1000,
+	.product =	0x21e8,
+	.build =	SIM_BUILDNUM,
+};
+static struct sim_device device[SIM_MAXDEV];
+
+/*
+ * Set the latency for an opcode, from "opcode:us"
+ */
+static int
+sim_delay(struct sim_config *cf, const char *val)
+{
+	uint16_t opcode;
+	unsigned int latency;
+	size_t i;
+	char *ep;
+	int rv;
+
+	opcode = (uint16_t)strtou(val, &ep, 0, 1, UINT16_MAX, &rv);
+	if (rv != ENOTSUP || *ep != ':')
+		return -1;
+
+	latency = (unsigned int)strtou(ep + 1, NULL, 0, 0, 10000000, &rv);
+	if (rv != 0)
+		return -1;
+
+	for (i = 0; i < cf->ndelay; i++) {
+		if (cf->delay[i].opcode == opcode)
+			break;
+	}
+
+	if (i == SIM_MAXDELAY)
+		return -1;
+
+	if (i == cf->ndelay)
+		cf->ndelay++;
+
+	cf->delay[i].opcode = opcode;
+	cf->delay[i].latency = latency;
+	return 0;
+}
+
+/*
+ * Set up the simulated controllers, from a list of settings as
+ *
+ *	devices=n,latency=us,jitter=us,credits=n,fail=n,drop=n,
+ *	ready=ms,revision=n,product=n,build=n,delay=opcode:us
+ *
+ * with any not given left as they were. The devices are all down and
+ * without firmware after this. Returns -1 if a setting is not known.
+ */
+int
+btsim_config(const char *settings)
+{
+	static char *const token[] = {
+		"devices", "latency", "jitter", "credits", "fail", "drop",
+		"ready", "revision", "product", "build", "delay", NULL
+	};
+	struct sim_config cf;
+	unsigned int *value[__arraycount(token) - 2];
+	char *buf, *opts, *val;
+	uintmax_t max;
+	int i, rv;
+
+	pthread_mutex_lock(&lock);
+	cf = config;
+	value[0] = &cf.devices;
+	value[1] = &cf.latency;
+	value[2] = &cf.jitter;
+	value[3] = &cf.credits;
+	value[4] = &cf.fail;
+	value[5] = &cf.drop;
+	value[6] = &cf.ready;
+	value[7] = &cf.revision;
+	value[8] = &cf.product;
+	value[9] = &cf.build;
+
+	buf = opts = estrdup(settings);
+	rv = 0;
+	while (*opts != '\0' && rv == 0) {
+		i = getsubopt(&opts, token, &val);
+		if (i == -1 || val == NULL) {
+			rv = -1;
+			break;
+		}
+
+		if (i == 10) {
+			rv = sim_delay(&cf, val);
+			continue;
+		}
+
+		max = (i == 0 ? SIM_MAXDEV : i == 3 ? HCI_MAXQUEUE
+		    : i == 9 ? 0x0fff : i >= 7 ? UINT16_MAX : 10000000);
+		*value[i] = (unsigned int)strtou(val, NULL, 0, 0, max, &rv);
+	}
+
+	free(buf);
+	if (rv == 0 && cf.credits == 0)
+		rv = -1;
+
+	if (rv == 0) {
+		config = cf;
+		memset(device, 0, sizeof(device));
+	}
+
+	pthread_mutex_unlock(&lock);
+	return (rv == 0 ? 0 : -1);
+}
+
+static uint32_t
+sim_random(uint32_t *seed)
+{
+
+	/* xorshift32 */
+	*seed ^= *seed << 13;
+	*seed ^= *seed >> 17;
+	*seed ^= *seed << 5;
+	return *seed;
+}
+
+/*
+ * Queue an answer, to be sent after the latency and jitter but not
+ * before those already queued.
+ */
+static struct sim_answer *
+sim_answer(struct sim_ctl *c, uint16_t opcode, uint8_t status,
+    const struct timespec *now, unsigned int delay)
+{
+	struct sim_answer *a, *last;
+	struct timespec ts;
+
+	if (c->count == SIM_MAXQUEUE)
+		return NULL;
+
+	if (c->cf.jitter > 0)
+		delay += sim_random(&c->seed) % (c->cf.jitter + 1);
+
+	ts.tv_sec = delay / 1000000;
+	ts.tv_nsec = (long)(delay % 1000000) * 1000;
+
+	a = &c->queue[(c->head + c->count) % SIM_MAXQUEUE];
+	timespecadd(now, &ts, &a->due);
+
+	if (c->count > 0) {
+		last = &c->queue[(c->head + c->count - 1) % SIM_MAXQUEUE];
+		if (timespeccmp(&a->due, &last->due, <))
+			a->due = last->due;
+	}
+
+	a->opcode = opcode;
+	a->rp[0] = status;
+	a->rlen = 1;
+	c->count++;
+
+	return a;
+}
+
+static unsigned int
+sim_latency(const struct sim_ctl *c, uint16_t opcode)
+{
+	size_t i;
+
+	for (i = 0; i < c->cf.ndelay; i++) {
+		if (c->cf.delay[i].opcode == opcode)
+			return c->cf.delay[i].latency;
+	}
+
+	return c->cf.latency;
+}
+
+/*
+ * Check a Write RAM block against the image. The blocks are expected
+ * in the order of the records, so the search starts from the record
+ * after the one last matched. A block that is written again, as when
+ * the download is retried, is the same as before and adds nothing to
+ * the ranges written.
+ */
+static void
+sim_write(struct sim_ctl *c, const uint8_t *cp, size_t len)
+{
+	const uint8_t *rec, *end;
+	uint32_t addr;
+	size_t n, i;
+
+	if (c->fw == NULL)
+		return;
+
+	addr = le32dec(cp);
+	len -= sizeof(uint32_t);
+	end = c->fw->rec + c->fw->len;
+	rec = c->next;
+	for (i = 0; i < c->fw->count; i++) {
+		if (rec >= end)
+			rec = c->fw->rec;
+
+		if (addr >= IMAGE_ADDR(rec) && (uint64_t)addr + len
+		    <= (uint64_t)IMAGE_ADDR(rec) + IMAGE_DATALEN(rec))
+			break;
+
+		rec += 1 + rec[0];
+	}
+
+	if (i == c->fw->count) {
+		c->wrong = true;
+		return;
+	}
+
+	n = addr - IMAGE_ADDR(rec);
+	if (memcmp(IMAGE_DATA(rec) + n, cp + sizeof(uint32_t), len) != 0)
+		c->wrong = true;
+
+	c->next = rec + 1 + rec[0];
+	spanmap_add(&c->ram, addr, len);
+}
+
+/*
+ * Take a command packet from the host.
+ */
+static void
+sim_command(struct sim_ctl *c, const uint8_t *buf, size_t len,
+    const struct timespec *now)
+{
+	const hci_cmd_hdr_t *hdr;
+	struct sim_answer *a;
+	struct sim_device *dv;
+	unsigned int latency;
+	uint16_t opcode, revision, subversion;
+
+	hdr = (const hci_cmd_hdr_t *)buf;
+	if (len < sizeof(*hdr) || hdr->type != HCI_CMD_PKT
+	    || len != sizeof(*hdr) + hdr->length || c->restarting)
+		return;
+
+	dv = &device[c->unit];
+	opcode = le16toh(hdr->opcode);
+	latency = sim_latency(c, opcode);
+
+	switch (opcode) {
+	case HCI_CMD_READ_LOCAL_VER:
+		a = sim_answer(c, opcode, 0, now, latency);
+		if (a == NULL)
+			break;
+
+		pthread_mutex_lock(&lock);
+		revision = (dv->loaded ? (c->cf.revision & 0xf000)
+		    | c->cf.build : c->cf.revision);
+		subversion = (dv->loaded ? 0x4000 | c->cf.build : 0x4000);
+		pthread_mutex_unlock(&lock);
+		a->rp[1] = 0x06;				/* HCIVersion */
+		le16enc(&a->rp[2], revision);
+		a->rp[4] = 0x06;				/* LMPVersion */
+		le16enc(&a->rp[5], 15);				/* Broadcom */
+		le16enc(&a->rp[7], subversion);			/* LMPSubversion */
+		a->rlen = 9;
+		break;
+
+	case 0xfc5a:		/* Read USB Product */
+		a = sim_answer(c, opcode, 0, now, latency);
+		if (a == NULL)
+			break;
+
+		le16enc(&a->rp[1], SIM_VENDOR);
+		le16enc(&a->rp[3], (uint16_t)c->cf.product);
+		a->rlen = 5;
+		break;
+
+	case 0xfc79:		/* Read Verbose Config */
+		a = sim_answer(c, opcode, 0, now, latency);
+		if (a == NULL)
+			break;
+
+		pthread_mutex_lock(&lock);
+		a->rp[1] = 0x63;				/* ChipID */
+		a->rp[2] = 0x00;				/* TargetID */
+		le16enc(&a->rp[3], 0x0100);			/* BuildBase */
+		le16enc(&a->rp[5], (dv->loaded ? c->cf.build : 0));
+		pthread_mutex_unlock(&lock);
+		a->rlen = 7;
+		break;
+
+	case 0xfc2e:		/* Download Minidriver */
+		if (c->fw == NULL) {
+			c->fw = firmware_device(SIM_VENDOR,
+			    (uint16_t)c->cf.product);
+			if (c->fw != NULL
+			    && firmware_prepare(c->fw, NULL) == -1) {
+				firmware_release(c->fw);
+				c->fw = NULL;
+			}
+		}
+
+		c->minidriver = true;
+		c->written = false;
+		c->wrong = false;
+		c->next = (c->fw != NULL ? c->fw->rec : NULL);
+		spanmap_free(&c->ram);
+		spanmap_init(&c->ram);
+		sim_answer(c, opcode, 0, now, latency);
+		break;
+
+	case 0xfc4c:		/* Write RAM */
+		if (!c->minidriver) {
+			sim_answer(c, opcode, SIM_DISALLOWED, now, latency);
+			break;
+		}
+
+		if (hdr->length < sizeof(uint32_t)) {
+			sim_answer(c, opcode, SIM_INVALID_PARAMS, now,
+			    latency);
+			break;
+		}
+
+		c->nwrite++;
+		if (c->cf.drop > 0 && c->nwrite % c->cf.drop == 0)
+			break;
+
+		if (c->cf.fail > 0 && c->nwrite % c->cf.fail == 0) {
+			sim_answer(c, opcode, SIM_UNSPECIFIED, now, latency);
+			break;
+		}
+
+		c->written = true;
+		sim_write(c, buf + sizeof(*hdr), hdr->length);
+		sim_answer(c, opcode, 0, now, latency);
+		break;
+
+	case 0xfc4e:		/* Launch RAM */
+		if (!c->minidriver) {
+			sim_answer(c, opcode, SIM_DISALLOWED, now, latency);
+			break;
+		}
+
+		sim_answer(c, opcode, 0, now, latency);
+
+		/* the whole image must have been written */
+		if (c->fw != NULL && spanmap_size(&c->ram)
+		    != spanmap_size(&c->fw->map))
+			c->wrong = true;
+
+		/* and restart, when that has been sent */
+		c->minidriver = false;
+		c->restarting = true;
+		sim_answer(c, HCI_CMD_NOP, 0, now,
+		    latency + c->cf.ready * 1000);
+		break;
+
+	case HCI_CMD_RESET:
+		c->minidriver = false;
+		sim_answer(c, opcode, 0, now, latency);
+		break;
+
+	default:
+		sim_answer(c, opcode, SIM_UNKNOWN_COMMAND, now, latency);
+		break;
+	}
+}
+
+/*
+ * Send the answer at the head of the queue, with the credits that are
+ * left once it is done.
+ */
+static void
+sim_send(struct sim_ctl *c)
+{
+	struct sim_answer *a;
+	uint8_t buf[sizeof(hci_event_hdr_t) + 3 + sizeof(a->rp)];
+	hci_event_hdr_t *hdr;
+	size_t len;
+
+	a = &c->queue[c->head];
+	c->head = (c->head + 1) % SIM_MAXQUEUE;
+	c->count--;
+
+	hdr = (hci_event_hdr_t *)buf;
+	hdr->type = HCI_EVENT_PKT;
+	hdr->event = HCI_EVENT_COMMAND_COMPL;
+
+	if (a->opcode == HCI_CMD_NOP) {
+		/* restarted, with the new firmware */
+		c->restarting = false;
+		pthread_mutex_lock(&lock);
+		if (c->written && !c->wrong)
+			device[c->unit].loaded = true;
+		pthread_mutex_unlock(&lock);
+		len = 0;
+	} else {
+		len = a->rlen;
+	}
+
+	buf[sizeof(*hdr)] = (uint8_t)(c->cf.credits > c->count
+	    ? c->cf.credits - c->count : 0);
+	le16enc(&buf[sizeof(*hdr) + 1], a->opcode);
+	memcpy(&buf[sizeof(*hdr) + 3], a->rp, len);
+	hdr->length = (uint8_t)(3 + len);
+
+	send(c->fd, buf, sizeof(*hdr) + 3 + len, 0);
+}
+
+static void *
+sim_run(void *arg)
+{
+	struct sim_ctl *c = arg;
+	struct pollfd pfd;
+	struct timespec now, ts;
+	uint8_t buf[HCI_CMD_PKT_SIZE];
+	ssize_t n;
+	int rv;
+
+	for (;;) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		while (c->count > 0
+		    && timespeccmp(&c->queue[c->head].due, &now, <=))
+			sim_send(c);
+
+		pfd.fd = c->fd;
+		pfd.events = POLLIN;
+		if (c->count > 0) {
+			timespecsub(&c->queue[c->head].due, &now, &ts);
+			rv = ppoll(&pfd, 1, &ts, NULL);
+		} else {
+			rv = ppoll(&pfd, 1, NULL, NULL);
+		}
+
+		if (rv == -1 && errno != EINTR)
+			break;
+
+		if (rv <= 0)
+			continue;
+
+		n = recv(c->fd, buf, sizeof(buf), 0);
+		if (n <= 0)
+			break;	/* the host closed it */
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sim_command(c, buf, (size_t)n, &now);
+	}
+
+	close(c->fd);
+	spanmap_free(&c->ram);
+	firmware_release(c->fw);
+	free(c);
+	return NULL;
+}
+
+static bool
+sim_unit(const char *name, size_t *unit)
+{
+	char *ep;
+	unsigned long u;
+
+	if (strncmp(name, "sim", 3) != 0 || name[3] == '\0')
+		return false;
+
+	u = strtoul(name + 3, &ep, 10);
+	if (*ep != '\0' || u >= config.devices)
+		return false;
+
+	*unit = u;
+	return true;
+}
+
+static bool
+btsim_next(char *name)
+{
+	size_t unit;
+	bool rv;
+
+	pthread_mutex_lock(&lock);
+	if (name[0] == '\0') {
+		unit = 0;
+		rv = (config.devices > 0);
+	} else {
+		rv = sim_unit(name, &unit) && ++unit < config.devices;
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (rv)
+		snprintf(name, HCI_DEVNAME_SIZE, "sim%zu", unit);
+
+	return rv;
+}
+
+static int
+btsim_info(struct btdev *d)
+{
+	size_t unit;
+
+	pthread_mutex_lock(&lock);
+	if (!sim_unit(d->name, &unit)) {
+		pthread_mutex_unlock(&lock);
+		return btdev_fail(d, "get info failed: %s", strerror(ENXIO));
+	}
+
+	snprintf(d->btr.btr_name, HCI_DEVNAME_SIZE, "%s", d->name);
+	d->btr.btr_flags = (device[unit].up ? BTF_UP : 0);
+	d->btr.btr_num_cmd = (uint16_t)config.credits;
+	memset(&d->btr.btr_bdaddr, 0, sizeof(bdaddr_t));
+	d->btr.btr_bdaddr.b[0] = (uint8_t)(unit + 1);
+	d->btr.btr_bdaddr.b[5] = 0x5e;
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static int
+btsim_open(struct btdev *d)
+{
+	struct sim_ctl *c;
+	pthread_t t;
+	sigset_t mask, omask;
+	int sv[2];
+
+	if (btsim_info(d) == -1)
+		return -1;
+
+	if (socketpair(AF_LOCAL, SOCK_SEQPACKET, 0, sv) == -1)
+		return btdev_fail(d, "socketpair: %s", strerror(errno));
+
+	c = ecalloc(1, sizeof(*c));
+	c->fd = sv[1];
+	spanmap_init(&c->ram);
+	pthread_mutex_lock(&lock);
+	sim_unit(d->name, &c->unit);
+	c->cf = config;
+	pthread_mutex_unlock(&lock);
+	c->seed = (uint32_t)(c->unit + 1) * 0x9e3779b9;
+
+	/* the controller takes no signals */
+	sigfillset(&mask);
+	pthread_sigmask(SIG_SETMASK, &mask, &omask);
+	errno = pthread_create(&t, NULL, sim_run, c);
+	pthread_sigmask(SIG_SETMASK, &omask, NULL);
+
+	if (errno != 0) {
+		btdev_fail(d, "cannot start controller: %s", strerror(errno));
+		close(sv[0]);
+		close(sv[1]);
+		free(c);
+		return -1;
+	}
+
+	pthread_detach(t);
+	d->fd = sv[0];
+	return 0;
+}
+
+static int
+btsim_enable(struct btdev *d, bool on)
+{
+	size_t unit;
+
+	pthread_mutex_lock(&lock);
+	if (sim_unit(d->name, &unit)) {
+		device[unit].up = on;
+		if (on)
+			d->btr.btr_flags |= BTF_UP;
+		else
+			d->btr.btr_flags &= ~BTF_UP;
+	}
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+static int
+btsim_connect(struct btdev *d)
+{
+
+	return 0;
+}
+
+static void
+btsim_close(struct btdev *d)
+{
+
+	close(d->fd);
+	d->fd = -1;
+}
+
+const struct btdev_transport btsim_transport = {
+	.name =		"simulator",
+	.next =		btsim_next,
+	.open =		btsim_open,
+	.info =		btsim_info,
+	.enable =	btsim_enable,
+	.connect =	btsim_connect,
+	.close =	btsim_close,
+};
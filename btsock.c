@@ -0,0 +1,160 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Raw HCI socket transport. The device is found and enabled with the
+ * ioctls on a Bluetooth socket, and the socket is then connected to it
+ * with filters that pass only the command events, so that the HCI
+ * engine sees nothing else. The filters belong to the socket, so they go
+ * away with it and there is nothing to put back.
+ */
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <bluetooth.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bcmfw.h"
+#include "btdev.h"
+
+static bool
+btsock_next(char *name)
+{
+	struct btreq btr;
+	int fd;
+
+	fd = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (fd == -1)
+		return false;
+
+	memset(&btr, 0, sizeof(btr));
+	snprintf(btr.btr_name, HCI_DEVNAME_SIZE, "%s", name);
+
+	if (ioctl(fd, SIOCNBTINFO, &btr) == -1) {
+		close(fd);
+		return false;
+	}
+
+	snprintf(name, HCI_DEVNAME_SIZE, "%s", btr.btr_name);
+	close(fd);
+	return true;
+}
+
+static int
+btsock_open(struct btdev *d)
+{
+
+	d->fd = socket(PF_BLUETOOTH, SOCK_RAW, BTPROTO_HCI);
+	if (d->fd == -1)
+		return btdev_fail(d, "socket: %s", strerror(errno));
+
+	snprintf(d->btr.btr_name, HCI_DEVNAME_SIZE, "%s", d->name);
+	if (ioctl(d->fd, SIOCGBTINFO, &d->btr) == -1)
+		return btdev_fail(d, "get info failed: %s", strerror(errno));
+
+	return 0;
+}
+
+static int
+btsock_info(struct btdev *d)
+{
+
+	if (ioctl(d->fd, SIOCGBTINFO, &d->btr) == -1)
+		return btdev_fail(d, "cannot read device info: %s",
+		    strerror(errno));
+
+	return 0;
+}
+
+static int
+btsock_enable(struct btdev *d, bool on)
+{
+
+	if (on)
+		d->btr.btr_flags |= BTF_UP;
+	else
+		d->btr.btr_flags &= ~BTF_UP;
+
+	if (ioctl(d->fd, SIOCSBTFLAGS, &d->btr) == -1)
+		return btdev_fail(d, "cannot %s device: %s",
+		    (on ? "enable" : "disable"), strerror(errno));
+
+	return 0;
+}
+
+static int
+btsock_connect(struct btdev *d)
+{
+	struct sockaddr_bt sa;
+	struct hci_filter f;
+
+	sa.bt_len = sizeof(sa);
+	sa.bt_family = AF_BLUETOOTH;
+	bdaddr_copy(&sa.bt_bdaddr, &d->btr.btr_bdaddr);
+
+	if (bind(d->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		return btdev_fail(d, "bind: %s", strerror(errno));
+
+	if (connect(d->fd, (struct sockaddr *)&sa, sizeof(sa)) == -1)
+		return btdev_fail(d, "connect: %s", strerror(errno));
+
+	memset(&f, 0, sizeof(f));
+	hci_filter_set(HCI_EVENT_COMMAND_COMPL, &f);
+	hci_filter_set(HCI_EVENT_COMMAND_STATUS, &f);
+	if (setsockopt(d->fd, BTPROTO_HCI, SO_HCI_EVT_FILTER, &f, sizeof(f))
+	    == -1)
+		return btdev_fail(d, "set filter: %s", strerror(errno));
+
+	memset(&f, 0, sizeof(f));
+	hci_filter_set(HCI_EVENT_PKT, &f);
+	if (setsockopt(d->fd, BTPROTO_HCI, SO_HCI_PKT_FILTER, &f, sizeof(f))
+	    == -1)
+		return btdev_fail(d, "set filter: %s", strerror(errno));
+
+	return 0;
+}
+
+static void
+btsock_close(struct btdev *d)
+{
+
+	close(d->fd);
+	d->fd = -1;
+}
+
+const struct btdev_transport btsock_transport = {
+	.name =		"socket",
+	.next =		btsock_next,
+	.open =		btsock_open,
+	.info =		btsock_info,
+	.enable =	btsock_enable,
+	.connect =	btsock_connect,
+	.close =	btsock_close,
+};
@@ -0,0 +1,538 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * SHA-256 and CRC32C (Castagnoli) for checking firmware files, using
+ * the SHA and CRC instructions of the CPU when it has them. On x86 the
+ * CPU is asked at run time, and on ARM the instructions are used when
+ * the compiler is told that they exist. Otherwise, portable code is
+ * used, which gives the same results.
+ *
+ * crc32c() takes the CRC so far, starting with 0, in the same way as
+ * the crc32() of zlib.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DIGEST_X86
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) \
+    && (defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#define DIGEST_ARM_SHA
+#include <arm_neon.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#define DIGEST_ARM_CRC
+#include <arm_acle.h>
+#endif
+
+#include "bcmfw.h"
+
+#define CRC32C_POLY	0x82f63b78	/* reflected */
+#define CRC32C_LANE	4096	/* bytes per interleaved stream */
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+	0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+	0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+	0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+	0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+	0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static pthread_once_t	digest_once = PTHREAD_ONCE_INIT;
+
+static void	(*sha256_blocks)(uint32_t *, const uint8_t *, size_t);
+static uint32_t	(*crc32c_update)(uint32_t, const uint8_t *, size_t);
+static const char *sha256_name;
+static const char *crc32c_name;
+
+static uint32_t	crc32c_table[8][256];	/* for the portable code */
+static uint32_t	crc32c_lane;		/* x^(8 * CRC32C_LANE) mod P */
+
+#define ROR(x, n)	(((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_blocks_c(uint32_t *h, const uint8_t *p, size_t n)
+{
+	uint32_t w[64], a, b, c, d, e, f, g, hh, t1, t2;
+	int i;
+
+	for (; n > 0; n--, p += 64) {
+		for (i = 0; i < 16; i++)
+			w[i] = be32dec(p + 4 * i);
+
+		for (i = 16; i < 64; i++) {
+			w[i] = w[i - 16] + w[i - 7]
+			    + (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18)
+			    ^ (w[i - 15] >> 3))
+			    + (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19)
+			    ^ (w[i - 2] >> 10));
+		}
+
+		a = h[0]; b = h[1]; c = h[2]; d = h[3];
+		e = h[4]; f = h[5]; g = h[6]; hh = h[7];
+
+		for (i = 0; i < 64; i++) {
+			t1 = hh + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25))
+			    + ((e & f) ^ (~e & g)) + K[i] + w[i];
+			t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22))
+			    + ((a & b) ^ (a & c) ^ (b & c));
+			hh = g; g = f; f = e; e = d + t1;
+			d = c; c = b; b = a; a = t1 + t2;
+		}
+
+		h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+		h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+	}
+}
+
+/*
+ * Slicing by 8, a table lookup for each of 8 bytes at a time
+ */
+static uint32_t
+crc32c_c(uint32_t crc, const uint8_t *p, size_t n)
+{
+
+	for (; n >= 8; n -= 8, p += 8) {
+		crc ^= le32dec(p);
+		crc = crc32c_table[7][crc & 0xff]
+		    ^ crc32c_table[6][(crc >> 8) & 0xff]
+		    ^ crc32c_table[5][(crc >> 16) & 0xff]
+		    ^ crc32c_table[4][crc >> 24]
+		    ^ crc32c_table[3][p[4]]
+		    ^ crc32c_table[2][p[5]]
+		    ^ crc32c_table[1][p[6]]
+		    ^ crc32c_table[0][p[7]];
+	}
+
+	for (; n > 0; n--, p++)
+		crc = crc32c_table[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+
+	return crc;
+}
+
+/*
+ * Multiply two polynomials modulo P, in the reflected bit order of the
+ * CRC, where the top bit is x^0.
+ */
+static uint32_t
+crc32c_mult(uint32_t a, uint32_t b)
+{
+	uint32_t m, p;
+
+	p = 0;
+	for (m = 1U << 31; m != 0; m >>= 1) {
+		if (a & m)
+			p ^= b;
+
+		b = (b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1);
+	}
+
+	return p;
+}
+
+#ifdef DIGEST_X86
+/*
+ * The SHA extensions take the state as ABEF and CDGH, and do two rounds
+ * at a time, so each group of four rounds is two instructions. The
+ * message schedule is kept in four registers of four words each.
+ */
+static void __attribute__((__target__("sha,sse4.1")))
+sha256_blocks_x86(uint32_t *h, const uint8_t *p, size_t n)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+	    0x0405060700010203ULL);
+	__m128i s0, s1, save0, save1, msg, tmp, m[4];
+	int i;
+
+	tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[0]),
+	    0xb1);					/* CDAB */
+	s1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&h[4]),
+	    0x1b);					/* EFGH */
+	s0 = _mm_alignr_epi8(tmp, s1, 8);		/* ABEF */
+	s1 = _mm_blend_epi16(s1, tmp, 0xf0);		/* CDGH */
+
+	for (; n > 0; n--, p += 64) {
+		save0 = s0;
+		save1 = s1;
+
+#pragma GCC unroll 16
+		for (i = 0; i < 16; i++) {
+			if (i < 4) {
+				m[i] = _mm_shuffle_epi8(_mm_loadu_si128(
+				    (const __m128i *)(p + 16 * i)), mask);
+			}
+
+			msg = _mm_add_epi32(m[i % 4],
+			    _mm_loadu_si128((const __m128i *)&K[4 * i]));
+			s1 = _mm_sha256rnds2_epu32(s1, s0, msg);
+
+			if (i >= 3 && i < 15) {
+				tmp = _mm_alignr_epi8(m[i % 4],
+				    m[(i + 3) % 4], 4);
+				m[(i + 1) % 4] = _mm_sha256msg2_epu32(
+				    _mm_add_epi32(m[(i + 1) % 4], tmp),
+				    m[i % 4]);
+			}
+
+			msg = _mm_shuffle_epi32(msg, 0x0e);
+			s0 = _mm_sha256rnds2_epu32(s0, s1, msg);
+
+			if (i >= 1 && i < 13) {
+				m[(i + 3) % 4] = _mm_sha256msg1_epu32(
+				    m[(i + 3) % 4], m[i % 4]);
+			}
+		}
+
+		s0 = _mm_add_epi32(s0, save0);
+		s1 = _mm_add_epi32(s1, save1);
+	}
+
+	tmp = _mm_shuffle_epi32(s0, 0x1b);		/* FEBA */
+	s1 = _mm_shuffle_epi32(s1, 0xb1);		/* DCHG */
+	s0 = _mm_blend_epi16(tmp, s1, 0xf0);		/* DCBA */
+	s1 = _mm_alignr_epi8(s1, tmp, 8);		/* HGFE */
+
+	_mm_storeu_si128((__m128i *)&h[0], s0);
+	_mm_storeu_si128((__m128i *)&h[4], s1);
+}
+
+/*
+ * The CRC32 instruction has a latency of three cycles but can start one
+ * every cycle, so large buffers are done as three streams at once and
+ * the results combined.
+ */
+static uint32_t __attribute__((__target__("sse4.2")))
+crc32c_x86(uint32_t crc, const uint8_t *p, size_t n)
+{
+#ifdef __x86_64__
+	uint64_t c0, c1, c2;
+	size_t i;
+
+	while (n >= 3 * CRC32C_LANE) {
+		c0 = crc;
+		c1 = 0;
+		c2 = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			c0 = _mm_crc32_u64(c0, le64dec(p + i));
+			c1 = _mm_crc32_u64(c1, le64dec(p + CRC32C_LANE + i));
+			c2 = _mm_crc32_u64(c2,
+			    le64dec(p + 2 * CRC32C_LANE + i));
+		}
+
+		crc = crc32c_mult(crc32c_lane, (uint32_t)c0) ^ (uint32_t)c1;
+		crc = crc32c_mult(crc32c_lane, crc) ^ (uint32_t)c2;
+		p += 3 * CRC32C_LANE;
+		n -= 3 * CRC32C_LANE;
+	}
+
+	for (c0 = crc; n >= 8; n -= 8, p += 8)
+		c0 = _mm_crc32_u64(c0, le64dec(p));
+
+	crc = (uint32_t)c0;
+#else
+	for (; n >= 4; n -= 4, p += 4)
+		crc = _mm_crc32_u32(crc, le32dec(p));
+#endif
+
+	for (; n > 0; n--, p++)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return crc;
+}
+#endif
+
+#ifdef DIGEST_ARM_SHA
+static void
+sha256_blocks_arm(uint32_t *h, const uint8_t *p, size_t n)
+{
+	uint32x4_t s0, s1, save0, save1, wk, tmp, m[4];
+	int i;
+
+	s0 = vld1q_u32(&h[0]);
+	s1 = vld1q_u32(&h[4]);
+
+	for (; n > 0; n--, p += 64) {
+		save0 = s0;
+		save1 = s1;
+
+		for (i = 0; i < 4; i++) {
+			m[i] = vreinterpretq_u32_u8(
+			    vrev32q_u8(vld1q_u8(p + 16 * i)));
+		}
+
+		for (i = 0; i < 16; i++) {
+			wk = vaddq_u32(m[i % 4], vld1q_u32(&K[4 * i]));
+
+			if (i < 12) {
+				m[i % 4] = vsha256su1q_u32(
+				    vsha256su0q_u32(m[i % 4], m[(i + 1) % 4]),
+				    m[(i + 2) % 4], m[(i + 3) % 4]);
+			}
+
+			tmp = s0;
+			s0 = vsha256hq_u32(s0, s1, wk);
+			s1 = vsha256h2q_u32(s1, tmp, wk);
+		}
+
+		s0 = vaddq_u32(s0, save0);
+		s1 = vaddq_u32(s1, save1);
+	}
+
+	vst1q_u32(&h[0], s0);
+	vst1q_u32(&h[4], s1);
+}
+#endif
+
+#ifdef DIGEST_ARM_CRC
+static uint32_t
+crc32c_arm(uint32_t crc, const uint8_t *p, size_t n)
+{
+	uint32_t c1, c2;
+	size_t i;
+
+	while (n >= 3 * CRC32C_LANE) {
+		c1 = 0;
+		c2 = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			crc = __crc32cd(crc, le64dec(p + i));
+			c1 = __crc32cd(c1, le64dec(p + CRC32C_LANE + i));
+			c2 = __crc32cd(c2, le64dec(p + 2 * CRC32C_LANE + i));
+		}
+
+		crc = crc32c_mult(crc32c_lane, crc) ^ c1;
+		crc = crc32c_mult(crc32c_lane, crc) ^ c2;
+		p += 3 * CRC32C_LANE;
+		n -= 3 * CRC32C_LANE;
+	}
+
+	for (; n >= 8; n -= 8, p += 8)
+		crc = __crc32cd(crc, le64dec(p));
+
+	for (; n > 0; n--, p++)
+		crc = __crc32cb(crc, *p);
+
+	return crc;
+}
+#endif
+
+static void
+digest_init(void)
+{
+	uint32_t c;
+	int i, k;
+#ifdef DIGEST_X86
+	unsigned int a, b, cx, d;
+#endif
+
+	for (i = 0; i < 256; i++) {
+		c = (uint32_t)i;
+		for (k = 0; k < 8; k++)
+			c = (c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1);
+
+		crc32c_table[0][i] = c;
+	}
+
+	for (i = 0; i < 256; i++) {
+		c = crc32c_table[0][i];
+		for (k = 1; k < 8; k++) {
+			c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+			crc32c_table[k][i] = c;
+		}
+	}
+
+	/* x^(8 * CRC32C_LANE), by squaring x^8 */
+	c = 1U << (31 - 8);
+	for (k = 8; k < 8 * CRC32C_LANE; k *= 2)
+		c = crc32c_mult(c, c);
+
+	crc32c_lane = c;
+
+	sha256_blocks = sha256_blocks_c;
+	sha256_name = "portable";
+	crc32c_update = crc32c_c;
+	crc32c_name = "portable";
+
+#ifdef DIGEST_X86
+	if (__get_cpuid(1, &a, &b, &cx, &d) && (cx & bit_SSE4_2)) {
+		crc32c_update = crc32c_x86;
+		crc32c_name = "sse4.2";
+	}
+
+	if (__get_cpuid(1, &a, &b, &cx, &d) && (cx & bit_SSE4_1)
+	    && (cx & bit_SSSE3) && __get_cpuid_count(7, 0, &a, &b, &cx, &d)
+	    && (b & bit_SHA)) {
+		sha256_blocks = sha256_blocks_x86;
+		sha256_name = "sha-ni";
+	}
+#endif
+
+#ifdef DIGEST_ARM_SHA
+	sha256_blocks = sha256_blocks_arm;
+	sha256_name = "armv8-sha2";
+#endif
+
+#ifdef DIGEST_ARM_CRC
+	crc32c_update = crc32c_arm;
+	crc32c_name = "armv8-crc32";
+#endif
+}
+
+void
+sha256_init(struct sha256 *ctx)
+{
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+
+	pthread_once(&digest_once, digest_init);
+
+	memcpy(ctx->h, h0, sizeof(ctx->h));
+	ctx->len = 0;
+}
+
+void
+sha256_update(struct sha256 *ctx, const void *data, size_t n)
+{
+	const uint8_t *p = data;
+	size_t used, k;
+
+	used = (size_t)(ctx->len % SHA256_BLOCK);
+	ctx->len += n;
+
+	if (used > 0) {
+		k = MIN(n, SHA256_BLOCK - used);
+		memcpy(ctx->buf + used, p, k);
+		p += k;
+		n -= k;
+
+		if (used + k < SHA256_BLOCK)
+			return;
+
+		(*sha256_blocks)(ctx->h, ctx->buf, 1);
+	}
+
+	(*sha256_blocks)(ctx->h, p, n / SHA256_BLOCK);
+	p += n - n % SHA256_BLOCK;
+	memcpy(ctx->buf, p, n % SHA256_BLOCK);
+}
+
+void
+sha256_final(struct sha256 *ctx, uint8_t *digest)
+{
+	uint8_t pad[2 * SHA256_BLOCK];
+	size_t used, n;
+	int i;
+
+	used = (size_t)(ctx->len % SHA256_BLOCK);
+	n = (used < SHA256_BLOCK - 8 ? SHA256_BLOCK : 2 * SHA256_BLOCK)
+	    - used;
+
+	memset(pad, 0, sizeof(pad));
+	pad[0] = 0x80;
+	be64enc(pad + n - 8, ctx->len * 8);
+
+	sha256_update(ctx, pad, n);
+
+	for (i = 0; i < 8; i++)
+		be32enc(digest + 4 * i, ctx->h[i]);
+}
+
+void
+sha256(const void *data, size_t n, uint8_t *digest)
+{
+	struct sha256 ctx;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, data, n);
+	sha256_final(&ctx, digest);
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t n)
+{
+
+	pthread_once(&digest_once, digest_init);
+
+	return ~(*crc32c_update)(~crc, data, n);
+}
+
+/*
+ * Write a digest in hex, as it is given in the index.
+ */
+char *
+digest_hex(char *buf, const uint8_t *digest, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		buf[2 * i] = hex[digest[i] >> 4];
+		buf[2 * i + 1] = hex[digest[i] & 0xf];
+	}
+
+	buf[2 * n] = '\0';
+	return buf;
+}
+
+/*
+ * Say which code is used, for the benchmarks.
+ */
+const char *
+sha256_engine(void)
+{
+
+	pthread_once(&digest_once, digest_init);
+
+	return sha256_name;
+}
+
+const char *
+crc32c_engine(void)
+{
+
+	pthread_once(&digest_once, digest_init);
+
+	return crc32c_name;
+}
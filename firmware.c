@@ -0,0 +1,686 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Firmware cache. Each distinct firmware image is loaded once per run
+ * and shared by all of the devices that use it, identified by the file
+ * (its path, device, inode, size and modification time) and, for the
+ * firmware pack, the offset within it.
+ *
+ * Once loaded, the firmware is not changed. Each user holds a reference
+ * and the cache holds one more, which is dropped by firmware_flush().
+ * Firmware from the pack refers into the mapped pack, which is opened
+ * when first needed and stays open until then. Built in firmware needs
+ * no file at all.
+ *
+ * A .hex file is only parsed when firmware_prepare() is first called,
+ * so that nothing is parsed for devices that will not be updated. If
+ * the CRC32C or SHA-256 digest of the file is known, it is checked at
+ * the same time.
+ *
+ * Devices may be updated from several threads at once, so the cache is
+ * locked by firmware_device(), firmware_release(), firmware_flush() and
+ * firmware_stamp(). The other lookups are only for use by these. Each
+ * firmware has a lock of its own which firmware_prepare() holds while
+ * the .hex file is parsed, so that different files can be parsed at the
+ * same time but each only once. A file that failed is not tried again.
+ * Parsing is one file at a time when tracing, so that the records of
+ * each file are dumped together.
+ */
+
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+
+#include "bcmfw.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t trace_parse = PTHREAD_MUTEX_INITIALIZER;
+static struct firmware *cache;
+static struct pack pack;	/* firmware pack, if any */
+static bool pack_opened;	/* pack was looked for */
+
+/* files may be compressed */
+static const char *const suffix[] = { "", LZ_SUFFIX };
+
+static struct firmware *
+firmware_lookup(const char *path, const struct stat *sb, size_t off)
+{
+	struct firmware *fw;
+
+	for (fw = cache; fw != NULL; fw = fw->next) {
+		if (fw->dev == sb->st_dev && fw->ino == sb->st_ino
+		    && fw->size == sb->st_size
+		    && timespeccmp(&fw->mtime, &sb->st_mtimespec, ==)
+		    && fw->off == off && strcmp(fw->path, path) == 0) {
+			fw->refs++;
+			return fw;
+		}
+	}
+
+	return NULL;
+}
+
+static struct firmware *
+firmware_alloc(const char *path, const struct stat *sb, size_t off)
+{
+	struct firmware *fw;
+
+	fw = ecalloc(1, sizeof(struct firmware));
+	snprintf(fw->path, sizeof(fw->path), "%s", path);
+	fw->dev = sb->st_dev;
+	fw->ino = sb->st_ino;
+	fw->size = sb->st_size;
+	fw->mtime = sb->st_mtimespec;
+	fw->off = off;
+	pthread_mutex_init(&fw->lock, NULL);
+	spanmap_init(&fw->map);
+
+	/* one for the cache, and one for the caller */
+	fw->refs = 2;
+	fw->next = cache;
+	cache = fw;
+
+	return fw;
+}
+
+static void
+firmware_free(struct firmware *fw)
+{
+
+	if (fw->img == NULL)
+		fwb_close(&fw->fwb);
+
+	image_free(fw->img);
+	spanmap_free(&fw->map);
+	pthread_mutex_destroy(&fw->lock);
+	free(fw);
+}
+
+/*
+ * Use the records from precompiled firmware, checked when it was
+ * opened. Returns -1 if the records overlap.
+ */
+static int
+firmware_fwb(struct firmware *fw)
+{
+
+	if (fwb_check(&fw->fwb, &fw->map) == -1)
+		return -1;
+
+	snprintf(fw->name, sizeof(fw->name), "%s", fw->fwb.name);
+	fw->rec = fw->fwb.rec;
+	fw->len = fw->fwb.len;
+	fw->count = fw->fwb.count;
+	fw->nrec = fw->fwb.nrec;
+	fw->starttype = fw->fwb.starttype;
+	fw->start = fw->fwb.start;
+	fw->ready = true;
+
+	return 0;
+}
+
+/*
+ * Use a precompiled firmware file if there is one that is good.
+ */
+static struct firmware *
+firmware_fwbfile(const char *path)
+{
+	struct firmware *fw;
+	struct stat sb;
+
+	if (stat(path, &sb) == -1)
+		return NULL;
+
+	fw = firmware_lookup(path, &sb, 0);
+	if (fw != NULL)
+		return fw;
+
+	fw = firmware_alloc(path, &sb, 0);
+	if (fwb_open(&fw->fwb, path) == 0 && firmware_fwb(fw) == 0)
+		return fw;
+
+	warnx("%s", fwb_error(&fw->fwb));
+
+	/* forget it, and use the .hex file */
+	cache = fw->next;
+	firmware_free(fw);
+	return NULL;
+}
+
+/*
+ * Find the firmware for a .hex file, preferring the precompiled form
+ * that was made by bcmfw-install if there is one that is good, and
+ * either form may be compressed. The digest and CRC of the .hex file,
+ * if given, are checked before it is used. Returns NULL if there is no such file.
+ */
+struct firmware *
+firmware_open(const char *file, const char *digest, const char *crc)
+{
+	struct firmware *fw;
+	struct stat sb;
+	char *path;
+	size_t i, len;
+
+	len = strlen(file);
+	if (len > 4 && strcasecmp(&file[len - 4], ".hex") == 0) {
+		for (i = 0; i < __arraycount(suffix); i++) {
+			easprintf(&path, "%.*s%s%s", (int)(len - 4), file,
+			    FWB_SUFFIX, suffix[i]);
+			fw = firmware_fwbfile(path);
+			free(path);
+
+			if (fw != NULL)
+				return fw;
+		}
+	}
+
+	for (i = 0; i < __arraycount(suffix); i++) {
+		easprintf(&path, "%s%s", file, suffix[i]);
+		if (stat(path, &sb) == 0) {
+			fw = firmware_lookup(path, &sb, 0);
+			if (fw == NULL) {
+				fw = firmware_alloc(path, &sb, 0);
+				snprintf(fw->name, sizeof(fw->name), "%s", path);
+				if (digest != NULL)
+					snprintf(fw->digest, sizeof(fw->digest),
+					    "%s", digest);
+				if (crc != NULL)
+					snprintf(fw->crc, sizeof(fw->crc),
+					    "%s", crc);
+			}
+
+			free(path);
+			return fw;
+		}
+
+		free(path);
+	}
+
+	return NULL;
+}
+
+/*
+ * Find the firmware for a device in the firmware pack. Returns NULL if
+ * the device is not in the pack, with a warning if the pack is damaged.
+ */
+struct firmware *
+firmware_find(struct pack *pk, uint16_t vid, uint16_t pid)
+{
+	struct firmware *fw;
+	const char *name;
+	char *ref;
+	size_t off, len;
+	int rv;
+
+	switch (pack_find(pk, vid, pid, &name, &off, &len)) {
+	case 1:
+		break;
+
+	case -1:
+		warnx("%s", pack_error(pk));
+		/* FALLTHROUGH */
+	default:
+		return NULL;
+	}
+
+	fw = firmware_lookup(pk->name, &pk->sb, off);
+	if (fw != NULL)
+		return fw;
+
+	fw = firmware_alloc(pk->name, &pk->sb, off);
+	easprintf(&ref, "%s(%s)", pk->name, name);
+	rv = fwb_init(&fw->fwb, ref, pk->buf + off, len);
+	free(ref);
+
+	if (rv == 0 && firmware_fwb(fw) == 0)
+		return fw;
+
+	warnx("%s", fwb_error(&fw->fwb));
+	cache = fw->next;
+	firmware_free(fw);
+	return NULL;
+}
+
+#ifdef BCMFW_EMBED
+/*
+ * Find the firmware for a device in the table built in to bcmfw. This
+ * was checked when the table was made, and is used as it is. Returns
+ * NULL if the device is not in the table.
+ */
+struct firmware *
+firmware_embedded(uint16_t vid, uint16_t pid)
+{
+	const struct embed *e;
+	struct firmware *fw;
+	uint32_t key, k;
+	size_t lo, hi, mid, i;
+
+	key = (uint32_t)vid << 16 | pid;
+	e = NULL;
+	lo = 0;
+	hi = embed_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		k = (uint32_t)embed_table[mid].vid << 16 | embed_table[mid].pid;
+		if (k == key) {
+			e = &embed_table[mid];
+			break;
+		}
+
+		if (k < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (e == NULL)
+		return NULL;
+
+	/* devices with the same firmware share the records */
+	for (fw = cache; fw != NULL; fw = fw->next) {
+		if (fw->embed != NULL && fw->rec == e->rec) {
+			fw->refs++;
+			return fw;
+		}
+	}
+
+	fw = ecalloc(1, sizeof(struct firmware));
+	snprintf(fw->name, sizeof(fw->name), "built-in(%s)", e->name);
+	fw->embed = e;
+	fw->rec = e->rec;
+	fw->len = e->len;
+	fw->count = e->count;
+	fw->nrec = e->nrec;
+	fw->starttype = e->starttype;
+	fw->start = e->start;
+	fw->ready = true;
+
+	pthread_mutex_init(&fw->lock, NULL);
+	spanmap_init(&fw->map);
+	for (i = 0; i < e->nspan; i++)
+		spanmap_add(&fw->map, e->span[i].addr, (size_t)e->span[i].len);
+
+	fw->refs = 2;
+	fw->next = cache;
+	cache = fw;
+
+	return fw;
+}
+#endif
+
+static struct firmware *
+firmware_search(uint16_t vid, uint16_t pid)
+{
+	struct firmware *fw;
+	char *line, *file, *digest, *crc, *blob;
+	size_t size;
+	ssize_t len;
+	FILE *i;
+	unsigned int v, p;
+	int n;
+
+#ifdef BCMFW_EMBED
+	fw = firmware_embedded(vid, pid);
+	if (fw != NULL)
+		return fw;
+#endif
+
+	firmware_chdir();
+
+	if (!pack_opened) {
+		pack_opened = true;
+		if (pack_open(&pack, PACK_FILE) == -1 && errno != ENOENT)
+			warnx("%s", pack_error(&pack));
+	}
+
+	if (pack.buf != NULL) {
+		fw = firmware_find(&pack, vid, pid);
+		if (fw != NULL)
+			return fw;
+	}
+
+	if ((i = fopen("index.txt", "r")) == NULL)
+		return NULL;
+
+	fw = NULL;
+	line = NULL;
+	size = 0;
+
+	while ((len = getline(&line, &size, i)) != EOF) {
+		if (sscanf(line, "%x:%x\t%n%*s\n", &v, &p, &n) != 2
+		    || v != vid || p != pid)
+			continue;
+
+		line[len - 1] = '\0';
+		file = &line[n];
+
+		/*
+		 * The digest, if given, names the installed copy of the
+		 * file. Use that, and fall back to the file name if it is
+		 * not there. The CRC may follow.
+		 */
+		crc = NULL;
+		digest = strchr(file, '\t');
+		if (digest != NULL) {
+			*digest++ = '\0';
+			crc = strchr(digest, '\t');
+			if (crc != NULL) {
+				*crc++ = '\0';
+				if (strlen(crc) != BLOB_CRCLEN)
+					crc = NULL;
+			}
+
+			if (strlen(digest) != BLOB_DIGESTLEN)
+				digest = NULL;
+		}
+
+		if (digest != NULL) {
+			easprintf(&blob, "%s/%s.hex", BLOB_DIR, digest);
+			fw = firmware_open(blob, digest, crc);
+			free(blob);
+		}
+
+		if (fw == NULL)
+			fw = firmware_open(file, digest, crc);
+
+		break;
+	}
+
+	free(line);
+	fclose(i);
+	return fw;
+}
+
+/*
+ * Find the firmware for a device, from the firmware built in to bcmfw
+ * or the firmware pack if possible, or else with the index file in the
+ * firmware directory. Returns NULL if there is none.
+ */
+struct firmware *
+firmware_device(uint16_t vid, uint16_t pid)
+{
+	struct firmware *fw;
+
+	pthread_mutex_lock(&lock);
+	fw = firmware_search(vid, pid);
+	pthread_mutex_unlock(&lock);
+
+	return fw;
+}
+
+static int __printflike(2, 3)
+firmware_fail(struct firmware *fw, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(fw->error, sizeof(fw->error), fmt, ap);
+	va_end(ap);
+
+	return -1;
+}
+
+const char *
+firmware_error(const struct firmware *fw)
+{
+
+	return fw->error;
+}
+
+/*
+ * The digests of the file contents, which are taken as the file is read
+ * when it is compressed.
+ */
+struct contents {
+	struct sha256	sha;
+	uint32_t	crc;
+	size_t		len;
+};
+
+static void
+contents_add(void *arg, const uint8_t *buf, size_t len)
+{
+	struct contents *c = arg;
+
+	sha256_update(&c->sha, buf, len);
+	c->crc = crc32c(c->crc, buf, len);
+	c->len += len;
+}
+
+static int
+contents_check(struct firmware *fw, struct contents *c)
+{
+	uint8_t digest[SHA256_LEN];
+	char str[2 * SHA256_LEN + 1];
+
+	if (fw->crc[0] != '\0') {
+		snprintf(str, sizeof(str), "%08x", c->crc);
+		if (strcasecmp(str, fw->crc) != 0)
+			return firmware_fail(fw, "%s: CRC mismatch", fw->path);
+	}
+
+	if (fw->digest[0] != '\0') {
+		sha256_final(&c->sha, digest);
+		digest_hex(str, digest, sizeof(digest));
+		if (strcasecmp(str, fw->digest) != 0)
+			return firmware_fail(fw, "%s: SHA-256 digest mismatch",
+			    fw->path);
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the .hex file into an image. The contents are checked against
+ * the digests before the parse when the file is in memory, and after it
+ * when the file is decoded as it is read, with the image thrown away if
+ * they don't match.
+ */
+static int
+firmware_parse(struct firmware *fw)
+{
+	struct contents c;
+	struct ihex *ih;
+	bool checked;
+	int rv;
+
+	if (fw->ready)
+		return 0;
+
+	if (fw->error[0] != '\0')
+		return -1;
+
+	ih = emalloc(sizeof(struct ihex));
+	if (ihex_open(ih, fw->path) == -1) {
+		firmware_fail(fw, "%s", ihex_error(ih));
+		free(ih);
+		return -1;
+	}
+
+	memset(&c, 0, sizeof(c));
+	sha256_init(&c.sha);
+	ihex_observe(ih, contents_add, &c);
+
+	checked = (c.len == ih->size);
+	if (checked && contents_check(fw, &c) == -1) {
+		rv = -1;
+		goto out;
+	}
+
+	fw->img = ihex_image(ih, &fw->map);
+	if (fw->img == NULL) {
+		rv = firmware_fail(fw, "%s", ihex_error(ih));
+		goto out;
+	}
+
+	if (!checked && contents_check(fw, &c) == -1) {
+		image_free(fw->img);
+		fw->img = NULL;
+		rv = -1;
+		goto out;
+	}
+
+	fw->rec = fw->img->buf;
+	fw->len = fw->img->len;
+	fw->count = fw->img->count;
+	fw->nrec = ih->nrec;
+	fw->starttype = ih->starttype;
+	fw->start = ih->start;
+	fw->ready = true;
+	rv = 0;
+
+out:
+	if (rv == -1)
+		spanmap_free(&fw->map);
+
+	ihex_close(ih);
+	free(ih);
+	return rv;
+}
+
+/*
+ * Make sure that the records are available, parsing the .hex file the
+ * first time. The whole file is checked before any record is used, and
+ * any text trace of it goes to log if that is given.
+ * Returns -1 if the file is no good.
+ */
+int
+firmware_prepare(struct firmware *fw, FILE *log)
+{
+	bool traced;
+	int rv;
+
+	pthread_mutex_lock(&fw->lock);
+	traced = (!fw->ready && tracing());
+	if (traced) {
+		pthread_mutex_lock(&trace_parse);
+		trace_output(log);
+	}
+
+	rv = firmware_parse(fw);
+
+	if (traced) {
+		trace_output(NULL);
+		pthread_mutex_unlock(&trace_parse);
+	}
+	pthread_mutex_unlock(&fw->lock);
+
+	return rv;
+}
+
+void
+firmware_release(struct firmware *fw)
+{
+	struct firmware **p;
+
+	if (fw == NULL)
+		return;
+
+	pthread_mutex_lock(&lock);
+	if (--fw->refs == 0) {
+		for (p = &cache; *p != NULL; p = &(*p)->next) {
+			if (*p == fw) {
+				*p = fw->next;
+				break;
+			}
+		}
+
+		firmware_free(fw);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Drop the references held by the cache, so that the firmware is freed
+ * when the last user releases it, and close the firmware pack. Nothing
+ * from the pack may be used after this.
+ */
+void
+firmware_flush(void)
+{
+	struct firmware *fw;
+
+	pthread_mutex_lock(&lock);
+	while ((fw = cache) != NULL) {
+		cache = fw->next;
+		fw->next = NULL;
+		if (--fw->refs == 0)
+			firmware_free(fw);
+	}
+
+	pack_close(&pack);
+	pack_opened = false;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Make a stamp for the firmware that can be found, from the identity of
+ * the pack and index files and from the built in firmware, so that what
+ * was decided with other firmware can be seen to be out of date.
+ */
+void
+firmware_stamp(char *buf)
+{
+	static const char *const file[] = { PACK_FILE, "index.txt" };
+	struct stat sb;
+	uint32_t crc;
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	firmware_chdir();
+
+	crc = 0;
+	for (i = 0; i < __arraycount(file); i++) {
+		if (stat(file[i], &sb) == -1)
+			continue;
+
+		crc = crc32c(crc, file[i], strlen(file[i]));
+		crc = crc32c(crc, &sb.st_dev, sizeof(sb.st_dev));
+		crc = crc32c(crc, &sb.st_ino, sizeof(sb.st_ino));
+		crc = crc32c(crc, &sb.st_size, sizeof(sb.st_size));
+		crc = crc32c(crc, &sb.st_mtimespec, sizeof(sb.st_mtimespec));
+	}
+
+#ifdef BCMFW_EMBED
+	for (i = 0; i < embed_count; i++) {
+		crc = crc32c(crc, &embed_table[i].vid, sizeof(uint16_t));
+		crc = crc32c(crc, &embed_table[i].pid, sizeof(uint16_t));
+		crc = crc32c(crc, embed_table[i].name,
+		    strlen(embed_table[i].name));
+		crc = crc32c(crc, &embed_table[i].len, sizeof(size_t));
+	}
+#endif
+	pthread_mutex_unlock(&lock);
+
+	snprintf(buf, BLOB_CRCLEN + 1, "%08x", crc);
+}
@@ -0,0 +1,387 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Precompiled firmware files are made by bcmfw-install from the Patch
+ * RAM .hex files, which are checked once at install time. The file is
+ * a header, followed by the Write RAM command parameters packed in the
+ * same way as an image, ready to be sent from the mapped file.
+ *
+ *	[0]	u8[4]	magic "BFWB"
+ *	[4]	u16	format version
+ *	[6]	u16	header length
+ *	[8]	u32	number of Write RAM records
+ *	[12]	u32	length of the records
+ *	[16]	u32	Data records in the .hex file
+ *	[20]	u32	start address
+ *	[24]	u8	start address record type, or 0
+ *	[25]	u8[3]	reserved
+ *	[28]	u32	CRC32C of the records
+ *	[32]	u8[32]	SHA-256 digest of the records
+ *
+ * All values are little endian.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+
+static void __printflike(2, 3)
+fwb_fail(struct fwb *fw, const char *fmt, ...)
+{
+	char msg[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	snprintf(fw->error, sizeof(fw->error), "%s: %s", fw->name, msg);
+}
+
+/*
+ * Make sure that the precompiled firmware is whole.
+ */
+static int
+fwb_load(struct fwb *fw)
+{
+	uint8_t digest[SHA256_LEN];
+	const uint8_t *r;
+	size_t hdrlen, n;
+
+	if (fw->size < FWB_HDRLEN
+	    || memcmp(fw->buf, FWB_MAGIC, 4) != 0) {
+		fwb_fail(fw, "not a precompiled firmware file");
+		return -1;
+	}
+
+	if (le16dec(fw->buf + 4) != FWB_VERSION) {
+		fwb_fail(fw, "unknown format version %u",
+		    le16dec(fw->buf + 4));
+		return -1;
+	}
+
+	hdrlen = le16dec(fw->buf + 6);
+	fw->count = le32dec(fw->buf + 8);
+	fw->len = le32dec(fw->buf + 12);
+	fw->nrec = le32dec(fw->buf + 16);
+	fw->start = le32dec(fw->buf + 20);
+	fw->starttype = fw->buf[24];
+
+	if (hdrlen < FWB_HDRLEN || hdrlen > fw->size
+	    || fw->len != fw->size - hdrlen) {
+		fwb_fail(fw, "bad length");
+		return -1;
+	}
+
+	fw->rec = fw->ptr = fw->buf + hdrlen;
+
+	/* each record must hold an address and some data */
+	n = 0;
+	for (r = fw->rec; r < fw->rec + fw->len; r += 1 + r[0]) {
+		if (r[0] <= sizeof(uint32_t)
+		    || (size_t)(fw->rec + fw->len - r) < 1 + (size_t)r[0]) {
+			fwb_fail(fw, "bad record at offset %zu",
+			    (size_t)(r - fw->buf));
+			return -1;
+		}
+
+		n++;
+	}
+
+	if (n != fw->count) {
+		fwb_fail(fw, "bad record count");
+		return -1;
+	}
+
+	/* the CRC is much quicker, and finds most damage first */
+	if (crc32c(0, fw->rec, fw->len) != le32dec(fw->buf + 28)) {
+		fwb_fail(fw, "CRC mismatch");
+		return -1;
+	}
+
+	sha256(fw->rec, fw->len, digest);
+	if (memcmp(digest, fw->buf + 32, sizeof(digest)) != 0) {
+		fwb_fail(fw, "digest mismatch");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Open and map a precompiled firmware file, or read it if compressed,
+ * and make sure that it is whole. Returns 0 on success or -1 on error,
+ * see fwb_error(). If the file does not exist, errno is ENOENT.
+ */
+int
+fwb_open(struct fwb *fw, const char *file)
+{
+	struct stat sb;
+	int fd, e;
+
+	memset(fw, 0, sizeof(*fw));
+	snprintf(fw->name, sizeof(fw->name), "%s", file);
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		goto fail;
+
+	if (fstat(fd, &sb) == -1)
+		goto fail;
+
+	if (lz_name(file)) {
+		if (lz_read(fd, &fw->buf, &fw->size) == -1)
+			goto fail;
+
+		close(fd);
+		fw->allocated = true;
+
+		if (fwb_load(fw) == -1) {
+			free(fw->buf);
+			fw->buf = NULL;
+			errno = EFTYPE;
+			return -1;
+		}
+
+		return 0;
+	}
+
+	if (!S_ISREG(sb.st_mode) || sb.st_size < FWB_HDRLEN
+	    || (uintmax_t)sb.st_size > SIZE_MAX) {
+		errno = EFTYPE;
+		goto fail;
+	}
+
+	fw->size = (size_t)sb.st_size;
+	fw->buf = mmap(NULL, fw->size, PROT_READ, MAP_FILE | MAP_PRIVATE,
+	    fd, 0);
+	if (fw->buf == MAP_FAILED)
+		goto fail;
+
+	close(fd);
+	fw->mapped = true;
+
+	if (fwb_load(fw) == -1) {
+		munmap(fw->buf, fw->size);
+		fw->buf = NULL;
+		errno = EFTYPE;
+		return -1;
+	}
+
+	return 0;
+
+fail:
+	e = errno;
+	fwb_fail(fw, "%s", strerror(e));
+	if (fd != -1)
+		close(fd);
+	fw->buf = NULL;
+	errno = e;
+	return -1;
+}
+
+/*
+ * Use precompiled firmware that is already in memory, such as from
+ * a firmware pack, after making sure that it is whole. Returns 0 on
+ * success or -1 on error, see fwb_error().
+ */
+int
+fwb_init(struct fwb *fw, const char *name, const uint8_t *buf, size_t size)
+{
+
+	memset(fw, 0, sizeof(*fw));
+	snprintf(fw->name, sizeof(fw->name), "%s", name);
+
+	fw->buf = __UNCONST(buf);
+	fw->size = size;
+	fw->mapped = false;
+
+	if (fwb_load(fw) == -1) {
+		fw->buf = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Return the next Write RAM command parameters from the file. Returns 1
+ * with a pointer into the mapped file, or 0 when there are no more.
+ */
+int
+fwb_next(struct fwb *fw, const uint8_t **cp, size_t *len)
+{
+
+	if (fw->ptr >= fw->rec + fw->len)
+		return 0;
+
+	*cp = IMAGE_PARAM(fw->ptr);
+	*len = IMAGE_PARAMLEN(fw->ptr);
+	fw->ptr += 1 + fw->ptr[0];
+	return 1;
+}
+
+/*
+ * Add the address ranges written by the file to the map. Returns -1 if
+ * any of them overlap.
+ */
+int
+fwb_check(struct fwb *fw, struct spanmap *map)
+{
+	const uint8_t *r;
+
+	for (r = fw->rec; r < fw->rec + fw->len; r += 1 + r[0]) {
+		if (spanmap_add(map, IMAGE_ADDR(r), IMAGE_DATALEN(r)) == -1) {
+			fwb_fail(fw, "data at 0x%08x overlaps earlier data",
+			    IMAGE_ADDR(r));
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void
+fwb_close(struct fwb *fw)
+{
+
+	if (fw->buf != NULL && fw->mapped)
+		munmap(fw->buf, fw->size);
+	else if (fw->allocated)
+		free(fw->buf);
+
+	fw->buf = NULL;
+	fw->rec = fw->ptr = NULL;
+}
+
+const char *
+fwb_error(const struct fwb *fw)
+{
+
+	return fw->error;
+}
+
+/*
+ * Make a precompiled firmware file from a Patch RAM .hex file, which
+ * may be compressed. The file is written under a temporary name and
+ * renamed when complete. Returns false if the .hex file is malformed or
+ * the file could not be written, with a warning.
+ */
+bool
+fwb_write(const char *hexfile, const char *file, bool compress)
+{
+	struct ihex ih;
+	struct spanmap map;
+	struct image *img;
+	uint8_t *buf;
+	size_t len;
+	char *tmp;
+	FILE *f;
+	bool ok;
+
+	if (ihex_open(&ih, hexfile) == -1) {
+		warnx("%s", ihex_error(&ih));
+		return false;
+	}
+
+	spanmap_init(&map);
+	img = ihex_image(&ih, &map);
+	spanmap_free(&map);
+
+	if (img == NULL) {
+		warnx("%s", ihex_error(&ih));
+		ihex_close(&ih);
+		return false;
+	}
+
+	len = FWB_HDRLEN + img->len;
+	buf = ecalloc(1, len);
+	memcpy(buf + FWB_HDRLEN, img->buf, img->len);
+
+	memcpy(buf, FWB_MAGIC, 4);
+	le16enc(buf + 4, FWB_VERSION);
+	le16enc(buf + 6, FWB_HDRLEN);
+	le32enc(buf + 8, (uint32_t)img->count);
+	le32enc(buf + 12, (uint32_t)img->len);
+	le32enc(buf + 16, (uint32_t)ih.nrec);
+	le32enc(buf + 20, ih.start);
+	buf[24] = ih.starttype;
+	le32enc(buf + 28, crc32c(0, img->buf, img->len));
+	sha256(img->buf, img->len, buf + 32);
+
+	image_free(img);
+	ihex_close(&ih);
+
+	ok = false;
+	easprintf(&tmp, "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		warn("%s", tmp);
+		goto done;
+	}
+
+	if (compress)
+		lz_fwrite(f, buf, len);
+	else
+		fwrite(buf, 1, len, f);
+
+	if (ferror(f)) {
+		warn("%s", tmp);
+		fclose(f);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (fclose(f) == EOF) {
+		warn("%s", tmp);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (rename(tmp, file) == -1) {
+		warn("%s", file);
+		unlink(tmp);
+		goto done;
+	}
+
+	ok = true;
+
+done:
+	free(tmp);
+	free(buf);
+	return ok;
+}
@@ -0,0 +1,693 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HCI command engine. Commands are written directly to the descriptor
+ * that the transport connected to the device, as many at a time as the
+ * controller has said that it will take, and the Command Complete and
+ * Command Status events are matched to them as they arrive, so that a
+ * stream of commands is limited by the link rather than by waiting for
+ * each one to be answered.
+ *
+ * Each Command Complete or Command Status event gives the number of
+ * commands that the controller can take (Num_HCI_Command_Packets), and
+ * one is used for each command sent. Events for the same opcode arrive
+ * in the order that the commands were sent, so they are matched to the
+ * oldest command with that opcode that is still waiting.
+ *
+ * A long run of the same command, such as the Write RAM blocks of a
+ * firmware download, can be laid out once as framed packets which point
+ * into the records they are sent from, and streamed with sendmmsg(2) so
+ * that each system call sends all that the controller will take.
+ *
+ * The round trip time is measured, one command at a time, and smoothed
+ * as TCP does (RFC 6298). A streamed packet that fails, or a stream that
+ * makes no progress for the timeout derived from that, is taken up again
+ * once the answers to the packets still waiting have come in or timed
+ * out, and then the packets that were not done are sent again. This is
+ * done a few times without progress before giving up, and only for
+ * streams, where each packet can be sent again without harm.
+ *
+ * The answers to streamed packets carry nothing but the opcode, so they
+ * are matched to the packets in the order that these were sent. If some
+ * go missing, those that came after may have been taken for the wrong
+ * packets, so every packet that was sent since all the answers were last
+ * in is sent again, and the rest of the stream is sent one packet at a
+ * time. The answers that were given up on may still come in after that,
+ * and since they would arrive ahead of the answer to the next packet, as
+ * many answers as were given up on are not trusted. Each counts as a
+ * failure, and the packet it came for is sent again.
+ *
+ * A command that completes with a failed status stops the engine, and
+ * the error is returned for that and every later call. Each wait has a
+ * deadline, the timeout from when the call was made, rather than
+ * sleeping for a fixed time.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+
+#include <bluetooth.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "hci.h"
+
+static void __printflike(2, 3)
+hci_fail(struct hci *h, const char *fmt, ...)
+{
+	va_list ap;
+
+	if (h->failed)
+		return;
+
+	va_start(ap, fmt);
+	vsnprintf(h->error, sizeof(h->error), fmt, ap);
+	va_end(ap);
+
+	h->failed = true;
+}
+
+/*
+ * Start using the descriptor, which must be connected to the device and
+ * pass only HCI events. The controller will take 'credits' commands to
+ * start with, and the timeout is in milliseconds.
+ */
+void
+hci_open(struct hci *h, int fd, unsigned int credits, int timeout)
+{
+
+	memset(h, 0, sizeof(*h));
+	h->fd = fd;
+	h->credits = MAX(credits, 1);
+	h->timeout = timeout;
+	h->rto = timeout;
+}
+
+/*
+ * Stop using the descriptor. Any commands still waiting are forgotten.
+ */
+void
+hci_close(struct hci *h)
+{
+
+	h->count = 0;
+}
+
+/*
+ * Forget any commands still waiting and clear the error, as when the
+ * controller has been reset.
+ */
+void
+hci_restart(struct hci *h)
+{
+
+	h->head = 0;
+	h->count = 0;
+	h->shead = 0;
+	h->stream = 0;
+	h->credits = 1;
+	h->timing = false;
+	h->failed = false;
+	h->error[0] = '\0';
+}
+
+const char *
+hci_error(const struct hci *h)
+{
+
+	return h->error;
+}
+
+/*
+ * Start timing a round trip, if one is not being timed already.
+ */
+static void
+hci_rtstart(struct hci *h, const struct hci_cmd *cmd, size_t seq)
+{
+
+	if (h->timing)
+		return;
+
+	h->timing = true;
+	h->rtcmd = cmd;
+	h->rtseq = seq;
+	clock_gettime(CLOCK_MONOTONIC, &h->rtstart);
+}
+
+/*
+ * The timed round trip is over, so update the smoothed round trip time
+ * and its variation, and the stream timeout.
+ */
+static void
+hci_rtdone(struct hci *h)
+{
+	struct timespec now, ts;
+	int rtt, delta;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &h->rtstart, &ts);
+	rtt = (int)MAX(ts.tv_sec * 1000000 + ts.tv_nsec / 1000, 1);
+
+	if (h->srtt == 0) {
+		h->srtt = rtt;
+		h->rttvar = rtt / 2;
+	} else {
+		delta = (rtt > h->srtt ? rtt - h->srtt : h->srtt - rtt);
+		h->rttvar += (delta - h->rttvar) / 4;
+		h->srtt += (rtt - h->srtt) / 8;
+	}
+
+	h->rto = (h->srtt + 4 * h->rttvar + 999) / 1000;
+	h->rto = MIN(MAX(h->rto, HCI_RTO_MIN), h->timeout);
+	h->timing = false;
+}
+
+/*
+ * Match an event to the oldest command waiting for it, and retire the
+ * commands at the head of the queue that are done.
+ */
+static void
+hci_complete(struct hci *h, uint16_t opcode, uint8_t status,
+    const uint8_t *rp, size_t rlen)
+{
+	struct hci_cmd *cmd;
+	size_t i, seq;
+
+	if (h->sdone != NULL && opcode == h->sopcode && h->stream == 0
+	    && h->slate > 0) {
+		h->slate--;
+		return;		/* late, and waited for by nothing */
+	}
+
+	if (h->stream > 0 && opcode == h->sopcode) {
+		seq = h->sseq[h->shead];
+		h->shead = (h->shead + 1) % HCI_MAXSTREAM;
+		if (--h->stream == 0)
+			h->ssync = h->sserial + 1;
+
+		if (status != 0) {
+			hci_fail(h, "command 0x%04x failed, status 0x%02x",
+			    opcode, status);
+			return;
+		}
+
+		/* it may be late, so the packet is sent again */
+		if (h->slate > 0) {
+			h->slate--;
+			if (h->timing && h->rtcmd == NULL && h->rtseq == seq)
+				h->timing = false;
+
+			return;
+		}
+
+		if (!h->sdone[seq]) {
+			h->sdone[seq] = true;
+			h->sleft--;
+		}
+
+		if (h->timing && h->rtcmd == NULL && h->rtseq == seq)
+			hci_rtdone(h);
+
+		return;
+	}
+
+	for (i = 0; i < h->count; i++) {
+		cmd = h->queue[(h->head + i) % HCI_MAXQUEUE];
+		if (cmd->opcode == opcode && !cmd->done)
+			break;
+	}
+
+	if (i == h->count)
+		return;		/* not ours */
+
+	if (cmd->rparam != NULL) {
+		cmd->rlen = MIN(cmd->rlen, rlen);
+		memcpy(cmd->rparam, rp, cmd->rlen);
+	} else {
+		cmd->rlen = 0;
+	}
+
+	cmd->status = status;
+	cmd->done = true;
+
+	if (h->timing && h->rtcmd == cmd)
+		hci_rtdone(h);
+
+	if (status != 0)
+		hci_fail(h, "command 0x%04x failed, status 0x%02x",
+		    opcode, status);
+
+	while (h->count > 0 && h->queue[h->head]->done) {
+		h->head = (h->head + 1) % HCI_MAXQUEUE;
+		h->count--;
+	}
+}
+
+/*
+ * Set the deadline for a wait of 'ms' milliseconds that starts now.
+ */
+static void
+hci_deadline(int ms, struct timespec *end)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+
+	clock_gettime(CLOCK_MONOTONIC, end);
+	timespecadd(end, &ts, end);
+}
+
+/*
+ * Read one event, waiting for it until the deadline if needed.
+ */
+static int
+hci_event(struct hci *h, const struct timespec *end)
+{
+	uint8_t buf[HCI_EVENT_PKT_SIZE];
+	const hci_event_hdr_t *hdr;
+	const uint8_t *ep;
+	struct timespec now, ts;
+	struct pollfd pfd;
+	ssize_t n;
+	int ms, rv;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespeccmp(&now, end, <)) {
+		timespecsub(end, &now, &ts);
+		ms = (int)(ts.tv_sec * 1000 + (ts.tv_nsec + 999999) / 1000000);
+	} else {
+		ms = 0;
+	}
+
+	pfd.fd = h->fd;
+	pfd.events = POLLIN;
+
+	rv = poll(&pfd, 1, ms);
+	if (rv == -1) {
+		if (errno == EINTR)
+			return 0;
+
+		hci_fail(h, "poll: %s", strerror(errno));
+		return -1;
+	}
+
+	if (rv == 0) {
+		h->rto = MIN(h->rto * 2, h->timeout);
+
+		if (h->stream > 0)
+			hci_fail(h, "command 0x%04x timed out", h->sopcode);
+		else if (h->count > 0)
+			hci_fail(h, "command 0x%04x timed out",
+			    h->queue[h->head]->opcode);
+		else
+			hci_fail(h, "timed out waiting for the controller");
+
+		return -1;
+	}
+
+	n = recv(h->fd, buf, sizeof(buf), 0);
+	if (n == -1) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+
+		hci_fail(h, "recv: %s", strerror(errno));
+		return -1;
+	}
+
+	hdr = (const hci_event_hdr_t *)buf;
+	if ((size_t)n < sizeof(*hdr) || hdr->type != HCI_EVENT_PKT
+	    || (size_t)n < sizeof(*hdr) + hdr->length)
+		return 0;
+
+	ep = buf + sizeof(*hdr);
+	switch (hdr->event) {
+	case HCI_EVENT_COMMAND_COMPL:	/* [0] u8 ncmd, [1] u16 opcode */
+		if (hdr->length < 3)
+			break;
+
+		h->credits = ep[0];
+		if (hdr->length > 3)
+			hci_complete(h, le16dec(ep + 1), ep[3], ep + 3,
+			    hdr->length - 3u);
+		else
+			hci_complete(h, le16dec(ep + 1), 0, NULL, 0);
+		break;
+
+	case HCI_EVENT_COMMAND_STATUS:	/* [0] u8 status, [1] u8 ncmd,
+					   [2] u16 opcode */
+		if (hdr->length < 4)
+			break;
+
+		h->credits = ep[1];
+		hci_complete(h, le16dec(ep + 2), ep[0], ep, 1);
+		break;
+
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Send a command, once the controller will take it. The command must
+ * stay in place until it is done, and then holds the status and the
+ * return parameters, if space was given for them.
+ */
+int
+hci_send(struct hci *h, struct hci_cmd *cmd)
+{
+	hci_cmd_hdr_t hdr;
+	struct iovec iov[2];
+	struct timespec end;
+	ssize_t n;
+
+	if (h->credits == 0 || h->count == HCI_MAXQUEUE)
+		hci_deadline(h->timeout, &end);
+
+	while (!h->failed && (h->credits == 0 || h->count == HCI_MAXQUEUE)) {
+		if (hci_event(h, &end) == -1)
+			return -1;
+	}
+
+	if (h->failed)
+		return -1;
+
+	if (cmd->clen > UINT8_MAX) {
+		hci_fail(h, "command 0x%04x too long", cmd->opcode);
+		return -1;
+	}
+
+	hdr.type = HCI_CMD_PKT;
+	hdr.opcode = htole16(cmd->opcode);
+	hdr.length = (uint8_t)cmd->clen;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = __UNCONST(cmd->cparam);
+	iov[1].iov_len = cmd->clen;
+
+	cmd->done = false;
+	cmd->status = 0;
+
+	n = writev(h->fd, iov, __arraycount(iov));
+	if (n != (ssize_t)(sizeof(hdr) + cmd->clen)) {
+		hci_fail(h, "send: %s",
+		    (n == -1 ? strerror(errno) : "short write"));
+		return -1;
+	}
+
+	h->queue[(h->head + h->count) % HCI_MAXQUEUE] = cmd;
+	h->count++;
+	h->credits--;
+
+	hci_rtstart(h, cmd, 0);
+
+	return 0;
+}
+
+/*
+ * Lay out packed records, each a length byte and that many parameter
+ * bytes, as command packets for the opcode. Nothing is copied, so the
+ * records must stay in place while the packets are used.
+ */
+void
+hci_frames(struct hci_frames *f, uint16_t opcode, const uint8_t *rec,
+    size_t len, size_t count)
+{
+	const uint8_t *r;
+	size_t i;
+
+	f->opcode = opcode;
+	f->hdr[0] = HCI_CMD_PKT;
+	le16enc(&f->hdr[1], opcode);
+
+	f->iov = ecalloc(count * 2, sizeof(*f->iov));
+	f->msg = ecalloc(count, sizeof(*f->msg));
+
+	i = 0;
+	for (r = rec; r < rec + len && i < count; r += 1 + r[0]) {
+		f->iov[i * 2].iov_base = f->hdr;
+		f->iov[i * 2].iov_len = sizeof(f->hdr);
+		f->iov[i * 2 + 1].iov_base = __UNCONST(r);
+		f->iov[i * 2 + 1].iov_len = 1 + r[0];
+
+		f->msg[i].msg_hdr.msg_iov = &f->iov[i * 2];
+		f->msg[i].msg_hdr.msg_iovlen = 2;
+		i++;
+	}
+
+	f->count = i;
+}
+
+void
+hci_frames_free(struct hci_frames *f)
+{
+
+	free(f->iov);
+	free(f->msg);
+	memset(f, 0, sizeof(*f));
+}
+
+/*
+ * Wait for the answers to the packets still waiting, after the stream
+ * has failed, so that none can be taken for a packet sent again.
+ */
+static void
+hci_drain(struct hci *h)
+{
+	struct timespec end;
+
+	hci_deadline(h->rto, &end);
+	while (h->stream > 0 && hci_event(h, &end) == 0)
+		continue;
+}
+
+/*
+ * Answers are missing, so those that came in since the last time that
+ * none were waiting may have been matched to the wrong packets. Send all
+ * of those packets again, and the rest of the stream one at a time. The
+ * answers still waited for may yet come, and are not to be trusted.
+ */
+static void
+hci_resync(struct hci *h, size_t count)
+{
+	size_t i;
+
+	h->slate += h->stream;
+
+	for (i = 0; i < count; i++) {
+		if (h->sdone[i] && h->ssent[i] >= h->ssync) {
+			h->sdone[i] = false;
+			h->sleft++;
+		}
+	}
+
+	h->slossy = true;
+}
+
+/*
+ * Send the packets, as many at a time as the controller will take, and
+ * wait until they are all done. Any commands sent before are waited for
+ * first. If the controller fails a packet or stops answering, the stream
+ * is taken up again with the packets that are not done.
+ */
+int
+hci_stream(struct hci *h, const struct hci_frames *f)
+{
+	struct timespec end;
+	size_t next, left, i;
+	unsigned int tries, n;
+	int k, rv;
+
+	if (hci_wait(h, NULL) == -1)
+		return -1;
+
+	if (f->count == 0)
+		return 0;
+
+	h->sopcode = f->opcode;
+	h->sdone = ecalloc(f->count, sizeof(bool));
+	h->ssent = ecalloc(f->count, sizeof(unsigned long));
+	h->sleft = f->count;
+	h->shead = 0;
+	h->stream = 0;
+	h->sserial = 0;
+	h->ssync = 1;
+	h->slate = 0;
+	h->slossy = false;
+
+	next = 0;
+	left = f->count;
+	tries = 0;
+	rv = 0;
+
+	while (h->sleft > 0) {
+		if (h->failed) {
+			hci_drain(h);
+			if (h->stream > 0)
+				hci_resync(h, f->count);
+
+			if (h->sleft < left)
+				tries = 0;
+
+			left = h->sleft;
+			if (tries++ == HCI_RETRY) {
+				rv = -1;
+				break;
+			}
+
+			hci_restart(h);
+			next = 0;
+			continue;
+		}
+
+		while (next < f->count && h->sdone[next])
+			next++;
+
+		/* As many as will be taken, or one at a time if lossy */
+		if (h->slossy)
+			n = (h->stream == 0 ? 1 : 0);
+		else
+			n = (unsigned int)MIN(h->credits,
+			    HCI_MAXSTREAM - h->stream);
+
+		if (n == 0 || next == f->count) {
+			hci_deadline(h->rto, &end);
+			hci_event(h, &end);
+			continue;
+		}
+
+		/* in a run of packets that are not done */
+		for (i = 1; i < n && next + i < f->count; i++) {
+			if (h->sdone[next + i])
+				break;
+		}
+
+		k = sendmmsg(h->fd, f->msg + next, (unsigned int)i, 0);
+		if (k == -1) {
+			if (errno != EINTR)
+				hci_fail(h, "send: %s", strerror(errno));
+
+			continue;
+		}
+
+		/*
+		 * Only time packets that were not sent before, since the
+		 * answer may be to the first time, unless it is sent alone
+		 * after the others were waited for.
+		 */
+		if (h->ssent[next] == 0 || h->slossy)
+			hci_rtstart(h, NULL, next);
+
+		for (i = 0; i < (size_t)k; i++, next++) {
+			if (h->ssent[next] != 0)
+				h->resent++;
+
+			h->ssent[next] = ++h->sserial;
+			h->sseq[(h->shead + h->stream) % HCI_MAXSTREAM] = next;
+			h->stream++;
+		}
+
+		h->credits -= (unsigned int)k;
+	}
+
+	free(h->sdone);
+	free(h->ssent);
+	h->sdone = NULL;
+	h->ssent = NULL;
+	h->stream = 0;
+	return rv;
+}
+
+/*
+ * Wait for an event that was not asked for, such as the Command Complete
+ * for opcode 0x0000 (No Operation) that a controller sends after it has
+ * been reset, as if the command had been sent.
+ */
+int
+hci_expect(struct hci *h, struct hci_cmd *cmd)
+{
+
+	if (h->failed)
+		return -1;
+
+	if (h->count == HCI_MAXQUEUE) {
+		hci_fail(h, "too many commands waiting");
+		return -1;
+	}
+
+	cmd->done = false;
+	cmd->status = 0;
+
+	h->queue[(h->head + h->count) % HCI_MAXQUEUE] = cmd;
+	h->count++;
+
+	return 0;
+}
+
+/*
+ * Wait until the command is done, or every command if NULL.
+ */
+int
+hci_wait(struct hci *h, const struct hci_cmd *cmd)
+{
+	struct timespec end;
+
+	hci_deadline(h->timeout, &end);
+
+	while (!h->failed && h->count > 0
+	    && (cmd == NULL || !cmd->done)) {
+		if (hci_event(h, &end) == -1)
+			return -1;
+	}
+
+	return (h->failed ? -1 : 0);
+}
+
+/*
+ * Send a command and wait for it, as bt_devreq(3) does.
+ */
+int
+hci_request(struct hci *h, struct hci_cmd *cmd)
+{
+
+	if (hci_send(h, cmd) == -1)
+		return -1;
+
+	return hci_wait(h, cmd);
+}
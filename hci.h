@@ -0,0 +1,108 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * HCI command engine, see hci.c
+ */
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <bluetooth.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HCI_MAXQUEUE	32	/* commands waiting at once */
+#define HCI_MAXSTREAM	256	/* streamed packets waiting at once */
+#define HCI_RETRY	3	/* times a stream is taken up again */
+#define HCI_RTO_MIN	50	/* milliseconds */
+
+struct hci_cmd {
+	uint16_t	opcode;
+	const void *	cparam;	/* command parameters */
+	size_t		clen;
+	void *		rparam;	/* space for return parameters, or NULL */
+	size_t		rlen;	/* and its size, then the length returned */
+	uint8_t		status;
+	bool		done;
+};
+
+/*
+ * A run of command packets laid out ready to send, with the header
+ * shared and the length and parameters taken from packed records.
+ */
+struct hci_frames {
+	uint16_t	opcode;
+	uint8_t		hdr[3];		/* packet type and opcode */
+	struct iovec *	iov;		/* two for each packet */
+	struct mmsghdr *msg;
+	size_t		count;
+};
+
+struct hci {
+	int		fd;
+	int		timeout;	/* milliseconds */
+	int		rto;		/* stream timeout, milliseconds */
+	int		srtt;		/* smoothed round trip, microseconds */
+	int		rttvar;		/* and its variation */
+	bool		timing;		/* a round trip is being timed */
+	const struct hci_cmd *rtcmd;	/* for this command */
+	size_t		rtseq;		/* or this streamed packet */
+	struct timespec	rtstart;
+	unsigned int	credits;	/* commands the controller will take */
+	struct hci_cmd *queue[HCI_MAXQUEUE];	/* sent and not all done */
+	size_t		head;
+	size_t		count;
+	uint16_t	sopcode;	/* opcode of the packets streamed */
+	bool *		sdone;		/* for each packet, if it is done */
+	unsigned long *	ssent;		/* and when it was last sent, or 0 */
+	size_t		sleft;		/* packets not done */
+	size_t		sseq[HCI_MAXSTREAM];	/* packets waiting, in order */
+	size_t		shead;
+	size_t		stream;		/* and how many */
+	unsigned long	sserial;	/* packets sent */
+	unsigned long	ssync;		/* those sent before were all matched */
+	size_t		slate;		/* answers given up on, that may come */
+	bool		slossy;		/* answers went missing */
+	unsigned int	resent;		/* packets sent again */
+	bool		failed;
+	char		error[128];
+};
+
+void hci_open(struct hci *, int, unsigned int, int);
+int hci_send(struct hci *, struct hci_cmd *);
+int hci_expect(struct hci *, struct hci_cmd *);
+int hci_wait(struct hci *, const struct hci_cmd *);
+int hci_request(struct hci *, struct hci_cmd *);
+int hci_stream(struct hci *, const struct hci_frames *);
+void hci_restart(struct hci *);
+void hci_close(struct hci *);
+const char *hci_error(const struct hci *);
+
+void hci_frames(struct hci_frames *, uint16_t, const uint8_t *, size_t,
+    size_t);
+void hci_frames_free(struct hci_frames *);
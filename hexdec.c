@@ -0,0 +1,329 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Decode a run of hexadecimal digit pairs to bytes, as found in each
+ * 'Intel HEX' record, and sum the bytes for the record checksum. This
+ * uses SSE2 or AVX2 on x86-64 and NEON on arm64, chosen once at the
+ * first call; read_digit() in ihex.c remains the reference for the
+ * format and is used to report the precise error when a record fails
+ * to decode. bench/hexcheck compares each decoder with the portable one.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HEXDEC_X86
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HEXDEC_NEON
+#endif
+
+#include "bcmfw.h"
+
+static inline int
+hex_value(uint8_t ch)
+{
+
+	if ('0' <= ch && ch <= '9')
+		return ch - '0';
+
+	ch |= 0x20;	/* lower case */
+	if ('a' <= ch && ch <= 'f')
+		return ch - 'a' + 0xa;
+
+	return -1;
+}
+
+/*
+ * Decode the trailing digit pairs which don't fill a vector, adding
+ * the bytes to the given sum.
+ */
+static inline bool
+hex_decode_tail(uint8_t *dst, const uint8_t *src, size_t n, uint8_t *sum)
+{
+	int hi, lo;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		hi = hex_value(src[2 * i]);
+		lo = hex_value(src[2 * i + 1]);
+		if (hi < 0 || lo < 0)
+			return false;
+
+		dst[i] = (uint8_t)((hi << 4) | lo);
+		*sum += dst[i];
+	}
+
+	return true;
+}
+
+static bool
+hex_decode_scalar(uint8_t *dst, const uint8_t *src, size_t n, uint8_t *sum)
+{
+	uint8_t s;
+
+	s = *sum;
+	if (!hex_decode_tail(dst, src, n, &s))
+		return false;
+
+	*sum = s;
+	return true;
+}
+
+#ifdef HEXDEC_X86
+/*
+ * Classify 16 characters as decimal digits or (either case) hex letters,
+ * and convert to nibble values. Returns the nibbles, with the validity
+ * of each character as a byte mask in *ok.
+ */
+static inline __m128i
+nibbles_sse2(__m128i v, __m128i *ok)
+{
+	__m128i l, dig, alp;
+
+	dig = _mm_and_si128(
+	    _mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+	    _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+
+	l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	alp = _mm_and_si128(
+	    _mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+	    _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
+
+	*ok = _mm_or_si128(dig, alp);
+	return _mm_or_si128(
+	    _mm_and_si128(dig, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+	    _mm_and_si128(alp, _mm_sub_epi8(l, _mm_set1_epi8('a' - 0xa))));
+}
+
+static bool
+hex_decode_sse2(uint8_t *dst, const uint8_t *src, size_t n, uint8_t *sum)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, ok, w, acc;
+	uint8_t s;
+	size_t i;
+
+	acc = zero;
+	for (i = 0; i + 8 <= n; i += 8) {
+		v = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+		v = nibbles_sse2(v, &ok);
+		if (_mm_movemask_epi8(ok) != 0xffff)
+			return false;
+
+		/*
+		 * Each 16-bit lane holds the high nibble in the low byte
+		 * and the low nibble in the high byte.
+		 */
+		w = _mm_or_si128(
+		    _mm_and_si128(_mm_slli_epi16(v, 4), _mm_set1_epi16(0x00f0)),
+		    _mm_srli_epi16(v, 8));
+		w = _mm_packus_epi16(w, zero);
+		_mm_storel_epi64((__m128i *)(dst + i), w);
+		acc = _mm_add_epi64(acc, _mm_sad_epu8(w, zero));
+	}
+
+	s = *sum + (uint8_t)_mm_cvtsi128_si32(acc);
+	if (!hex_decode_tail(dst + i, src + 2 * i, n - i, &s))
+		return false;
+
+	*sum = s;
+	return true;
+}
+
+static inline __attribute__((__target__("avx2"))) __m256i
+nibbles_avx2(__m256i v, __m256i *ok)
+{
+	__m256i l, dig, alp;
+
+	dig = _mm256_and_si256(
+	    _mm256_cmpgt_epi8(v, _mm256_set1_epi8('0' - 1)),
+	    _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), v));
+
+	l = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	alp = _mm256_and_si256(
+	    _mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+	    _mm256_cmpgt_epi8(_mm256_set1_epi8('f' + 1), l));
+
+	*ok = _mm256_or_si256(dig, alp);
+	return _mm256_or_si256(
+	    _mm256_and_si256(dig, _mm256_sub_epi8(v, _mm256_set1_epi8('0'))),
+	    _mm256_and_si256(alp, _mm256_sub_epi8(l, _mm256_set1_epi8('a' - 0xa))));
+}
+
+static __attribute__((__target__("avx2"))) bool
+hex_decode_avx2(uint8_t *dst, const uint8_t *src, size_t n, uint8_t *sum)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i v, ok, w, acc;
+	uint64_t t;
+	uint8_t s;
+	size_t i;
+
+	acc = zero;
+	for (i = 0; i + 16 <= n; i += 16) {
+		v = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+		v = nibbles_avx2(v, &ok);
+		if (_mm256_movemask_epi8(ok) != -1)
+			return false;
+
+		w = _mm256_or_si256(
+		    _mm256_and_si256(_mm256_slli_epi16(v, 4),
+			_mm256_set1_epi16(0x00f0)),
+		    _mm256_srli_epi16(v, 8));
+
+		/* packing is per 128-bit lane, gather the two results */
+		w = _mm256_packus_epi16(w, zero);
+		w = _mm256_permute4x64_epi64(w, 0x08);
+		_mm_storeu_si128((__m128i *)(dst + i),
+		    _mm256_castsi256_si128(w));
+		acc = _mm256_add_epi64(acc, _mm256_sad_epu8(w, zero));
+	}
+
+	t = (uint64_t)_mm256_extract_epi64(acc, 0)
+	    + (uint64_t)_mm256_extract_epi64(acc, 1);
+	s = *sum + (uint8_t)t;
+
+	/* finish with SSE2 for the remainder */
+	if (!hex_decode_sse2(dst + i, src + 2 * i, n - i, &s))
+		return false;
+
+	*sum = s;
+	return true;
+}
+#endif /* HEXDEC_X86 */
+
+#ifdef HEXDEC_NEON
+static inline uint8x16_t
+nibbles_neon(uint8x16_t v, uint8x16_t *ok)
+{
+	uint8x16_t d, a, isd, isa;
+
+	d = vsubq_u8(v, vdupq_n_u8('0'));
+	isd = vcltq_u8(d, vdupq_n_u8(10));
+
+	a = vsubq_u8(vorrq_u8(v, vdupq_n_u8(0x20)), vdupq_n_u8('a'));
+	isa = vcltq_u8(a, vdupq_n_u8(6));
+
+	*ok = vorrq_u8(isd, isa);
+	return vbslq_u8(isd, d, vaddq_u8(a, vdupq_n_u8(0xa)));
+}
+
+static bool
+hex_decode_neon(uint8_t *dst, const uint8_t *src, size_t n, uint8_t *sum)
+{
+	uint8x16x2_t v;
+	uint8x16_t hi, lo, okh, okl, b;
+	uint8_t s;
+	size_t i;
+
+	s = *sum;
+	for (i = 0; i + 16 <= n; i += 16) {
+		/* deinterleave, high nibble characters in val[0] */
+		v = vld2q_u8(src + 2 * i);
+		hi = nibbles_neon(v.val[0], &okh);
+		lo = nibbles_neon(v.val[1], &okl);
+		if (vminvq_u8(vandq_u8(okh, okl)) != 0xff)
+			return false;
+
+		b = vorrq_u8(vshlq_n_u8(hi, 4), lo);
+		vst1q_u8(dst + i, b);
+		s += vaddvq_u8(b);
+	}
+
+	if (!hex_decode_tail(dst + i, src + 2 * i, n - i, &s))
+		return false;
+
+	*sum = s;
+	return true;
+}
+#endif /* HEXDEC_NEON */
+
+static pthread_once_t hexdec_once = PTHREAD_ONCE_INIT;
+
+static struct hex_decoder decoder[4];	/* the portable one first */
+static size_t ndecoder;
+
+static void
+hex_decode_add(const char *name,
+    bool (*decode)(uint8_t *, const uint8_t *, size_t, uint8_t *))
+{
+
+	decoder[ndecoder].name = name;
+	decoder[ndecoder].decode = decode;
+	ndecoder++;
+}
+
+/*
+ * List the decoders that this CPU can run, in order of preference with
+ * the best last.
+ */
+static void
+hex_decode_init(void)
+{
+
+	hex_decode_add("portable", hex_decode_scalar);
+
+#if defined(HEXDEC_X86)
+	hex_decode_add("sse2", hex_decode_sse2);
+	if (__builtin_cpu_supports("avx2"))
+		hex_decode_add("avx2", hex_decode_avx2);
+#elif defined(HEXDEC_NEON)
+	hex_decode_add("neon", hex_decode_neon);
+#endif
+}
+
+/*
+ * Decode 'n' bytes from the '2n' hex digits at 'src' into 'dst', and add
+ * them to the 8-bit checksum. Returns false if any character is not a
+ * hex digit, in which case the checksum is not changed.
+ */
+bool
+hex_decode(uint8_t *dst, const uint8_t *src, size_t n, uint8_t *sum)
+{
+
+	pthread_once(&hexdec_once, hex_decode_init);
+	return (*decoder[ndecoder - 1].decode)(dst, src, n, sum);
+}
+
+/*
+ * Every decoder that this CPU can run, for checking them against the
+ * portable one, which comes first.
+ */
+const struct hex_decoder *
+hex_decoders(size_t *count)
+{
+
+	pthread_once(&hexdec_once, hex_decode_init);
+	*count = ndecoder;
+	return decoder;
+}
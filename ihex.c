@@ -23,7 +23,14 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -33,12 +40,194 @@
 
 #include "bcmfw.h"
 
-static uint8_t		inbuf[1024];
-static uint8_t *	inptr;
-static ssize_t		inmax;
-static int		infd;
+/*
+ * Record the error, with the position of the last character read
+ */
+static void __printflike(2, 3)
+ihex_fail(struct ihex *ih, const char *fmt, ...)
+{
+	char msg[64];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	snprintf(ih->error, sizeof(ih->error), "%s: line %zu, column %zu: %s",
+	    ih->name, ih->line, (size_t)(ih->ptr - ih->bol), msg);
+}
+
+/*
+ * Go back to the start of the file. A compressed file is decoded again
+ * from the first block, and is no longer observed.
+ */
+static void
+ihex_rewind(struct ihex *ih)
+{
+
+	if (ih->lz != NULL) {
+		if (lz_rewind(ih->lz) == -1 && ih->ioerr == 0)
+			ih->ioerr = errno;
+
+		ih->end = ih->buf;
+		ih->observe = NULL;
+	}
+
+	ih->ptr = ih->bol = ih->buf;
+	ih->line = 1;
+	ih->done = false;
+	ih->cksum = 0;
+	ih->base = 0;
+	ih->based = false;
+	ih->starttype = 0;
+	ih->start = 0;
+	ih->nrec = 0;
+	ih->pendlen = 0;
+}
+
+/*
+ * A record is a start code and up to 4 + 255 + 1 bytes as digits, and a
+ * compressed file is decoded a block at a time into a window that holds
+ * the current line and the block after it.
+ */
+#define IHEX_LINEMAX	(1 + 2 * (4 + UINT8_MAX + 1))
+
+/*
+ * Get the file ready to read. Regular files are mapped and decoded in
+ * place, and anything that can't be mapped (such as a pipe) is read into
+ * an allocated buffer instead. Compressed files are not decoded here but
+ * as the records are read, so only a block of the contents is held.
+ */
+int
+ihex_open(struct ihex *ih, const char *infile)
+{
+	struct stat sb;
+	size_t size;
+	ssize_t len;
+	int fd, e;
+
+	memset(ih, 0, sizeof(*ih));
+	snprintf(ih->name, sizeof(ih->name), "%s", infile);
+
+	fd = open(infile, O_RDONLY);
+	if (fd == -1)
+		goto fail;
+
+	if (fstat(fd, &sb) == -1)
+		goto fail;
+
+	if (lz_name(infile)) {
+		ih->lz = emalloc(sizeof(struct lz_stream));
+		if (lz_open(ih->lz, fd) == -1) {
+			e = errno;
+			free(ih->lz);
+			ih->lz = NULL;
+			errno = e;
+			goto fail;
+		}
+
+		ih->size = ih->lz->len;
+		ih->window = LZ_BLOCK + IHEX_LINEMAX;
+		ih->buf = ih->end = emalloc(ih->window);
+		ihex_rewind(ih);
+		return 0;
+	}
+
+	if (S_ISREG(sb.st_mode) && sb.st_size > 0
+	    && (uintmax_t)sb.st_size <= SIZE_MAX) {
+		ih->buf = mmap(NULL, (size_t)sb.st_size, PROT_READ,
+		    MAP_FILE | MAP_PRIVATE, fd, 0);
+		if (ih->buf != MAP_FAILED) {
+			(void)madvise(ih->buf, (size_t)sb.st_size,
+			    MADV_SEQUENTIAL);
+			ih->end = ih->buf + sb.st_size;
+			ih->mapped = true;
+			goto done;
+		}
+	}
+
+	ih->buf = NULL;
+	size = 0;
+	len = 0;
+	for (;;) {
+		if ((size_t)len == size) {
+			size = (size == 0 ? 65536 : size * 2);
+			ih->buf = erealloc(ih->buf, size);
+		}
+
+		ih->end = ih->buf + len;
+		len = read(fd, ih->end, size - len);
+		if (len == 0)
+			break;
+		if (len == -1)
+			goto fail;
+
+		len += ih->end - ih->buf;
+	}
+
+done:
+	close(fd);
+	ih->size = (size_t)(ih->end - ih->buf);
+	ihex_rewind(ih);
+	return 0;
+
+fail:
+	e = errno;
+	snprintf(ih->error, sizeof(ih->error), "%s: %s", ih->name, strerror(e));
+	if (fd != -1)
+		close(fd);
+	free(ih->buf);
+	ih->buf = NULL;
+	errno = e;
+	return -1;
+}
+
+void
+ihex_close(struct ihex *ih)
+{
+
+	trace_flush();
+
+	if (ih->lz != NULL) {
+		close(ih->lz->fd);
+		lz_close(ih->lz);
+		free(ih->lz);
+		ih->lz = NULL;
+	}
+
+	if (ih->mapped)
+		munmap(ih->buf, (size_t)(ih->end - ih->buf));
+	else
+		free(ih->buf);
 
-static uint8_t		cksum;
+	ih->buf = ih->ptr = ih->end = ih->bol = NULL;
+}
+
+const char *
+ihex_error(const struct ihex *ih)
+{
+
+	return ih->error;
+}
+
+/*
+ * Have fn see the whole of the file contents, for a digest. That is done
+ * now if the file is in memory, otherwise as each block is decoded, and
+ * it is complete once the file has been read without error.
+ */
+void
+ihex_observe(struct ihex *ih, void (*fn)(void *, const uint8_t *, size_t),
+    void *arg)
+{
+
+	if (ih->lz == NULL) {
+		(*fn)(arg, ih->buf, (size_t)(ih->end - ih->buf));
+		return;
+	}
+
+	ih->observe = fn;
+	ih->observearg = arg;
+}
 
 /*
  * Read 'Intel HEX' file, lines in the format:
@@ -55,26 +244,20 @@ static uint8_t		cksum;
  *
  * Also see:  https://en.wikipedia.org/wiki/Intel_HEX
  */
-static char
-read_char(void)
+static inline char
+read_char(struct ihex *ih)
 {
-	
-	if (inptr - inbuf == inmax) {
-		inmax = read(infd, inbuf, sizeof(inbuf));
-		inptr = inbuf;
-		if (inmax == 0)
-			return 0;
-		if (inmax == -1)
-			err(EXIT_FAILURE, "read");
-	}
 
-	return *inptr++;
+	if (ih->ptr == ih->end)
+		return 0;
+
+	return *ih->ptr++;
 }
 
-static inline uint8_t
-read_digit(void)
+static inline int
+read_digit(struct ihex *ih)
 {
-	char ch = read_char();
+	char ch = read_char(ih);
 
 	if ('0' <= ch && ch <= '9')
 		return ch - '0';
@@ -86,130 +269,680 @@ read_digit(void)
 		return ch - 'A' + 0xa;
 
 	if (ch == '\r' || ch == '\n')
-		errx(EXIT_FAILURE, "unexpected EOL");
+		ihex_fail(ih, "unexpected EOL");
+	else if (ch == 0)
+		ihex_fail(ih, "unexpected EOF");
+	else
+		ihex_fail(ih, "invalid hex digit");
+
+	return -1;
+}
 
-	if (ch == 0)
-		errx(EXIT_FAILURE, "unexpected EOF");
+static inline bool
+read_byte(struct ihex *ih, uint8_t *v)
+{
+	int hi, lo;
+
+	if ((hi = read_digit(ih)) == -1 || (lo = read_digit(ih)) == -1)
+		return false;
 
-	errx(EXIT_FAILURE, "invalid hex digit");
+	*v = (uint8_t)((hi << 4) + lo);
+	ih->cksum += *v;
+	return true;
 }
 
-static inline uint8_t
-read_byte(void)
+/*
+ * Read 'n' bytes. The whole run is decoded at once when the input
+ * holds enough characters, otherwise (or if that fails) we go one
+ * digit at a time to find and report the problem.
+ */
+static bool
+read_bytes(struct ihex *ih, uint8_t *buf, size_t n)
 {
-	uint8_t v;
-	
-	v = (read_digit() << 4) + read_digit();
-	cksum += v;
-	return v;
+
+	if ((size_t)(ih->end - ih->ptr) >= n * 2
+	    && hex_decode(buf, ih->ptr, n, &ih->cksum)) {
+		ih->ptr += n * 2;
+		return true;
+	}
+
+	while (n-- > 0) {
+		if (!read_byte(ih, buf++))
+			return false;
+	}
+
+	return true;
 }
 
-struct ihex *
-read_ihex(const char *infile)
+/*
+ * Skip to the start of the next line, returning the first character
+ */
+static char
+skip_eol(struct ihex *ih)
 {
-	struct ihex *head, *block, *prev;
-	uint32_t base;
-	uint16_t addr;
-	uint8_t type, count;
-	uint8_t data[UINT8_MAX];
 	char ch;
-	int i;
 
-	infd = open(infile, O_RDONLY);
-	if (infd == -1)
-		return NULL;
+	while ((ch = read_char(ih)) == '\r' || ch == '\n') {
+		if (ch == '\n') {
+			ih->line++;
+			ih->bol = ih->ptr;
+		}
+	}
 
-	inptr = inbuf;
-	inmax = 0;
-	cksum = 0;
+	return ch;
+}
 
-	head = NULL;
-	prev = NULL;
-	base = 0;
+/*
+ * Skip line ends, and say if that was all there was
+ */
+static bool
+at_end(struct ihex *ih)
+{
 
-	ch = read_char();
-	for(;;) {
-		if (ch != ':')
-			errx(EXIT_FAILURE, "no start code");
+	while (ih->ptr < ih->end && (*ih->ptr == '\r' || *ih->ptr == '\n')) {
+		if (*ih->ptr++ == '\n') {
+			ih->line++;
+			ih->bol = ih->ptr;
+		}
+	}
 
-		count = read_byte();
-		addr = (read_byte() << 8) + read_byte();
-		type = read_byte();
+	return ih->ptr == ih->end;
+}
 
-		for (i = 0; i < count; i++)
-			data[i] = read_byte();
+/*
+ * Make sure that the window on a compressed file holds a whole record
+ * after any line ends, or the rest of the file. The current line is
+ * moved to the start of the window and the next block decoded after it,
+ * so the position of an error is as for a file held in memory. Returns
+ * -1 if the compressed data could not be read.
+ */
+static int
+ihex_fill(struct ihex *ih)
+{
+	size_t off, col, len;
+	ssize_t n;
 
-		(void)read_byte(); /* this byte ensures cksum == 0 */
-		if (cksum != 0)
-			errx(EXIT_FAILURE, "checksum mismatch");
+	if (ih->lz == NULL)
+		return 0;
 
-		while ((ch = read_char()) == '\r' || ch == '\n')
-			;
+	for (;;) {
+		if (ih->ioerr != 0) {
+			ihex_fail(ih, "%s", strerror(ih->ioerr));
+			return -1;
+		}
 
-		switch (type) {
-		case 0x00:	/* Data */
-			block = emalloc(sizeof(struct ihex));
+		(void)at_end(ih);
+		if ((size_t)(ih->end - ih->ptr) >= IHEX_LINEMAX
+		    || ih->lz->off == ih->lz->len)
+			return 0;
 
-			if (count + sizeof(uint32_t) > UINT8_MAX)
-				errx(EXIT_FAILURE, "ihex block too large");
+		off = (size_t)(ih->bol - ih->buf);
+		col = (size_t)(ih->ptr - ih->bol);
+		len = (size_t)(ih->end - ih->bol);
+		if (len + LZ_BLOCK > ih->window) {
+			ih->window = len + LZ_BLOCK;
+			ih->buf = erealloc(ih->buf, ih->window);
+		}
+
+		memmove(ih->buf, ih->buf + off, len);
+		ih->bol = ih->buf;
+		ih->ptr = ih->buf + col;
+		ih->end = ih->buf + len;
+
+		n = lz_next(ih->lz, ih->end);
+		if (n <= 0) {
+			ih->ioerr = (n == 0 ? EFTYPE : errno);
+			continue;
+		}
+
+		if (ih->observe != NULL)
+			(*ih->observe)(ih->observearg, ih->end, (size_t)n);
+
+		ih->end += n;
+	}
+}
 
-			le32enc(block->data, base + addr);
-			memcpy(block->data + sizeof(uint32_t), data, count);
-			block->count = count + sizeof(uint32_t);
-			block->next = NULL;
+/*
+ * Read records until the next Data record, and return its absolute
+ * address and the data. Returns 1 for data, 0 at End of File, or -1
+ * if the file is malformed.
+ */
+static int
+ihex_data(struct ihex *ih, uint32_t *addr, const uint8_t **data, size_t *len)
+{
+	uint16_t offset;
+	uint8_t type, count;
+	bool dump;
 
-			if (head == NULL)
-				head = block;
-			if (prev != NULL)
-				prev->next = block;
+	dump = (!ih->quiet && tracing());
 
-			prev = block;
+	for (;;) {
+		if (ih->done)
+			return 0;
+
+		if (ihex_fill(ih) == -1)
+			return -1;
+
+		if (skip_eol(ih) != ':') {
+			ihex_fail(ih, "no start code");
+			return -1;
+		}
 
-			if (verbose > 1) {
-				printf("  Data address 0x%08x, count %u",
-				    le32dec(block->data), block->count);
+		/*
+		 * <Addr>, <Type>, <Data> and the <Checksum> byte, which
+		 * ensures that cksum == 0
+		 */
+		if (!read_byte(ih, &count)
+		    || !read_bytes(ih, ih->rec, count + 4))
+			return -1;
 
-				for (i = 4; i < block->count; i++) {
-					printf("%s %02x",
-					    (((i - 4) % 16) ? "" : "\n   "),
-					    block->data[i]);
-				}
+		offset = (ih->rec[0] << 8) + ih->rec[1];
+		type = ih->rec[2];
 
-				printf("\n");
+		if (ih->cksum != 0) {
+			ihex_fail(ih, "checksum mismatch");
+			return -1;
+		}
+
+		switch (type) {
+		case 0x00:	/* Data */
+			if (count + sizeof(uint32_t) > UINT8_MAX) {
+				ihex_fail(ih, "ihex block too large");
+				return -1;
 			}
-			break;
 
-		case 0x01:	/* End of File */
-			if (count != 0)
-				errx(EXIT_FAILURE, "EOF: invalid data");
+			if (ih->map != NULL
+			    && spanmap_add(ih->map, ih->base + offset, count) == -1) {
+				ihex_fail(ih, "data at 0x%08x overlaps earlier data",
+				    ih->base + offset);
+				return -1;
+			}
 
-			if (ch != 0)
-				errx(EXIT_FAILURE, "EOF: not end of file");
+			*addr = ih->base + offset;
+			*data = ih->rec + 3;
+			*len = count;
+			ih->nrec++;
 
-			close(infd);
+			if (dump)
+				trace_record(type, *addr, *data, *len);
+			return 1;
 
-			if (verbose > 1) {
-				printf("\n");
+		case 0x01:	/* End of File */
+			if (count != 0) {
+				ihex_fail(ih, "EOF: invalid data");
+				return -1;
 			}
 
-			return head;
+			if (ihex_fill(ih) == -1)
+				return -1;
 
-		case 0x04:	/* Extended Linear Address */
-			if (count != 2)
-				errx(EXIT_FAILURE, "ELA: invalid data");
+			if (skip_eol(ih) != 0) {
+				ihex_fail(ih, "EOF: not end of file");
+				return -1;
+			}
 
-			base = (data[0] << 24) + (data[1] << 16);
-			if (verbose > 1) {
-				printf("  Extended Linear Address 0x%08x\n", base);
+			if (dump) {
+				trace_record(type, 0, NULL, 0);
+				trace_flush();
 			}
-			break;
+
+			ih->done = true;
+			return 0;
 
 		case 0x02:	/* Extended Segment Address */
+			if (count != 2) {
+				ihex_fail(ih, "ESA: invalid data");
+				return -1;
+			}
+
+			ih->base = (uint32_t)be16dec(ih->rec + 3) << 4;
+			ih->based = true;
+			if (dump)
+				trace_record(type, ih->base, NULL, 0);
+			break;
+
 		case 0x03:	/* Start Segment Address */
 		case 0x05:	/* Start Linear Address */
+			if (count != 4) {
+				ihex_fail(ih, "%s: invalid data",
+				    (type == 0x03 ? "SSA" : "SLA"));
+				return -1;
+			}
+
+			if (ih->starttype != 0 && (ih->starttype != type
+			    || ih->start != be32dec(ih->rec + 3))) {
+				ihex_fail(ih, "conflicting start address");
+				return -1;
+			}
+
+			ih->starttype = type;
+			ih->start = be32dec(ih->rec + 3);
+			if (dump)
+				trace_record(type, ih->start, NULL, 0);
+			break;
+
+		case 0x04:	/* Extended Linear Address */
+			if (count != 2) {
+				ihex_fail(ih, "ELA: invalid data");
+				return -1;
+			}
+
+			ih->base = (uint32_t)be16dec(ih->rec + 3) << 16;
+			ih->based = true;
+			if (dump)
+				trace_record(type, ih->base, NULL, 0);
+			break;
+
 		default:
-			warnx("unhandled record type 0x%02x\n", type);
+			ihex_fail(ih, "invalid record type 0x%02x", type);
+			return -1;
+		}
+	}
+}
+
+/*
+ * Parse the rest of the opened file into a firmware image. Returns NULL
+ * if the file is malformed, see ihex_error() for the reason.
+ */
+struct image *
+ihex_parse(struct ihex *ih)
+{
+	struct image *img;
+	const uint8_t *data;
+	uint32_t addr;
+	size_t len;
+	int rv;
+
+	img = image_alloc();
+
+	while ((rv = ihex_data(ih, &addr, &data, &len)) == 1)
+		image_add(img, addr, data, len);
+
+	if (rv == -1) {
+		image_free(img);
+		return NULL;
+	}
+
+	image_trim(img);
+	return img;
+}
+
+/*
+ * Validate the whole file without keeping the data, and fill in the map
+ * of the address ranges it writes. Returns -1 if the file is malformed
+ * or any data overlaps, otherwise 0 with the file ready to be read from
+ * the start. The Start Address, if any, remains in the context.
+ */
+int
+ihex_check(struct ihex *ih, struct spanmap *map)
+{
+	const uint8_t *data;
+	uint32_t addr, start;
+	size_t len;
+	uint8_t starttype;
+	int rv;
+
+	/* the records are not traced while checking */
+	ih->map = map;
+	ih->quiet = true;
+
+	while ((rv = ihex_data(ih, &addr, &data, &len)) == 1)
+		continue;
+
+	ih->map = NULL;
+	ih->quiet = false;
+
+	if (rv == -1)
+		return -1;
+
+	starttype = ih->starttype;
+	start = ih->start;
+	ihex_rewind(ih);
+	ih->starttype = starttype;
+	ih->start = start;
+
+	return 0;
+}
+
+/*
+ * Parallel parsing. The file is split at line boundaries into a chunk
+ * per thread, and each chunk is decoded into its own image as if it were
+ * a file of its own, starting with a zero base address. Data records
+ * that come before the first Extended Address record in a chunk belong
+ * to the base address in effect at the end of the previous chunk, so
+ * once all the chunks are done, these are adjusted in order and the
+ * images are joined.
+ *
+ * Anything unusual (an error in any chunk, or an End of File record
+ * that is not at the end) causes the file to be parsed again in the
+ * normal way, which gives exactly the same result and error as if the
+ * parallel parse had not been tried.
+ */
+#define CHUNK_MIN	(256 * 1024)
+
+struct chunk {
+	pthread_t	thread;
+	struct ihex	ih;
+	struct image *	img;
+	size_t		inherit;	/* records before any base address */
+	bool		last;
+	bool		started;
+	int		rv;
+};
+
+static void *
+chunk_parse(void *arg)
+{
+	struct chunk *c = arg;
+	const uint8_t *data;
+	uint32_t addr;
+	size_t len;
+	int rv;
+
+	for (;;) {
+		if (!c->last && at_end(&c->ih)) {
+			rv = 0;
+			break;
+		}
+
+		rv = ihex_data(&c->ih, &addr, &data, &len);
+		if (rv != 1)
+			break;
+
+		image_add(c->img, addr, data, len);
+		if (!c->ih.based)
+			c->inherit++;
+	}
+
+	c->rv = rv;
+	return NULL;
+}
+
+/*
+ * Join the chunk images, or return NULL if they don't make a file
+ */
+static struct image *
+chunk_join(struct ihex *ih, struct chunk *c, int n)
+{
+	struct image *img;
+	uint8_t *rec;
+	size_t i;
+	int k;
+
+	img = image_alloc();
+	for (k = 0; k < n; k++) {
+		if (c[k].rv == -1 || c[k].ih.done != c[k].last)
+			goto fail;
+
+		if (c[k].ih.starttype != 0) {
+			if (ih->starttype != 0
+			    && (ih->starttype != c[k].ih.starttype
+			    || ih->start != c[k].ih.start))
+				goto fail;
+
+			ih->starttype = c[k].ih.starttype;
+			ih->start = c[k].ih.start;
+		}
+
+		i = 0;
+		IMAGE_FOREACH(rec, c[k].img) {
+			if (i++ == c[k].inherit)
+				break;
+
+			le32enc(rec + 1, ih->base + IMAGE_ADDR(rec));
+		}
+
+		if (c[k].ih.based) {
+			ih->base = c[k].ih.base;
+			ih->based = true;
+		}
+
+		ih->nrec += c[k].ih.nrec;
+
+		if (img->len + c[k].img->len > img->size) {
+			img->size = img->len + c[k].img->len;
+			img->buf = erealloc(img->buf, img->size);
+		}
+
+		memcpy(img->buf + img->len, c[k].img->buf, c[k].img->len);
+		img->len += c[k].img->len;
+		img->count += c[k].img->count;
+	}
+
+	ih->done = true;
+	ih->ptr = ih->end;
+	return img;
+
+fail:
+	image_free(img);
+	return NULL;
+}
+
+/*
+ * Parse the opened file using up to 'nthreads' threads. The result is
+ * the same as from ihex_parse(), which is used when the file is small,
+ * compressed or has already been partly read, or when tracing the records.
+ */
+struct image *
+ihex_parse_parallel(struct ihex *ih, int nthreads)
+{
+	struct image *img;
+	struct chunk *c;
+	uint8_t *p, *q;
+	size_t len;
+	int k, n;
+
+	len = (size_t)(ih->end - ih->ptr);
+	n = (int)MIN((size_t)MAX(nthreads, 1), len / CHUNK_MIN);
+	if (n < 2 || ih->ptr != ih->buf || ih->lz != NULL || tracing())
+		return ihex_parse(ih);
+
+	c = ecalloc((size_t)n, sizeof(struct chunk));
+
+	/*
+	 * Each chunk after the first starts at the first line following
+	 * an even share of the file.
+	 */
+	p = ih->ptr;
+	for (k = 0; k < n; k++) {
+		q = ih->ptr + len / n * (k + 1);
+		if (k == n - 1)
+			q = ih->end;
+		else {
+			while (q < ih->end && *q != '\n')
+				q++;
+			if (q < ih->end)
+				q++;
+		}
+
+		memcpy(c[k].ih.name, ih->name, sizeof(ih->name));
+		c[k].ih.buf = c[k].ih.ptr = c[k].ih.bol = p;
+		c[k].ih.end = q;
+		c[k].ih.line = 1;
+		c[k].img = image_alloc();
+		c[k].last = (k == n - 1);
+		p = q;
+	}
+
+	/* if a thread can't be started, do that chunk here */
+	for (k = 0; k < n; k++) {
+		c[k].started = (pthread_create(&c[k].thread, NULL,
+		    chunk_parse, &c[k]) == 0);
+		if (!c[k].started)
+			chunk_parse(&c[k]);
+	}
+
+	for (k = 0; k < n; k++) {
+		if (c[k].started)
+			pthread_join(c[k].thread, NULL);
+	}
+
+	img = chunk_join(ih, c, n);
+
+	for (k = 0; k < n; k++)
+		image_free(c[k].img);
+
+	free(c);
+
+	if (img == NULL) {
+		ihex_rewind(ih);
+		return ihex_parse(ih);
+	}
+
+	return img;
+}
+
+/*
+ * Stream the opened file, one Write RAM block at a time. Contiguous data
+ * records are merged until the block is as large as the HCI parameter
+ * limit allows, so only the current record and the block being built are
+ * held in memory. On return 'buf' holds the block (the 32-bit address
+ * followed by the data) and '*len' is its length. Returns 1 for a block,
+ * 0 at End of File, or -1 if the file is malformed.
+ */
+int
+ihex_next(struct ihex *ih, uint8_t *buf, size_t *len)
+{
+	uint32_t addr;
+	size_t n, k;
+	int rv;
+
+	addr = 0;
+	n = 0;
+	rv = 0;
+
+	while (n < UINT8_MAX - sizeof(uint32_t)) {
+		if (ih->pendlen == 0) {
+			rv = ihex_data(ih, &ih->pendaddr, &ih->pend,
+			    &ih->pendlen);
+			if (rv == -1)
+				return -1;
+			if (rv == 0)
+				break;
+		}
+
+		if (n == 0)
+			addr = ih->pendaddr;
+		else if (ih->pendaddr != addr + n)
 			break;
+
+		k = MIN(ih->pendlen, UINT8_MAX - sizeof(uint32_t) - n);
+		memcpy(buf + sizeof(uint32_t) + n, ih->pend, k);
+		ih->pendaddr += k;
+		ih->pend += k;
+		ih->pendlen -= k;
+		n += k;
+	}
+
+	if (n == 0)
+		return 0;
+
+	le32enc(buf, addr);
+	*len = sizeof(uint32_t) + n;
+	return 1;
+}
+
+/*
+ * Check the opened file and build its image, filling in the map of the
+ * address ranges that it writes. A file smaller than PARALLEL_MIN is
+ * checked and then streamed a Write RAM block at a time, which keeps
+ * little of it in memory. A larger one is parsed on every CPU, and the
+ * map is made from the records afterwards, so the file is only gone
+ * through once. It is checked again the normal way only when some data
+ * overlaps, for the error to give the line. A compressed file is read
+ * once as it is decoded, with the map filled in as each record is added
+ * to the image, so the records are traced up to any error in the file.
+ *
+ * Since overlapping data is refused, no two records write the same byte
+ * and the order that they are sent in does not change what ends up in
+ * Patch RAM. The image is merged, and sorted first when the records were
+ * out of order. Returns NULL if the file is malformed or any data
+ * overlaps, see ihex_error() for the reason.
+ */
+#define PARALLEL_MIN	(2 * CHUNK_MIN)
+
+struct image *
+ihex_image(struct ihex *ih, struct spanmap *map)
+{
+	struct image *img;
+	uint8_t *rec, cp[UINT8_MAX];
+	size_t len;
+	long ncpu;
+	int rv;
+
+	if (ih->lz != NULL) {
+		ih->map = map;
+		img = ihex_parse(ih);
+		ih->map = NULL;
+		if (img == NULL)
+			return NULL;
+	} else if ((size_t)(ih->end - ih->ptr) >= PARALLEL_MIN) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		img = ihex_parse_parallel(ih, (int)MIN(MAX(ncpu, 1), 64));
+		if (img == NULL)
+			return NULL;
+
+		IMAGE_FOREACH(rec, img) {
+			if (spanmap_add(map, IMAGE_ADDR(rec),
+			    IMAGE_DATALEN(rec)) == -1) {
+				image_free(img);
+				spanmap_free(map);
+				spanmap_init(map);
+				ihex_rewind(ih);
+				if (ihex_check(ih, map) == 0)
+					ihex_fail(ih, "overlapping data");
+
+				return NULL;
+			}
+		}
+	} else {
+		if (ihex_check(ih, map) == -1)
+			return NULL;
+
+		img = image_alloc();
+		while ((rv = ihex_next(ih, cp, &len)) == 1) {
+			image_add(img, le32dec(cp), cp + sizeof(uint32_t),
+			    len - sizeof(uint32_t));
+		}
+
+		if (rv == -1) {
+			image_free(img);
+			return NULL;
 		}
 	}
+
+	if (map->sorted)
+		image_coalesce(img);
+	else
+		image_sort(img);
+
+	image_trim(img);
+	return img;
+}
+
+/*
+ * Read a whole file, for the simple case. Returns NULL if the file
+ * could not be opened or held no data, and exits if it was malformed.
+ */
+struct image *
+read_ihex(const char *infile)
+{
+	struct image *img;
+	struct ihex ih;
+
+	if (ihex_open(&ih, infile) == -1)
+		return NULL;
+
+	img = ihex_parse(&ih);
+	ihex_close(&ih);
+
+	if (img == NULL)
+		errx(EXIT_FAILURE, "%s", ihex_error(&ih));
+
+	if (image_count(img) == 0) {
+		image_free(img);
+		return NULL;
+	}
+
+	return img;
 }
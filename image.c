@@ -0,0 +1,221 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Firmware images are kept as a sequence of Write RAM records packed
+ * into a single buffer. Each record is a length byte followed by that
+ * many bytes of HCI command parameters, being the 32-bit address and
+ * the data to write there.
+ */
+
+#include <err.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+
+#include "bcmfw.h"
+
+struct image *
+image_alloc(void)
+{
+	struct image *img;
+
+	img = emalloc(sizeof(struct image));
+	img->buf = NULL;
+	img->len = 0;
+	img->size = 0;
+	img->count = 0;
+
+	return img;
+}
+
+void
+image_free(struct image *img)
+{
+
+	if (img == NULL)
+		return;
+
+	free(img->buf);
+	free(img);
+}
+
+/*
+ * Append a record of 'len' data bytes for 'addr'
+ */
+void
+image_add(struct image *img, uint32_t addr, const uint8_t *data, size_t len)
+{
+	uint8_t *rec;
+
+	if (sizeof(uint32_t) + len > UINT8_MAX)
+		errx(EXIT_FAILURE, "image record too large");
+
+	if (img->len + IMAGE_HDRLEN + len > img->size) {
+		img->size = MAX(img->size * 2, 65536);
+		img->buf = erealloc(img->buf, img->size);
+	}
+
+	rec = img->buf + img->len;
+	rec[0] = (uint8_t)(sizeof(uint32_t) + len);
+	le32enc(rec + 1, addr);
+	memcpy(rec + IMAGE_HDRLEN, data, len);
+
+	img->len += IMAGE_HDRLEN + len;
+	img->count++;
+}
+
+/*
+ * Release the unused part of the buffer, once the image is complete
+ */
+void
+image_trim(struct image *img)
+{
+
+	if (img->len == 0 || img->len == img->size)
+		return;
+
+	img->buf = erealloc(img->buf, img->len);
+	img->size = img->len;
+}
+
+size_t
+image_count(const struct image *img)
+{
+
+	return img->count;
+}
+
+struct order {
+	uint32_t	addr;
+	size_t		off;
+};
+
+static int
+order_cmp(const void *a, const void *b)
+{
+	const struct order *x = a, *y = b;
+
+	if (x->addr != y->addr)
+		return (x->addr < y->addr ? -1 : 1);
+
+	return (x->off < y->off ? -1 : x->off > y->off ? 1 : 0);
+}
+
+/*
+ * Put the records in address order and merge them, giving the smallest
+ * number of Write RAM commands for the image
+ */
+void
+image_sort(struct image *img)
+{
+	struct order *v;
+	uint8_t *buf, *rec;
+	size_t i, len;
+
+	if (img->count < 2)
+		return;
+
+	v = ecalloc(img->count, sizeof(struct order));
+	i = 0;
+	IMAGE_FOREACH(rec, img) {
+		v[i].addr = IMAGE_ADDR(rec);
+		v[i].off = rec - img->buf;
+		i++;
+	}
+
+	qsort(v, img->count, sizeof(struct order), order_cmp);
+
+	buf = emalloc(img->len);
+	len = 0;
+	for (i = 0; i < img->count; i++) {
+		rec = img->buf + v[i].off;
+		memcpy(buf + len, rec, 1 + rec[0]);
+		len += 1 + rec[0];
+	}
+
+	free(v);
+	free(img->buf);
+	img->buf = buf;
+	img->size = img->len;
+
+	image_coalesce(img);
+}
+
+/*
+ * Merge address-contiguous records, so that each record fills as much of
+ * a single HCI command (4 address bytes plus data) as possible. Record
+ * addresses are absolute, so contiguous data either side of an Extended
+ * Linear Address record is merged too. When the following record does
+ * not fit entirely, the head of it is moved into the previous record and
+ * the rest is left at the adjusted address.
+ *
+ * This is done in place; the output never gets ahead of the input since
+ * each merge drops a header, and a split record takes only the space
+ * that it did before.
+ */
+void
+image_coalesce(struct image *img)
+{
+	uint8_t *rec, *next, *end, *last, *out;
+	const uint8_t *data;
+	uint32_t addr;
+	size_t len, n;
+
+	end = img->buf + img->len;
+	last = NULL;
+	out = img->buf;
+	img->count = 0;
+
+	for (rec = img->buf; rec < end; rec = next) {
+		next = rec + 1 + rec[0];
+		addr = IMAGE_ADDR(rec);
+		data = IMAGE_DATA(rec);
+		len = IMAGE_DATALEN(rec);
+
+		if (last != NULL && last[0] < UINT8_MAX
+		    && IMAGE_ADDR(last) + IMAGE_DATALEN(last) == addr) {
+			n = MIN((size_t)(UINT8_MAX - last[0]), len);
+			memmove(out, data, n);
+			last[0] += n;
+			out += n;
+
+			addr += n;
+			data += n;
+			len -= n;
+		}
+
+		if (len > 0) {
+			last = out;
+			last[0] = (uint8_t)(sizeof(uint32_t) + len);
+			le32enc(last + 1, addr);
+			memmove(last + IMAGE_HDRLEN, data, len);
+			out += IMAGE_HDRLEN + len;
+			img->count++;
+		}
+	}
+
+	img->len = out - img->buf;
+}
@@ -0,0 +1,597 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Parse a Windows driver .INF file, to find the PatchRAM file
+ * that is used for each USB VendorID/ProductID.
+ *
+ * A driver for many models has a few sections for each of them, so the
+ * sections are found by a hash of their name. The models are collected
+ * in the order they are found and sorted once they are all in.
+ */
+
+#include <sys/types.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+
+#include "inf.h"
+
+struct line {
+	char *		text;
+	struct line *	next;
+};
+
+struct section {
+	char *		name;
+	uint32_t	hash;
+	struct line *	lines;
+	struct section *next;
+	struct section *chain;	/* in the hash bucket */
+};
+
+static struct section *	sections;
+static struct section **bucket;
+static size_t		nbucket;	/* a power of two */
+static size_t		nsection;
+
+struct model *		models;
+int			nmodels;
+
+static struct model **	lastmodel = &models;
+
+char *			DriverDate;
+char *			DriverVersion;
+
+static unsigned int	VendorID;
+static unsigned int	ProductID;
+
+static void
+line_add(struct section *s, uint8_t *ptr, size_t len)
+{
+	struct line *l;
+
+	l = emalloc(sizeof(struct line));
+	l->text = estrndup((char *)ptr, len);
+	l->next = s->lines;
+	s->lines = l;
+}
+
+/*
+ * FNV-1a, of the name in lower case since section names are not case
+ * sensitive
+ */
+static uint32_t
+section_hash(const uint8_t *ptr, size_t len)
+{
+	uint32_t h;
+	size_t i;
+
+	h = 2166136261U;
+	for (i = 0; i < len; i++) {
+		h ^= (uint32_t)tolower(ptr[i]);
+		h *= 16777619U;
+	}
+
+	return h;
+}
+
+/*
+ * Keep no more than two sections to a bucket on average
+ */
+static void
+section_grow(void)
+{
+	struct section *s;
+	size_t h;
+
+	if (nsection < 2 * nbucket)
+		return;	/* room for one more */
+
+	free(bucket);
+	nbucket = (nbucket == 0 ? 64 : 2 * nbucket);
+	bucket = ecalloc(nbucket, sizeof(struct section *));
+
+	for (s = sections; s != NULL; s = s->next) {
+		h = s->hash & (nbucket - 1);
+		s->chain = bucket[h];
+		bucket[h] = s;
+	}
+}
+
+static struct section *
+section_find(const uint8_t *ptr, size_t len, uint32_t h)
+{
+	struct section *s;
+
+	if (nbucket == 0)
+		return NULL;
+
+	for (s = bucket[h & (nbucket - 1)]; s != NULL; s = s->chain) {
+		if (s->hash == h
+		    && strncasecmp(s->name, (const char *)ptr, len) == 0
+		    && s->name[len] == '\0')
+			return s;
+	}
+
+	return NULL;
+}
+
+static struct section *
+section_add(uint8_t *ptr, size_t len)
+{
+	struct section *s;
+	uint32_t hash;
+	size_t h;
+
+	hash = section_hash(ptr, len);
+	s = section_find(ptr, len, hash);
+	if (s != NULL)
+		return s;
+
+	s = emalloc(sizeof(struct section));
+	s->name = estrndup((char *)ptr, len);
+	s->hash = hash;
+	s->lines = NULL;
+
+	section_grow();
+	s->next = sections;
+	sections = s;
+	nsection++;
+
+	h = s->hash & (nbucket - 1);
+	s->chain = bucket[h];
+	bucket[h] = s;
+
+	return s;
+}
+
+static void
+model_add(unsigned int vid, unsigned int pid, char *file)
+{
+	struct model *m;
+
+	if (file[0] == '"') {
+		*strrchr(file, '"') = '\0';
+		file++;
+	}
+
+	m = emalloc(sizeof(struct model));
+	m->vid = vid;
+	m->pid = pid;
+	m->file = estrdup(file);
+
+	m->next = NULL;
+	*lastmodel = m;
+	lastmodel = &m->next;
+}
+
+static struct model **sort_models;
+
+static int
+model_cmp(const void *a, const void *b)
+{
+	const size_t *i = a, *j = b;
+	const struct model *m = sort_models[*i], *n = sort_models[*j];
+
+	if (m->vid != n->vid)
+		return (m->vid < n->vid ? -1 : 1);
+
+	if (m->pid != n->pid)
+		return (m->pid < n->pid ? -1 : 1);
+
+	return (*i < *j ? -1 : *i > *j ? 1 : 0);
+}
+
+/*
+ * Put the models in vid:pid order, keeping only the first found of
+ * each.
+ */
+static void
+model_sort(void)
+{
+	struct model **v, *m, *prev;
+	size_t *idx, i, n;
+
+	n = 0;
+	for (m = models; m != NULL; m = m->next)
+		n++;
+
+	v = ecalloc(n + 1, sizeof(struct model *));
+	idx = ecalloc(n + 1, sizeof(size_t));
+	for (i = 0, m = models; m != NULL; i++, m = m->next) {
+		v[i] = m;
+		idx[i] = i;
+	}
+
+	sort_models = v;
+	qsort(idx, n, sizeof(size_t), model_cmp);
+	sort_models = NULL;
+
+	models = NULL;
+	lastmodel = &models;
+	nmodels = 0;
+	prev = NULL;
+
+	for (i = 0; i < n; i++) {
+		m = v[idx[i]];
+		if (prev != NULL && m->vid == prev->vid
+		    && m->pid == prev->pid) {
+			free(m->file);
+			free(m);
+			continue;
+		}
+
+		m->next = NULL;
+		*lastmodel = m;
+		lastmodel = &m->next;
+		nmodels++;
+		prev = m;
+	}
+
+	free(idx);
+	free(v);
+}
+
+/*
+ * Read the .INF file. The rules we follow here are
+ *	a. max line length is 4096 bytes
+ *	b. <esc><esc> is not <esc>
+ *	c. <esc><end-of-line> is skipped
+ *	d. leading <space> is skipped
+ *	e. trailing <space> is skipped
+ *	f. <quote> % <quote> is not <stringkey>
+ *	g. <quote> ; <quote> is not <semicolon>
+ *	h. <stringkey> " <stringkey> is not <quote>
+ *	i. <stringkey> ; <stringkey> is not <semicolon>
+ *	j. all chars after <semicolon> are skipped
+ *	k. empty lines are skipped
+ */
+void
+read_inf(const char *name)
+{
+	uint8_t	buf[4096];
+	struct section *section;
+	FILE *	f;
+	size_t	len, space, lineno;
+	bool	esc, quote, comment, stringkey;
+	bool	leading;
+	int	ch;
+
+	f = efopen(name, "r");
+	lineno = 0;
+	section = NULL;
+
+start:
+	len = 0;
+	space = 0;
+
+	esc = false;
+	quote = false;
+	comment = false;
+	stringkey = false;
+
+	leading = true;
+
+	lineno++;
+
+	while (len < __arraycount(buf)) {
+		ch = fgetc(f);
+		if (ch == '\n' || ch == EOF) {
+			if (esc) {
+				if (!comment)
+					len--;	/* drop <backslash> */
+
+				if (ch == '\n') {
+					esc = false;
+					lineno++;
+					continue;
+				}
+			}
+			if (quote)
+				warnx("unterminated quote on line #%zu", lineno);
+			if (stringkey)
+				warnx("unterminated string key on line #%zu", lineno);
+			if (space)
+				len = space;	/* drop trailing spaces */
+			if (ch == EOF) {
+				if (len == 0) {
+					if (ferror(f))
+						warn("Read error on %s", name);
+
+					fclose(f);
+					return;
+				}
+
+				warnx("missing newline at end of file");
+			}
+			if (len == 0)
+				goto start;	/* ignore empty lines */
+			if (buf[0] == '[') {
+				if (buf[len - 1] == ']')
+					section = section_add(buf + 1, len - 2);
+				else {
+					warnx("malformed section header on line #%zu", lineno);
+					section = NULL;
+				}
+			} else if (section != NULL) /* ignore lines with no section */
+				line_add(section, buf, len);
+
+			goto start;
+		}
+		if (ch == ';' && !quote && !stringkey)
+			comment = true;
+		if (ch == '\\')
+			esc = !esc;
+		else
+			esc = false;
+
+		if (ch == '\r' || comment)
+			continue;
+
+		if (ch == '%' && !quote)
+			stringkey = !stringkey;
+		if (ch == '"' && !stringkey)
+			quote = !quote;
+		if ((ch == '=' || ch == ',') && !quote && !stringkey) {
+			if (space) {
+				len = space;	/* drop spaces */
+				space = 0;
+			}
+			leading = true;
+		} else if ((ch == ' ' || ch == '\t') && !quote && !stringkey) {
+			if (leading)	/* skip leading spaces */
+				continue;
+			if (space == 0)	/* mark start of space */
+				space = len;
+		} else {
+			space = 0;
+			leading = false;
+		}
+
+		buf[len++] = (uint8_t)ch;
+	}
+
+	err(EXIT_FAILURE, "line #%zu too long", lineno);
+}
+
+bool
+section_foreach(const char *name, void (*func)(char **, size_t))
+{
+	struct section *s;
+	struct line *l;
+	char *av[10], *p, *t, *text, sep;
+	bool quote, stringkey;
+	size_t len, n;
+
+	len = strlen(name);
+	s = section_find((const uint8_t *)name, len,
+	    section_hash((const uint8_t *)name, len));
+	if (s == NULL)
+		return false;
+
+	/*
+	 * parse each line into an arg array
+	 *
+	 *	<0> = <1> [, <2> ... ]
+	 *
+	 * and call the function.
+	 */
+	for (l = s->lines; l; l = l->next) {
+		n = 0;
+		sep = '=';
+		quote = false;
+		stringkey = false;
+
+		t = text = estrdup(l->text);
+		for (p = t; n < __arraycount(av) - 1; p++) {
+			if (*p == '\0') {
+				if (sep == ',')
+					break;
+
+				av[n++] = p;	/* empty key */
+				p = t;		/* restart */
+				sep = ',';
+			}
+			if (*p == '%' && !quote)
+				stringkey = !stringkey;
+			if (*p == '"' && !stringkey)
+				quote = !quote;
+			if (*p == sep && !quote && !stringkey) {
+				*p = '\0';
+				av[n++] = t;
+				t = p + 1;
+				sep = ',';
+			}
+		}
+		av[n++] = t;
+
+		(*func)(av, n);
+		free(text);
+	}
+
+	return true;
+}
+
+static void
+each_version(char *av[], size_t n)
+{
+	int d, m, y;
+
+	/*
+	 * Version Section. Match lines in the format of
+	 *
+	 *	DriverVer = <date>, <version>
+	 */
+
+	if (n > 2 && strcasecmp("DriverVer", av[0]) == 0) {
+		if (sscanf(av[1], "%d/%d/%d", &m, &d, &y) == 3)
+			easprintf(&DriverDate, "%04d-%02d-%02d", y, m, d);
+
+		DriverVersion = estrdup(av[2]);
+	}
+}
+
+static void
+each_addreg(char *av[], size_t n)
+{
+	/*
+	 * AddReg Section. Match lines in the format of
+	 *
+	 *	<?>,<?>,%RAMPatchFileName%,<flags>,<filename>
+	 *
+	 * and copy the value to RAMPatchFileName
+	 */
+
+	if (n > 5 && strcasecmp(av[3], "%RAMPatchFileName%") == 0)
+		model_add(VendorID, ProductID, av[5]);
+}
+
+static void
+each_hw(char *av[], size_t n)
+{
+	/*
+	 * Match lines in the format of
+	 *
+	 *	AddReg=<addreg-section>
+	 *
+	 * and parse those sections
+	 */
+
+	if (n > 1 && strcasecmp("AddReg", av[0]) == 0)
+		section_foreach(av[1], each_addreg);
+}
+
+static void
+each_model(char *av[], size_t n)
+{
+	const char *ext[] = { "", ".nt", ".ntx86", ".ntia64", ".ntamd64" };
+	char name[256];
+	size_t i;
+
+	/*
+	 * Models Section. Match lines in the format of
+	 *
+	 *	<model-description> = <model-section-name>, <usb-device-id>
+	 *
+	 * and parse sections named
+	 *
+	 *	 <model-section-name>[|.nt|.ntx86|.ntia64|.ntamd64].hw
+	 */
+
+	if (n < 3 || sscanf(av[2], "USB\\VID_%4x&PID_%4x", &VendorID, &ProductID) != 2)
+		return;
+
+	for (i = 0; i < __arraycount(ext); i++) {
+		snprintf(name, sizeof(name), "%s%s.hw", av[1], ext[i]);
+		if (section_foreach(name, each_hw))
+			break;
+	}
+}
+
+static void
+each_manufacturer(char *av[], size_t n)
+{
+	char name[256];
+	size_t i;
+
+	/*
+	 * Manufacturer Section. Match lines in the format of
+	 *
+	 *	<description> = <manufacturer> [, <target> ...]
+	 *
+	 * parse sections named
+	 *	<manufacturer> <manufacturer>.<target> ...
+	 */
+	if (n < 2 && strlen(av[0]) > 0)
+		return;
+
+	snprintf(name, sizeof(name), "%s", av[1]);
+	for (i = 2;; i++) {
+		section_foreach(name, each_model);
+
+		if (i == n)
+			break;
+
+		snprintf(name, sizeof(name), "%s.%s", av[1], av[i]);
+	}
+}
+
+/*
+ * Walk the sections read from the .INF file, starting at the Version
+ * and Manufacturer sections, and collect the models.
+ */
+void
+find_models(void)
+{
+
+	section_foreach("Version", each_version);
+	section_foreach("Manufacturer", each_manufacturer);
+	model_sort();
+}
+
+/*
+ * Release everything read from the .INF file
+ */
+void
+free_inf(void)
+{
+	struct section *s;
+	struct line *l;
+	struct model *m;
+
+	while ((s = sections) != NULL) {
+		sections = s->next;
+		while ((l = s->lines) != NULL) {
+			s->lines = l->next;
+			free(l->text);
+			free(l);
+		}
+		free(s->name);
+		free(s);
+	}
+
+	free(bucket);
+	bucket = NULL;
+	nbucket = 0;
+	nsection = 0;
+
+	while ((m = models) != NULL) {
+		models = m->next;
+		free(m->file);
+		free(m);
+	}
+	lastmodel = &models;
+
+	free(DriverDate);
+	DriverDate = NULL;
+	free(DriverVersion);
+	DriverVersion = NULL;
+}
@@ -0,0 +1,462 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * A small LZ77 codec for compressed firmware files, so that less needs
+ * to be read from slow storage. The file is
+ *
+ *	[0]	u8[4]	magic "BFWZ"
+ *	[4]	u32	uncompressed length
+ *	[8]		blocks
+ *
+ * and each block holds up to LZ_BLOCK bytes of the data, compressed
+ * separately from the others, as
+ *
+ *	[0]	u32	length of the block, with LZ_STORED set if the
+ *			block is not compressed
+ *	[4]	u8[]	block
+ *
+ * so that blocks can be decoded as soon as they are read, and a file can
+ * be parsed a block at a time without the whole being held. Compressed
+ * blocks are a sequence of a token byte, with the literal length in the
+ * high nibble and the match length less LZ_MINMATCH in the low nibble,
+ * then the literals, a 16-bit match offset and the match. Either length
+ * may be extended by bytes following the token or the offset, added
+ * until one is not 255. The last sequence in a block has literals only.
+ * All values are little endian.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+
+#define LZ_HDRLEN	8
+#define LZ_STORED	0x80000000
+#define LZ_MINMATCH	4
+#define LZ_MAXOFF	65535
+#define LZ_HASHBITS	13
+#define LZ_MAXRATIO	255	/* bytes decoded from each byte, at most */
+
+static uint32_t
+lz_hash(const uint8_t *p)
+{
+
+	return (le32dec(p) * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static uint8_t *
+lz_putlen(uint8_t *op, size_t len)
+{
+
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/*
+ * The most that a block of n bytes can compress to
+ */
+size_t
+lz_bound(size_t n)
+{
+
+	return n + n / 255 + 16;
+}
+
+/*
+ * Compress a block into dst, which must have room for lz_bound(n) bytes.
+ * Returns the compressed length.
+ */
+size_t
+lz_compress(uint8_t *dst, const uint8_t *src, size_t n)
+{
+	uint32_t table[1 << LZ_HASHBITS];
+	const uint8_t *ip, *anchor, *end, *ref;
+	uint8_t *op;
+	size_t lit, mlen;
+	uint32_t h, pos;
+
+	memset(table, 0xff, sizeof(table));
+
+	op = dst;
+	ip = anchor = src;
+	end = src + n;
+
+	while (end - ip >= LZ_MINMATCH) {
+		h = lz_hash(ip);
+		pos = table[h];
+		table[h] = (uint32_t)(ip - src);
+
+		if (pos == UINT32_MAX || (size_t)(ip - src) - pos > LZ_MAXOFF
+		    || memcmp(src + pos, ip, LZ_MINMATCH) != 0) {
+			ip++;
+			continue;
+		}
+
+		ref = src + pos;
+
+		mlen = LZ_MINMATCH;
+		while (ip + mlen < end && ip[mlen] == ref[mlen])
+			mlen++;
+
+		lit = (size_t)(ip - anchor);
+		*op++ = (uint8_t)(MIN(lit, 15) << 4
+		    | MIN(mlen - LZ_MINMATCH, 15));
+		if (lit >= 15)
+			op = lz_putlen(op, lit - 15);
+
+		memcpy(op, anchor, lit);
+		op += lit;
+
+		le16enc(op, (uint16_t)(ip - ref));
+		op += 2;
+
+		if (mlen - LZ_MINMATCH >= 15)
+			op = lz_putlen(op, mlen - LZ_MINMATCH - 15);
+
+		ip += mlen;
+		anchor = ip;
+	}
+
+	lit = (size_t)(end - anchor);
+	*op++ = (uint8_t)(MIN(lit, 15) << 4);
+	if (lit >= 15)
+		op = lz_putlen(op, lit - 15);
+
+	memcpy(op, anchor, lit);
+	op += lit;
+
+	return (size_t)(op - dst);
+}
+
+static bool
+lz_getlen(const uint8_t **ip, const uint8_t *end, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= end)
+			return false;
+
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/*
+ * Decompress a block, which must fill dst exactly. Returns -1 if the
+ * block is malformed.
+ */
+int
+lz_decompress(uint8_t *dst, size_t dstlen, const uint8_t *src, size_t srclen)
+{
+	const uint8_t *ip, *end;
+	uint8_t *op, *ref;
+	size_t len, off;
+	uint8_t token;
+
+	ip = src;
+	end = src + srclen;
+	op = dst;
+
+	for (;;) {
+		if (ip >= end)
+			return -1;
+
+		token = *ip++;
+
+		len = token >> 4;
+		if (len == 15 && !lz_getlen(&ip, end, &len))
+			return -1;
+
+		if (len > (size_t)(end - ip)
+		    || len > (size_t)(dst + dstlen - op))
+			return -1;
+
+		memcpy(op, ip, len);
+		op += len;
+		ip += len;
+
+		if (ip == end)
+			break;
+
+		if (end - ip < 2)
+			return -1;
+
+		off = le16dec(ip);
+		ip += 2;
+
+		len = (token & 15);
+		if (len == 15 && !lz_getlen(&ip, end, &len))
+			return -1;
+
+		len += LZ_MINMATCH;
+		if (off == 0 || off > (size_t)(op - dst)
+		    || len > (size_t)(dst + dstlen - op))
+			return -1;
+
+		/* the match may overlap what it is copying */
+		for (ref = op - off; len > 0; len--)
+			*op++ = *ref++;
+	}
+
+	return (op == dst + dstlen ? 0 : -1);
+}
+
+/*
+ * Write data to the stream in compressed form. Returns false if it could
+ * not be written.
+ */
+bool
+lz_fwrite(FILE *f, const uint8_t *buf, size_t len)
+{
+	uint8_t hdr[LZ_HDRLEN], *out;
+	size_t off, n, clen;
+
+	if (len > UINT32_MAX) {
+		errno = EFBIG;
+		return false;
+	}
+
+	memcpy(hdr, LZ_MAGIC, 4);
+	le32enc(hdr + 4, (uint32_t)len);
+	fwrite(hdr, 1, sizeof(hdr), f);
+
+	out = emalloc(sizeof(uint32_t) + lz_bound(LZ_BLOCK));
+	for (off = 0; off < len; off += n) {
+		n = MIN(len - off, LZ_BLOCK);
+		clen = lz_compress(out + sizeof(uint32_t), buf + off, n);
+		if (clen >= n) {
+			clen = n;
+			memcpy(out + sizeof(uint32_t), buf + off, n);
+			le32enc(out, (uint32_t)clen | LZ_STORED);
+		} else {
+			le32enc(out, (uint32_t)clen);
+		}
+
+		fwrite(out, 1, sizeof(uint32_t) + clen, f);
+	}
+
+	free(out);
+	return (ferror(f) == 0);
+}
+
+static ssize_t
+readn(int fd, void *buf, size_t n)
+{
+	ssize_t len;
+	size_t off;
+
+	for (off = 0; off < n; off += (size_t)len) {
+		len = read(fd, (uint8_t *)buf + off, n - off);
+		if (len == -1)
+			return -1;
+
+		if (len == 0)
+			break;
+	}
+
+	return (ssize_t)off;
+}
+
+/*
+ * Start reading compressed data from the file, which is left open. The
+ * length in the header is checked against the size of the file, as each
+ * block has a length word and no byte of a block decodes to more than
+ * LZ_MAXRATIO bytes. Returns -1 with errno set, to EFTYPE if the header
+ * is malformed or claims more data than the file could hold.
+ */
+int
+lz_open(struct lz_stream *lz, int fd)
+{
+	uint8_t hdr[LZ_HDRLEN];
+	struct stat sb;
+	uint64_t need;
+	ssize_t rv;
+
+	memset(lz, 0, sizeof(*lz));
+	lz->fd = fd;
+
+	if (fstat(fd, &sb) == -1)
+		return -1;
+
+	rv = readn(fd, hdr, sizeof(hdr));
+	if (rv == -1)
+		return -1;
+
+	if (rv != sizeof(hdr) || memcmp(hdr, LZ_MAGIC, 4) != 0) {
+		errno = EFTYPE;
+		return -1;
+	}
+
+	lz->len = le32dec(hdr + 4);
+	need = LZ_HDRLEN
+	    + (lz->len + LZ_BLOCK - 1) / LZ_BLOCK * sizeof(uint32_t)
+	    + lz->len / LZ_MAXRATIO;
+	if (S_ISREG(sb.st_mode) && need > (uint64_t)sb.st_size) {
+		errno = EFTYPE;
+		return -1;
+	}
+
+	lz->in = emalloc(lz_bound(LZ_BLOCK));
+	return 0;
+}
+
+/*
+ * Read and decode the next block into buf, which has room for LZ_BLOCK
+ * bytes. Returns the length of the block, 0 at the end of the data, or
+ * -1 with errno set, to EFTYPE if the data is malformed.
+ */
+ssize_t
+lz_next(struct lz_stream *lz, uint8_t *buf)
+{
+	uint8_t hdr[sizeof(uint32_t)];
+	uint32_t word;
+	size_t n, clen;
+	ssize_t rv;
+
+	if (lz->off == lz->len)
+		return 0;
+
+	n = MIN(lz->len - lz->off, LZ_BLOCK);
+
+	rv = readn(lz->fd, hdr, sizeof(hdr));
+	if (rv != sizeof(hdr))
+		goto fail;
+
+	word = le32dec(hdr);
+	clen = word & ~LZ_STORED;
+	if (clen > lz_bound(LZ_BLOCK) || ((word & LZ_STORED) && clen != n)) {
+		rv = 0;
+		goto fail;
+	}
+
+	rv = readn(lz->fd, lz->in, clen);
+	if (rv != (ssize_t)clen)
+		goto fail;
+
+	if (word & LZ_STORED)
+		memcpy(buf, lz->in, n);
+	else if (lz_decompress(buf, n, lz->in, clen) == -1) {
+		rv = 0;
+		goto fail;
+	}
+
+	lz->off += n;
+	return (ssize_t)n;
+
+fail:
+	if (rv != -1)
+		errno = EFTYPE;
+	return -1;
+}
+
+/*
+ * Go back to the first block
+ */
+int
+lz_rewind(struct lz_stream *lz)
+{
+
+	if (lseek(lz->fd, LZ_HDRLEN, SEEK_SET) == -1)
+		return -1;
+
+	lz->off = 0;
+	return 0;
+}
+
+void
+lz_close(struct lz_stream *lz)
+{
+
+	free(lz->in);
+	lz->in = NULL;
+}
+
+/*
+ * Read the whole of the compressed data from the file into an allocated
+ * buffer, for when it is needed all at once. Returns -1 with errno set,
+ * as for lz_open() and lz_next().
+ */
+int
+lz_read(int fd, uint8_t **bufp, size_t *lenp)
+{
+	struct lz_stream lz;
+	uint8_t *buf;
+	size_t off;
+	ssize_t n;
+	int e;
+
+	if (lz_open(&lz, fd) == -1)
+		return -1;
+
+	buf = malloc(MAX(lz.len, 1));
+	if (buf == NULL) {
+		lz_close(&lz);
+		return -1;
+	}
+
+	for (off = 0; off < lz.len; off += (size_t)n) {
+		n = lz_next(&lz, buf + off);
+		if (n <= 0) {
+			e = (n == 0 ? EFTYPE : errno);
+			free(buf);
+			lz_close(&lz);
+			errno = e;
+			return -1;
+		}
+	}
+
+	lz_close(&lz);
+	*bufp = buf;
+	*lenp = lz.len;
+	return 0;
+}
+
+/*
+ * Whether the file name is for a compressed file
+ */
+bool
+lz_name(const char *name)
+{
+	size_t len;
+
+	len = strlen(name);
+	return (len > strlen(LZ_SUFFIX)
+	    && strcmp(name + len - strlen(LZ_SUFFIX), LZ_SUFFIX) == 0);
+}
@@ -0,0 +1,532 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The firmware pack holds the precompiled firmware for every model in
+ * a single file, with a hashed index by USB Vendor and Product ID. The
+ * pack is written by bcmfw-install, and mapped once by bcmfw.
+ *
+ *	[0]	u8[4]	magic "BFWP"
+ *	[4]	u16	format version
+ *	[6]	u16	header length
+ *	[8]	u32	number of hash buckets, a power of two
+ *	[12]	u32	number of index entries
+ *	[16]	u32	offset of the buckets
+ *	[20]	u32	offset of the index entries
+ *	[24]	u8[8]	reserved
+ *
+ * Each bucket is the number of the first index entry in its chain, and
+ * each index entry is
+ *
+ *	[0]	u16	USB Vendor ID
+ *	[2]	u16	USB Product ID
+ *	[4]	u32	number of the next entry in the chain
+ *	[8]	u32	offset of the .hex file name
+ *	[12]	u32	offset of the precompiled firmware
+ *	[16]	u32	length of the precompiled firmware
+ *
+ * where the chains end with PACK_NONE. The names and the precompiled
+ * firmware follow, and firmware that is used by many models is stored
+ * only once. All values are little endian.
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+
+#define PACK_MAGIC	"BFWP"
+#define PACK_VERSION	1
+#define PACK_HDRLEN	32
+#define PACK_ENTLEN	20
+#define PACK_NONE	0xffffffff
+
+static void __printflike(2, 3)
+pack_fail(struct pack *pk, const char *fmt, ...)
+{
+	char msg[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(msg, sizeof(msg), fmt, ap);
+	va_end(ap);
+
+	snprintf(pk->error, sizeof(pk->error), "%s: %s", pk->name, msg);
+}
+
+static uint32_t
+pack_hash(uint16_t vid, uint16_t pid)
+{
+	uint32_t h;
+
+	h = ((uint32_t)vid << 16) | pid;
+	h ^= h >> 16;
+	h *= 0x7feb352d;
+	h ^= h >> 15;
+	h *= 0x846ca68b;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/*
+ * Open and map the firmware pack, and check the header. Returns 0 on
+ * success or -1 on error, see pack_error(). If the pack does not exist,
+ * errno is ENOENT.
+ */
+int
+pack_open(struct pack *pk, const char *file)
+{
+	struct stat sb;
+	uint32_t boff, eoff;
+	int fd, e;
+
+	memset(pk, 0, sizeof(*pk));
+	snprintf(pk->name, sizeof(pk->name), "%s", file);
+
+	fd = open(file, O_RDONLY);
+	if (fd == -1)
+		goto fail;
+
+	if (fstat(fd, &sb) == -1)
+		goto fail;
+
+	if (!S_ISREG(sb.st_mode) || sb.st_size < PACK_HDRLEN
+	    || (uintmax_t)sb.st_size > UINT32_MAX) {
+		errno = EFTYPE;
+		goto fail;
+	}
+
+	pk->sb = sb;
+	pk->size = (size_t)sb.st_size;
+	pk->buf = mmap(NULL, pk->size, PROT_READ, MAP_FILE | MAP_PRIVATE,
+	    fd, 0);
+	if (pk->buf == MAP_FAILED)
+		goto fail;
+
+	close(fd);
+
+	if (memcmp(pk->buf, PACK_MAGIC, 4) != 0) {
+		pack_fail(pk, "not a firmware pack");
+		goto bad;
+	}
+
+	if (le16dec(pk->buf + 4) != PACK_VERSION) {
+		pack_fail(pk, "unknown format version %u",
+		    le16dec(pk->buf + 4));
+		goto bad;
+	}
+
+	pk->nbucket = le32dec(pk->buf + 8);
+	pk->nentry = le32dec(pk->buf + 12);
+	boff = le32dec(pk->buf + 16);
+	eoff = le32dec(pk->buf + 20);
+
+	if (pk->nbucket == 0 || (pk->nbucket & (pk->nbucket - 1)) != 0
+	    || boff < le16dec(pk->buf + 6)
+	    || boff > pk->size || pk->nbucket > (pk->size - boff) / 4
+	    || eoff > pk->size
+	    || pk->nentry > (pk->size - eoff) / PACK_ENTLEN) {
+		pack_fail(pk, "bad index");
+		goto bad;
+	}
+
+	pk->bucket = pk->buf + boff;
+	pk->entry = pk->buf + eoff;
+	return 0;
+
+fail:
+	e = errno;
+	pack_fail(pk, "%s", strerror(e));
+	if (fd != -1)
+		close(fd);
+	pk->buf = NULL;
+	errno = e;
+	return -1;
+
+bad:
+	munmap(pk->buf, pk->size);
+	pk->buf = NULL;
+	errno = EFTYPE;
+	return -1;
+}
+
+void
+pack_close(struct pack *pk)
+{
+
+	if (pk->buf != NULL)
+		munmap(pk->buf, pk->size);
+
+	pk->buf = NULL;
+}
+
+const char *
+pack_error(const struct pack *pk)
+{
+
+	return pk->error;
+}
+
+static int
+pack_decode(struct pack *pk, const uint8_t *ent, const char **name,
+    size_t *off, size_t *len)
+{
+	uint32_t noff;
+
+	noff = le32dec(ent + 8);
+	*off = le32dec(ent + 12);
+	*len = le32dec(ent + 16);
+
+	if (noff >= pk->size
+	    || memchr(pk->buf + noff, '\0', pk->size - noff) == NULL
+	    || *off > pk->size || *len > pk->size - *off) {
+		pack_fail(pk, "bad entry for %04x:%04x",
+		    le16dec(ent), le16dec(ent + 2));
+		return -1;
+	}
+
+	*name = (const char *)pk->buf + noff;
+	return 1;
+}
+
+/*
+ * Find the precompiled firmware for a device in the pack. Returns 1
+ * with the .hex file name and the location of the firmware in the pack,
+ * 0 if there is none for the device, or -1 if the pack is damaged, see
+ * pack_error(). The firmware itself is not checked.
+ */
+int
+pack_find(struct pack *pk, uint16_t vid, uint16_t pid, const char **name,
+    size_t *off, size_t *len)
+{
+	const uint8_t *ent;
+	uint32_t h, i, n;
+
+	ent = NULL;
+	h = pack_hash(vid, pid) & (pk->nbucket - 1);
+	i = le32dec(pk->bucket + 4 * (size_t)h);
+	for (n = 0; i != PACK_NONE; n++) {
+		if (i >= pk->nentry || n >= pk->nentry) {
+			pack_fail(pk, "bad index chain");
+			return -1;
+		}
+
+		ent = pk->entry + (size_t)i * PACK_ENTLEN;
+		if (le16dec(ent) == vid && le16dec(ent + 2) == pid)
+			break;
+
+		i = le32dec(ent + 4);
+	}
+
+	if (i == PACK_NONE)
+		return 0;
+
+	return pack_decode(pk, ent, name, off, len);
+}
+
+/*
+ * Get an entry of the pack index by number, to walk the whole pack.
+ * Returns 1 with the device IDs and as for pack_find(), 0 if there is
+ * no such entry, or -1 if the pack is damaged.
+ */
+int
+pack_entry(struct pack *pk, size_t i, uint16_t *vid, uint16_t *pid,
+    const char **name, size_t *off, size_t *len)
+{
+	const uint8_t *ent;
+
+	if (i >= pk->nentry)
+		return 0;
+
+	ent = pk->entry + i * PACK_ENTLEN;
+	*vid = le16dec(ent);
+	*pid = le16dec(ent + 2);
+
+	return pack_decode(pk, ent, name, off, len);
+}
+
+/*
+ * Writing the pack
+ */
+struct packent {
+	uint16_t	vid;
+	uint16_t	pid;
+	uint32_t	next;
+	size_t		patch;	/* index into patch table */
+};
+
+struct patch {
+	const char *	name;	/* .hex file name */
+	uint32_t	nameoff;
+	uint32_t	off;
+	size_t		len;
+	uint8_t *	buf;
+};
+
+static const struct pack_model *sort_models;
+
+static int
+model_cmp(const void *a, const void *b)
+{
+	const size_t *i = a, *j = b;
+	int rv;
+
+	rv = strcmp(sort_models[*i].file, sort_models[*j].file);
+	if (rv != 0)
+		return rv;
+
+	return (*i < *j ? -1 : *i > *j ? 1 : 0);
+}
+
+/*
+ * Read the precompiled firmware for a .hex file from the directory,
+ * which may be compressed. Returns false if there is none, warning if
+ * it is damaged.
+ */
+static bool
+patch_read(struct patch *p, const char *dir)
+{
+	static const char *const suffix[] = { "", LZ_SUFFIX };
+	struct fwb fw;
+	char *path;
+	size_t i, len;
+	bool rv;
+
+	len = strlen(p->name);
+	if (len <= 4 || strcasecmp(&p->name[len - 4], ".hex") != 0)
+		return false;
+
+	rv = false;
+	for (i = 0; i < __arraycount(suffix) && !rv; i++) {
+		easprintf(&path, "%s/%.*s%s%s", dir, (int)(len - 4), p->name,
+		    FWB_SUFFIX, suffix[i]);
+
+		rv = (fwb_open(&fw, path) == 0);
+		if (rv) {
+			p->len = fw.size;
+			p->buf = emalloc(p->len);
+			memcpy(p->buf, fw.buf, p->len);
+			fwb_close(&fw);
+		} else if (errno != ENOENT) {
+			warnx("%s", fwb_error(&fw));
+		}
+
+		free(path);
+	}
+
+	return rv;
+}
+
+/*
+ * Write a firmware pack holding the precompiled firmware from 'dir' for
+ * each of the models. Models without precompiled firmware are left out,
+ * as are repeated models after the first, and firmware with the same
+ * contents under different names is stored once. The pack is written
+ * under a temporary name and renamed when complete. Returns false on error,
+ * with a warning.
+ */
+bool
+pack_write(const char *file, const char *dir, const struct pack_model *m,
+    size_t nmodel)
+{
+	struct packent *ent;
+	struct patch *patch;
+	size_t *ord, *map;
+	size_t i, k, nent, npatch, nbucket, size, off;
+	uint32_t *bucket, h, j;
+	uint8_t *buf, *p;
+	char *tmp;
+	FILE *f;
+	bool found, rv;
+
+	/* read each firmware file once, in name order */
+	ord = ecalloc(nmodel + 1, sizeof(size_t));
+	map = ecalloc(nmodel + 1, sizeof(size_t));
+	patch = ecalloc(nmodel + 1, sizeof(struct patch));
+
+	for (i = 0; i < nmodel; i++)
+		ord[i] = i;
+
+	sort_models = m;
+	qsort(ord, nmodel, sizeof(size_t), model_cmp);
+
+	npatch = 0;
+	found = false;
+	for (i = 0; i < nmodel; i++) {
+		if (i == 0 || strcmp(m[ord[i]].file, m[ord[i - 1]].file) != 0) {
+			patch[npatch].name = m[ord[i]].file;
+			found = patch_read(&patch[npatch], dir);
+			if (found)
+				npatch++;
+		}
+
+		map[ord[i]] = (found ? npatch - 1 : SIZE_MAX);
+	}
+
+	/* the index, in model order */
+	for (nbucket = 1; nbucket < nmodel; nbucket <<= 1)
+		continue;
+
+	bucket = ecalloc(nbucket, sizeof(uint32_t));
+	for (k = 0; k < nbucket; k++)
+		bucket[k] = PACK_NONE;
+
+	ent = ecalloc(nmodel + 1, sizeof(struct packent));
+	nent = 0;
+	for (i = 0; i < nmodel; i++) {
+		if (map[i] == SIZE_MAX)
+			continue;
+
+		h = pack_hash(m[i].vid, m[i].pid) & (uint32_t)(nbucket - 1);
+		for (j = bucket[h]; j != PACK_NONE; j = ent[j].next) {
+			if (ent[j].vid == m[i].vid && ent[j].pid == m[i].pid)
+				break;
+		}
+
+		if (j != PACK_NONE)
+			continue;
+
+		ent[nent].vid = m[i].vid;
+		ent[nent].pid = m[i].pid;
+		ent[nent].patch = map[i];
+		ent[nent].next = bucket[h];
+		bucket[h] = (uint32_t)nent;
+		nent++;
+	}
+
+	/* lay out the file */
+	size = PACK_HDRLEN + nbucket * 4 + nent * PACK_ENTLEN;
+	for (k = 0; k < npatch; k++) {
+		patch[k].nameoff = (uint32_t)size;
+		size += strlen(patch[k].name) + 1;
+	}
+
+	/* firmware files with the same contents share one copy */
+	for (k = 0; k < npatch; k++) {
+		for (i = 0; i < k; i++) {
+			if (patch[i].len == patch[k].len
+			    && memcmp(patch[i].buf, patch[k].buf,
+			    patch[k].len) == 0)
+				break;
+		}
+
+		if (i < k) {
+			patch[k].off = patch[i].off;
+			continue;
+		}
+
+		patch[k].off = (uint32_t)size;
+		size += patch[k].len;
+	}
+
+	rv = false;
+	tmp = NULL;
+	buf = NULL;
+
+	if (size > UINT32_MAX) {
+		warnx("%s: too large", file);
+		goto done;
+	}
+
+	buf = ecalloc(1, size);
+	memcpy(buf, PACK_MAGIC, 4);
+	le16enc(buf + 4, PACK_VERSION);
+	le16enc(buf + 6, PACK_HDRLEN);
+	le32enc(buf + 8, (uint32_t)nbucket);
+	le32enc(buf + 12, (uint32_t)nent);
+	le32enc(buf + 16, PACK_HDRLEN);
+	le32enc(buf + 20, (uint32_t)(PACK_HDRLEN + nbucket * 4));
+
+	p = buf + PACK_HDRLEN;
+	for (k = 0; k < nbucket; k++, p += 4)
+		le32enc(p, bucket[k]);
+
+	for (k = 0; k < nent; k++, p += PACK_ENTLEN) {
+		le16enc(p, ent[k].vid);
+		le16enc(p + 2, ent[k].pid);
+		le32enc(p + 4, ent[k].next);
+		le32enc(p + 8, patch[ent[k].patch].nameoff);
+		le32enc(p + 12, patch[ent[k].patch].off);
+		le32enc(p + 16, (uint32_t)patch[ent[k].patch].len);
+	}
+
+	for (k = 0; k < npatch; k++) {
+		off = patch[k].nameoff;
+		memcpy(buf + off, patch[k].name, strlen(patch[k].name) + 1);
+		memcpy(buf + patch[k].off, patch[k].buf, patch[k].len);
+	}
+
+	easprintf(&tmp, "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		warn("%s", tmp);
+		goto done;
+	}
+
+	if (fwrite(buf, 1, size, f) != size) {
+		warn("%s", tmp);
+		fclose(f);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (fclose(f) == EOF) {
+		warn("%s", tmp);
+		unlink(tmp);
+		goto done;
+	}
+
+	if (rename(tmp, file) == -1) {
+		warn("%s", file);
+		unlink(tmp);
+		goto done;
+	}
+
+	rv = true;
+
+done:
+	for (k = 0; k < npatch; k++)
+		free(patch[k].buf);
+
+	free(tmp);
+	free(buf);
+	free(ent);
+	free(bucket);
+	free(patch);
+	free(map);
+	free(ord);
+	return rv;
+}
@@ -0,0 +1,320 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Probe cache. What was decided for each device is remembered between
+ * runs, so that a device that does not need anything done can be passed
+ * over without asking it again. The cache is a text file, with a line
+ * for each device and HCI revision,
+ *
+ *	BDADDR	revision	vid:pid	decision	stamp	digest
+ *
+ * where the stamp is from firmware_stamp() when the decision was made,
+ * and the digest is that of the firmware last loaded, or "-".
+ *
+ * Whether a device is made by Broadcom, and which firmware it would
+ * take, do not change. Those decisions are final for as long as the
+ * firmware that can be found does not change, and can be used without
+ * enabling a device that is down when its address is already known.
+ * Whether the firmware is loaded does change, with every power cycle,
+ * so for the others only the USB Vendor and Product ID are used.
+ *
+ * The cache is shared by all devices, and is locked.
+ */
+
+#include <sys/stat.h>
+
+#include <bluetooth.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "btdev.h"
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static char *file;		/* cache file, if open */
+static struct probe *probe;
+static size_t count;
+static bool changed;		/* needs to be written */
+static char stamp[BLOB_CRCLEN + 1];
+
+static const char *const decision[] = {
+	[BTDEV_UPDATE] =		"updated",
+	[BTDEV_NOT_BROADCOM] =		"not-broadcom",
+	[BTDEV_NOT_BROADCOM_USB] =	"not-broadcom-usb",
+	[BTDEV_NOT_AVAILABLE] =		"not-available",
+	[BTDEV_NOT_REQUIRED] =		"not-required",
+	[BTDEV_NOT_FOUND] =		"not-found",
+	[BTDEV_ENABLED] =		"enabled",
+};
+
+static struct probe *
+probe_lookup(const bdaddr_t *bdaddr, uint16_t revision)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (bdaddr_same(&probe[i].bdaddr, bdaddr)
+		    && probe[i].revision == revision)
+			return &probe[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * Read the cache file. A missing file is an empty cache, and lines that
+ * can not be read are dropped.
+ */
+void
+probe_open(const char *path)
+{
+	char addr[18], word[24], crc[BLOB_CRCLEN + 1];
+	char digest[BLOB_DIGESTLEN + 1];
+	struct probe p;
+	char *line;
+	size_t size;
+	FILE *f;
+	size_t i;
+
+	pthread_mutex_lock(&lock);
+	file = estrdup(path);
+	firmware_stamp(stamp);
+
+	f = fopen(file, "r");
+	if (f == NULL) {
+		if (errno != ENOENT)
+			warn("%s", file);
+
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+
+	line = NULL;
+	size = 0;
+	while (getline(&line, &size, f) != EOF) {
+		if (line[0] == '#')
+			continue;
+
+		memset(&p, 0, sizeof(p));
+		if (sscanf(line, "%17s %4hx %4hx:%4hx %23s %8s %64s", addr,
+		    &p.revision, &p.vendor, &p.product, word, crc,
+		    digest) != 7 || !bt_aton(addr, &p.bdaddr))
+			continue;
+
+		for (i = 0; i < __arraycount(decision); i++) {
+			if (strcmp(word, decision[i]) == 0)
+				break;
+		}
+
+		if (i == __arraycount(decision)
+		    || probe_lookup(&p.bdaddr, p.revision) != NULL)
+			continue;
+
+		p.decision = (int)i;
+		snprintf(p.stamp, sizeof(p.stamp), "%s", crc);
+		if (strcmp(digest, "-") != 0)
+			snprintf(p.digest, sizeof(p.digest), "%s", digest);
+
+		probe = erealloc(probe, (count + 1) * sizeof(*probe));
+		probe[count++] = p;
+	}
+
+	free(line);
+	fclose(f);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Write the cache file, if anything changed, and forget it.
+ */
+void
+probe_close(void)
+{
+	char addr[18], *tmp;
+	size_t i;
+	FILE *f;
+
+	pthread_mutex_lock(&lock);
+	if (file == NULL || !changed)
+		goto done;
+
+	easprintf(&tmp, "%s.tmp", file);
+	f = fopen(tmp, "w");
+	if (f == NULL) {
+		warn("%s", tmp);
+		free(tmp);
+		goto done;
+	}
+
+	fprintf(f, "# bcmfw probe cache\n");
+	for (i = 0; i < count; i++) {
+		fprintf(f, "%s\t%04x\t%04x:%04x\t%s\t%s\t%s\n",
+		    bt_ntoa(&probe[i].bdaddr, addr), probe[i].revision,
+		    probe[i].vendor, probe[i].product,
+		    decision[probe[i].decision], probe[i].stamp,
+		    (probe[i].digest[0] != '\0' ? probe[i].digest : "-"));
+	}
+
+	if (fclose(f) == EOF) {
+		warn("%s", tmp);
+		unlink(tmp);
+	} else if (rename(tmp, file) == -1) {
+		warn("%s", file);
+		unlink(tmp);
+	}
+
+	free(tmp);
+
+done:
+	free(file);
+	free(probe);
+	file = NULL;
+	probe = NULL;
+	count = 0;
+	changed = false;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Recall what was decided for the device with this address and HCI
+ * revision. Returns false if nothing is known.
+ */
+bool
+probe_find(const bdaddr_t *bdaddr, uint16_t revision, struct probe *p)
+{
+	struct probe *e;
+
+	pthread_mutex_lock(&lock);
+	e = probe_lookup(bdaddr, revision);
+	if (e != NULL)
+		*p = *e;
+	pthread_mutex_unlock(&lock);
+
+	return (e != NULL);
+}
+
+/*
+ * Find a final decision for the device with this address and any HCI
+ * revision, for when the revision is not known. Returns false if there
+ * is none.
+ */
+bool
+probe_known(const bdaddr_t *bdaddr, struct probe *p)
+{
+	size_t i;
+	bool found;
+
+	pthread_mutex_lock(&lock);
+	found = false;
+	for (i = 0; i < count && !found; i++) {
+		if (bdaddr_same(&probe[i].bdaddr, bdaddr)
+		    && probe_final(&probe[i])) {
+			*p = probe[i];
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	return found;
+}
+
+/*
+ * Returns true if the decision still holds, whatever state the device
+ * is in now.
+ */
+bool
+probe_final(const struct probe *p)
+{
+
+	switch (p->decision) {
+	case BTDEV_NOT_BROADCOM:
+	case BTDEV_NOT_BROADCOM_USB:
+	case BTDEV_NOT_AVAILABLE:
+		return true;
+
+	case BTDEV_NOT_FOUND:
+		return (strcmp(p->stamp, stamp) == 0);
+
+	default:
+		return false;
+	}
+}
+
+/*
+ * Remember a decision. The digest of the firmware that was loaded is
+ * kept until other firmware is loaded.
+ */
+void
+probe_note(const struct probe *p)
+{
+	struct probe *e;
+
+	pthread_mutex_lock(&lock);
+	if (file == NULL)
+		goto done;
+
+	e = probe_lookup(&p->bdaddr, p->revision);
+	if (e == NULL) {
+		probe = erealloc(probe, (count + 1) * sizeof(*probe));
+		e = &probe[count++];
+		memset(e, 0, sizeof(*e));
+	} else if (e->decision == p->decision
+	    && e->vendor == p->vendor && e->product == p->product
+	    && strcmp(e->stamp, stamp) == 0
+	    && (p->digest[0] == '\0' || strcmp(e->digest, p->digest) == 0)) {
+		goto done;
+	}
+
+	e->bdaddr = p->bdaddr;
+	e->revision = p->revision;
+	e->vendor = p->vendor;
+	e->product = p->product;
+	e->decision = p->decision;
+	snprintf(e->stamp, sizeof(e->stamp), "%s", stamp);
+	if (p->digest[0] != '\0')
+		snprintf(e->digest, sizeof(e->digest), "%s", p->digest);
+
+	changed = true;
+
+done:
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Describe a decision, for display.
+ */
+const char *
+probe_decision(const struct probe *p)
+{
+
+	return decision[p->decision];
+}
@@ -0,0 +1,172 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The span map describes which parts of the target address space an
+ * image writes to, as a sorted array of disjoint address ranges. Adding
+ * a range that touches an existing one extends it, so each span is a
+ * maximal contiguous run, and adding a range that overlaps data already
+ * present is refused.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <util.h>
+
+#include "bcmfw.h"
+
+#define SPAN_END(s)	((uint64_t)(s)->addr + (s)->len)
+
+void
+spanmap_init(struct spanmap *map)
+{
+
+	map->span = NULL;
+	map->count = 0;
+	map->size = 0;
+	map->sorted = true;
+}
+
+void
+spanmap_free(struct spanmap *map)
+{
+
+	free(map->span);
+	spanmap_init(map);
+}
+
+static void
+spanmap_insert(struct spanmap *map, size_t i, uint32_t addr, size_t len)
+{
+
+	if (map->count == map->size) {
+		map->size = MAX(map->size * 2, 16);
+		map->span = erealloc(map->span,
+		    map->size * sizeof(struct span));
+	}
+
+	memmove(&map->span[i + 1], &map->span[i],
+	    (map->count - i) * sizeof(struct span));
+	map->span[i].addr = addr;
+	map->span[i].len = len;
+	map->count++;
+}
+
+static void
+spanmap_remove(struct spanmap *map, size_t i)
+{
+
+	map->count--;
+	memmove(&map->span[i], &map->span[i + 1],
+	    (map->count - i) * sizeof(struct span));
+}
+
+/*
+ * Add the range of 'len' bytes at 'addr'. Returns -1 if any part of it
+ * is already present, in which case the map is not changed.
+ */
+int
+spanmap_add(struct spanmap *map, uint32_t addr, size_t len)
+{
+	struct span *s;
+	uint64_t end;
+	size_t lo, hi, i;
+
+	end = (uint64_t)addr + len;
+	if (len == 0)
+		return 0;
+
+	/* records normally arrive in order, so try the last span first */
+	if (map->count > 0) {
+		s = &map->span[map->count - 1];
+		if (addr == SPAN_END(s)) {
+			s->len += len;
+			return 0;
+		}
+
+		if (addr > SPAN_END(s)) {
+			spanmap_insert(map, map->count, addr, len);
+			return 0;
+		}
+
+		map->sorted = false;
+	}
+
+	/* find the first span which ends at or after addr */
+	lo = 0;
+	hi = map->count;
+	while (lo < hi) {
+		i = lo + (hi - lo) / 2;
+		if (SPAN_END(&map->span[i]) < addr)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+
+	i = lo;
+	if (i == map->count || end < map->span[i].addr) {
+		spanmap_insert(map, i, addr, len);
+		return 0;
+	}
+
+	s = &map->span[i];
+	if (addr < SPAN_END(s) && end > s->addr)
+		return -1;
+
+	if (end == s->addr) {
+		/* prepend, cannot touch the previous span */
+		s->addr = addr;
+		s->len += len;
+		return 0;
+	}
+
+	/* append to span i, and perhaps join span i + 1 */
+	if (i + 1 < map->count && end > map->span[i + 1].addr)
+		return -1;
+
+	s->len += len;
+	if (i + 1 < map->count && end == map->span[i + 1].addr) {
+		s->len += map->span[i + 1].len;
+		spanmap_remove(map, i + 1);
+	}
+
+	return 0;
+}
+
+/*
+ * Total bytes covered by the map
+ */
+uint64_t
+spanmap_size(const struct spanmap *map)
+{
+	uint64_t n;
+	size_t i;
+
+	n = 0;
+	for (i = 0; i < map->count; i++)
+		n += map->span[i].len;
+
+	return n;
+}
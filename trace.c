@@ -0,0 +1,306 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Trace of the records read from Patch RAM files. The text trace, with
+ * -vv, is the record dump written to stdout, or to the output of the
+ * device that the file is being read for. The binary trace, with -t,
+ * is written to a file for later processing and holds every record in
+ * the order that it was read, as
+ *
+ *	[0]	u8	record type
+ *	[1]	u8	data length
+ *	[2]	u32	address, little endian
+ *	[6]	u8[]	data
+ *
+ * following a 4 byte "BFWT" header. The address is the absolute address
+ * of Data records, the new base of Extended Address records, and the
+ * start address of Start Address records.
+ *
+ * Records are formatted into a buffer which is only written out when
+ * full, or when the trace is flushed. The buffer is shared by all
+ * threads, so it is only touched with trace_lock held.
+ */
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bcmfw.h"
+
+#define TRACE_BUFSIZ	(64 * 1024)
+#define TRACE_RECMAX	1024	/* largest formatted record */
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *	trace_fp;
+static FILE *	trace_out;	/* text goes here instead, if set */
+static bool	trace_bin;
+static size_t	trace_len;
+static char	trace_buf[TRACE_BUFSIZ];
+
+static const char trace_hex[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static void
+trace_atexit(void)
+{
+
+	trace_close();
+}
+
+/*
+ * Start tracing, to the named file in binary or to stdout as text
+ * if no file was given.
+ */
+void
+trace_open(const char *file)
+{
+
+	if (trace_fp != NULL)
+		return;
+
+	if (file == NULL) {
+		trace_fp = stdout;
+		trace_bin = false;
+	} else {
+		trace_fp = fopen(file, "w");
+		if (trace_fp == NULL)
+			err(EXIT_FAILURE, "%s", file);
+
+		trace_bin = true;
+		memcpy(trace_buf, "BFWT", 4);
+		trace_len = 4;
+	}
+
+	atexit(trace_atexit);
+}
+
+bool
+tracing(void)
+{
+
+	return (trace_fp != NULL);
+}
+
+/*
+ * Write out the buffer, with trace_lock held.
+ */
+static void
+trace_write(void)
+{
+	FILE *fp;
+
+	if (trace_fp == NULL || trace_len == 0)
+		return;
+
+	fp = (trace_out != NULL ? trace_out : trace_fp);
+	if (fwrite(trace_buf, 1, trace_len, fp) != trace_len)
+		err(EXIT_FAILURE, "trace");
+
+	trace_len = 0;
+	fflush(fp);
+}
+
+/*
+ * Send the text trace to the given stream until this is called again
+ * with NULL, so that the dump of a file read on behalf of a device
+ * lands in the output of that device. The binary trace is unaffected.
+ */
+void
+trace_output(FILE *fp)
+{
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fp != NULL && !trace_bin) {
+		trace_write();
+		trace_out = fp;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void
+trace_flush(void)
+{
+
+	pthread_mutex_lock(&trace_lock);
+	trace_write();
+	pthread_mutex_unlock(&trace_lock);
+}
+
+void
+trace_close(void)
+{
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fp != NULL) {
+		trace_write();
+		if (trace_fp != stdout)
+			fclose(trace_fp);
+
+		trace_fp = NULL;
+		trace_out = NULL;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+static char *
+put_str(char *p, const char *s)
+{
+	size_t len;
+
+	len = strlen(s);
+	memcpy(p, s, len);
+	return p + len;
+}
+
+static char *
+put_x32(char *p, uint32_t v)
+{
+	int i;
+
+	*p++ = '0';
+	*p++ = 'x';
+	for (i = 24; i >= 0; i -= 8) {
+		memcpy(p, &trace_hex[((v >> i) & 0xff) * 2], 2);
+		p += 2;
+	}
+
+	return p;
+}
+
+static char *
+put_u(char *p, unsigned int v)
+{
+	char tmp[12];
+	size_t n;
+
+	n = 0;
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v > 0);
+
+	while (n > 0)
+		*p++ = tmp[--n];
+
+	return p;
+}
+
+/*
+ * Trace a record, formatted the same as the verbose dump always was.
+ */
+static char *
+trace_text(char *p, uint8_t type, uint32_t addr, const uint8_t *data,
+    size_t len)
+{
+	size_t i;
+
+	switch (type) {
+	case 0x00:	/* Data */
+		p = put_str(p, "  Data address ");
+		p = put_x32(p, addr);
+		p = put_str(p, ", count ");
+		p = put_u(p, (unsigned int)len + 4);
+
+		for (i = 0; i < len; i++) {
+			if (i % 16 == 0)
+				p = put_str(p, "\n   ");
+
+			*p++ = ' ';
+			memcpy(p, &trace_hex[data[i] * 2], 2);
+			p += 2;
+		}
+
+		*p++ = '\n';
+		break;
+
+	case 0x01:	/* End of File */
+		*p++ = '\n';
+		break;
+
+	case 0x02:	/* Extended Segment Address */
+		p = put_str(p, "  Extended Segment Address ");
+		p = put_x32(p, addr);
+		*p++ = '\n';
+		break;
+
+	case 0x03:	/* Start Segment Address */
+	case 0x05:	/* Start Linear Address */
+		p = put_str(p, (type == 0x03
+		    ? "  Start Segment Address " : "  Start Linear Address "));
+		p = put_x32(p, addr);
+		*p++ = '\n';
+		break;
+
+	case 0x04:	/* Extended Linear Address */
+		p = put_str(p, "  Extended Linear Address ");
+		p = put_x32(p, addr);
+		*p++ = '\n';
+		break;
+	}
+
+	return p;
+}
+
+void
+trace_record(uint8_t type, uint32_t addr, const uint8_t *data, size_t len)
+{
+	char *p;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_fp == NULL) {
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+
+	if (TRACE_BUFSIZ - trace_len < TRACE_RECMAX)
+		trace_write();
+
+	p = trace_buf + trace_len;
+
+	if (trace_bin) {
+		*p++ = (char)type;
+		*p++ = (char)len;
+		le32enc(p, addr);
+		p += sizeof(uint32_t);
+		if (len > 0)
+			memcpy(p, data, len);
+		p += len;
+	} else {
+		p = trace_text(p, type, addr, data, len);
+	}
+
+	trace_len = (size_t)(p - trace_buf);
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -43,6 +43,7 @@
 
 #include <err.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -53,6 +54,8 @@
 #define USB_VENDOR_BROADCOM		0x0a5c
 #define USB_PRODUCT_BROADCOM_BCM2033NF	0x2033
 
+#define UGEN_TIMEOUT			2000	/* milliseconds */
+
 /* Default filenames */
 const char *bcm2033_fw = "BCM2033-FW.bin";
 const char *bcm2033_md = "BCM2033-MD.hex";
@@ -88,6 +91,7 @@ ugen_write_file(const char *name)
 	ssize_t len;
 	int fd;
 
+	firmware_chdir();
 	if ((fd = open(name, O_RDONLY)) == -1)
 		err(EXIT_FAILURE, "%s", name);
 
@@ -106,6 +110,38 @@ ugen_write_file(const char *name)
 	close(fd);
 }
 
+/*
+ * Wait for the device to answer on the interrupt endpoint, and return
+ * the first byte.
+ */
+static char
+ugen_read_intr(const char *dv, const char *what)
+{
+	struct pollfd pfd;
+	char buf[10];
+	ssize_t len;
+	int rv;
+
+	pfd.fd = intr;
+	pfd.events = POLLIN;
+
+	rv = poll(&pfd, 1, UGEN_TIMEOUT);
+	if (rv == -1)
+		err(EXIT_FAILURE, "%s: poll", dv);
+
+	if (rv == 0)
+		errx(EXIT_FAILURE, "%s: read `%s' timed out", dv, what);
+
+	len = read(intr, buf, sizeof(buf));
+	if (len == -1)
+		err(EXIT_FAILURE, "%s: read `%s' failed", dv, what);
+
+	if (len < 1)
+		errx(EXIT_FAILURE, "%s: read `%s' failed", dv, what);
+
+	return buf[0];
+}
+
 /*
  * Open Control endpoint and verify VendorID & ProductID, then
  * find the interrupt and bulk-in device numbers for Interface 0,
@@ -198,29 +234,24 @@ ugen_query_dev(const char *dv)
 void
 check_ugen(const char *dv)
 {
-	char buf[10];
 
+	/*
+	 * The minidriver answers the memory select as soon as it runs,
+	 * and the firmware answers when it has been loaded, so wait for
+	 * each of those rather than for a fixed time.
+	 */
 	if (ugen_query_dev(dv)) {
 		ugen_write_file(bcm2033_md);
 
-		usleep(100);
-
 		if (write(bulk, "#", 1) < 1)
 			errx(EXIT_FAILURE, "%s: write `#' failed", dv);
 
-		if (read(intr, buf, sizeof(buf)) < 1)
-			errx(EXIT_FAILURE, "%s: read `#' failed", dv);
-
-		if (buf[0] != '#')
+		if (ugen_read_intr(dv, "#") != '#')
 			errx(EXIT_FAILURE, "%s: memory select failed", dv);
 
 		ugen_write_file(bcm2033_fw);
-		usleep(250);
-
-		if (read(intr, buf, sizeof(buf)) < 1)
-			err(EXIT_FAILURE, "%s: read `.' failed", dv);
 
-		if (buf[0] != '.')
+		if (ugen_read_intr(dv, ".") != '.')
 			errx(EXIT_FAILURE, "%s: firmware load failed", dv);
 
 		printf("%s: loaded\n", dv);
@@ -0,0 +1,400 @@
+/*-
+ * Copyright (c) 2016 Iain Hibbert
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Update many devices at once. A small pool of threads takes the devices
+ * in turn, and each runs the whole probe, load and download for its
+ * device through a session, so that the round trips to one controller
+ * overlap with those to others.
+ *
+ * Downloads can be limited to a number at a time for each USB bus, so
+ * that the devices behind one host controller do not have to share its
+ * bandwidth too thinly. The bus of each device is found by walking the
+ * autoconfiguration tree with drvctl(4), and a device that is not on a
+ * USB bus, or when that can not be done, is a bus of its own.
+ *
+ * When more than one device is updated at once, the verbose output for
+ * each is held until it is done and then shown all together, so that it
+ * reads as it would if the devices were updated one after another.
+ */
+
+#include <sys/types.h>
+#include <sys/drvctlio.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+
+#include <ctype.h>
+#include <err.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <util.h>
+
+#include "bcmfw.h"
+#include "btdev.h"
+
+#define DRVCTLDEV	"/dev/drvctl"
+
+struct job {
+	char		name[HCI_DEVNAME_SIZE];
+	size_t		bus;		/* index in bus table */
+	bool		ok;
+	unsigned int	time;		/* ms spent, not counting waits */
+};
+
+struct bus {
+	char		name[HCI_DEVNAME_SIZE];
+	unsigned int	active;		/* downloads now */
+};
+
+struct engine {
+	const struct btdev_transport *tp;
+	pthread_mutex_t	lock;
+	pthread_cond_t	idle;		/* a download is done */
+	struct job *	job;
+	size_t		njob;
+	size_t		next;		/* job to start next */
+	struct bus *	bus;
+	size_t		nbus;
+	unsigned int	perbus;		/* downloads at once, or 0 */
+	bool		hold;		/* hold output until done */
+};
+
+static const char *const reason[] = {
+	[BTDEV_NOT_BROADCOM] =		"Manufacturer is not Broadcom",
+	[BTDEV_NOT_BROADCOM_USB] =	"VendorID is not Broadcom",
+	[BTDEV_NOT_AVAILABLE] =		"Firmware updating not available",
+	[BTDEV_NOT_REQUIRED] =		"Firmware update is not required",
+	[BTDEV_NOT_FOUND] =		"Firmware not found",
+	[BTDEV_ENABLED] =		"Not updating (previously enabled)",
+};
+
+static unsigned int
+elapsed(const struct timespec *start)
+{
+	struct timespec now, ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, start, &ts);
+	return (unsigned int)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/*
+ * Look for the device below the parent, noting the closest USB bus on
+ * the way down.
+ */
+static bool
+bus_search(int fd, const char *dev, const char *parent, const char *usb,
+    char *bus)
+{
+	struct devlistargs l;
+	char (*child)[16];
+	const char *u;
+	size_t i, n;
+	bool found;
+
+	memset(&l, 0, sizeof(l));
+	snprintf(l.l_devname, sizeof(l.l_devname), "%s", parent);
+	if (ioctl(fd, DRVLISTDEV, &l) == -1 || l.l_children == 0)
+		return false;
+
+	n = l.l_children;
+	child = ecalloc(n, sizeof(*child));
+	l.l_childname = child;
+	if (ioctl(fd, DRVLISTDEV, &l) == -1) {
+		free(child);
+		return false;
+	}
+
+	n = MIN(n, l.l_children);
+	found = false;
+	for (i = 0; i < n && !found; i++) {
+		u = usb;
+		if (strncmp(child[i], "usb", 3) == 0
+		    && isdigit((unsigned char)child[i][3]))
+			u = child[i];
+
+		if (strcmp(child[i], dev) == 0) {
+			snprintf(bus, HCI_DEVNAME_SIZE, "%s",
+			    (u != NULL ? u : dev));
+			found = true;
+		} else {
+			found = bus_search(fd, dev, child[i], u, bus);
+		}
+	}
+
+	free(child);
+	return found;
+}
+
+/*
+ * Give each device the index of its bus, adding buses as they are
+ * found.
+ */
+static void
+bus_find(struct engine *e)
+{
+	char name[HCI_DEVNAME_SIZE];
+	size_t i, j;
+	int fd;
+
+	fd = open(DRVCTLDEV, O_RDONLY);
+	e->bus = ecalloc(e->njob, sizeof(struct bus));
+	e->nbus = 0;
+
+	for (i = 0; i < e->njob; i++) {
+		if (fd == -1 || !bus_search(fd, e->job[i].name, "", NULL, name))
+			snprintf(name, sizeof(name), "%s", e->job[i].name);
+
+		for (j = 0; j < e->nbus; j++) {
+			if (strcmp(e->bus[j].name, name) == 0)
+				break;
+		}
+
+		if (j == e->nbus) {
+			snprintf(e->bus[j].name, sizeof(e->bus[j].name),
+			    "%s", name);
+			e->nbus++;
+		}
+
+		e->job[i].bus = j;
+	}
+
+	if (fd != -1)
+		close(fd);
+}
+
+/*
+ * Wait until the bus can take another download. Returns the time that
+ * was spent waiting, in ms.
+ */
+static unsigned int
+bus_acquire(struct engine *e, struct bus *b)
+{
+	struct timespec start;
+
+	if (e->perbus == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	pthread_mutex_lock(&e->lock);
+	while (b->active >= e->perbus)
+		pthread_cond_wait(&e->idle, &e->lock);
+
+	b->active++;
+	pthread_mutex_unlock(&e->lock);
+
+	return elapsed(&start);
+}
+
+static void
+bus_release(struct engine *e, struct bus *b)
+{
+
+	if (e->perbus == 0)
+		return;
+
+	pthread_mutex_lock(&e->lock);
+	b->active--;
+	pthread_cond_broadcast(&e->idle);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * Update one device, if it needs it.
+ */
+static void
+update_one(struct engine *e, struct job *j)
+{
+	struct timespec start;
+	struct btdev d;
+	FILE *log;
+	char *buf;
+	size_t size;
+	unsigned int wait;
+	int rv;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	wait = 0;
+
+	buf = NULL;
+	size = 0;
+	log = (e->hold ? open_memstream(&buf, &size) : NULL);
+
+	rv = btdev_open(&d, e->tp, j->name);
+	if (rv == 0) {
+		if (log != NULL)
+			d.log = log;
+
+		rv = btdev_probe(&d);
+		if (rv == BTDEV_UPDATE) {
+			wait = bus_acquire(e, &e->bus[j->bus]);
+
+			if (verbose > 0) {
+				fprintf(d.log, "Updating ...");
+				fflush(d.log);
+			}
+
+			rv = btdev_update(&d);
+			bus_release(e, &e->bus[j->bus]);
+
+			if (verbose > 0 && rv == 0) {
+				fprintf(d.log, " done\n");
+				fprintf(d.log, "  %zu records, %zu Write RAM"
+				    " commands", d.firmware->nrec, d.ncmd);
+				if (d.hci.resent > 0)
+					fprintf(d.log, ", %u sent again",
+					    d.hci.resent);
+				fprintf(d.log, "\n");
+				fprintf(d.log, "  Round trip %d us,"
+				    " timeout %d ms\n", d.hci.srtt, d.hci.rto);
+				fprintf(d.log, "  Ready after %u ms,"
+				    " HCI rev 0x%04x\n", d.readytime,
+				    d.revision);
+				fprintf(d.log, "\n");
+			} else if (verbose > 0) {
+				fprintf(d.log, " failed\n");
+			}
+		} else if (rv > 0 && verbose > 0) {
+			fprintf(d.log, "%s: %s%s\n", j->name, reason[rv],
+			    (d.known ? " (cached)" : ""));
+		}
+	}
+
+	if (log != NULL)
+		fclose(log);
+
+	pthread_mutex_lock(&e->lock);
+	if (buf != NULL) {
+		fwrite(buf, 1, size, stdout);
+		fflush(stdout);
+	}
+
+	if (rv == -1)
+		warnx("%s: %s", j->name, btdev_error(&d));
+	pthread_mutex_unlock(&e->lock);
+
+	btdev_close(&d);
+
+	free(buf);
+
+	j->ok = (rv != -1);
+	j->time = elapsed(&start) - wait;
+}
+
+static void *
+update_worker(void *arg)
+{
+	struct engine *e = arg;
+	struct job *j;
+
+	for (;;) {
+		pthread_mutex_lock(&e->lock);
+		j = (e->next < e->njob ? &e->job[e->next++] : NULL);
+		pthread_mutex_unlock(&e->lock);
+
+		if (j == NULL)
+			return NULL;
+
+		update_one(e, j);
+	}
+}
+
+/*
+ * Update the named devices, reached through the transport, with up to
+ * 'jobs' at once (or all of them if 0) and up to 'perbus' downloads at
+ * once on each bus (or any number if 0). The wall clock time and the
+ * time that the devices took between them, which is how long they would
+ * have taken one after another, are returned in ms. Returns false if any
+ * device could not be updated.
+ */
+bool
+update_devices(const struct btdev_transport *tp,
+    const char (*name)[HCI_DEVNAME_SIZE], size_t n, unsigned int jobs,
+    unsigned int perbus, unsigned int *wall, unsigned int *serial)
+{
+	struct timespec start;
+	struct engine e;
+	pthread_t *tid;
+	size_t i, nthread;
+	bool ok;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	memset(&e, 0, sizeof(e));
+	e.tp = tp;
+	pthread_mutex_init(&e.lock, NULL);
+	pthread_cond_init(&e.idle, NULL);
+	e.perbus = perbus;
+	e.njob = n;
+	e.job = ecalloc(MAX(n, 1), sizeof(struct job));
+	for (i = 0; i < n; i++)
+		snprintf(e.job[i].name, sizeof(e.job[i].name), "%s", name[i]);
+
+	if (perbus > 0)
+		bus_find(&e);
+
+	nthread = (jobs == 0 ? n : MIN(jobs, n));
+	tid = ecalloc(MAX(nthread, 1), sizeof(pthread_t));
+	e.hold = (nthread > 1);
+
+	/* this thread is one of the workers */
+	for (i = 1; i < nthread; i++) {
+		if (pthread_create(&tid[i], NULL, update_worker, &e) != 0) {
+			warnx("cannot start thread");
+			break;
+		}
+	}
+
+	nthread = i;
+	update_worker(&e);
+
+	for (i = 1; i < nthread; i++)
+		pthread_join(tid[i], NULL);
+
+	ok = true;
+	*serial = 0;
+	for (i = 0; i < n; i++) {
+		if (!e.job[i].ok)
+			ok = false;
+
+		*serial += e.job[i].time;
+	}
+
+	*wall = elapsed(&start);
+
+	free(tid);
+	free(e.bus);
+	free(e.job);
+	pthread_cond_destroy(&e.idle);
+	pthread_mutex_destroy(&e.lock);
+
+	return ok;
+}